@@ -0,0 +1,462 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include "batchmode.h"
+
+/* JSON helpers: just enough JSON for flat request objects */
+
+static void skip_space(const std::string& s, size_t& pos) {
+    while(pos < s.size() && (s[pos] == ' ' || s[pos] == '\t' || s[pos] == '\r' || s[pos] == '\n')) {
+        pos++;
+    }
+}
+
+static void append_utf8(std::string& out, unsigned long cp) {
+    if(cp < 0x80) {
+        out += static_cast<char>(cp);
+    } else if(cp < 0x800) {
+        out += static_cast<char>(0xC0 | (cp >> 6));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if(cp < 0x10000) {
+        out += static_cast<char>(0xE0 | (cp >> 12));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | (cp >> 18));
+        out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+static unsigned long parse_hex4(const std::string& s, size_t& pos) {
+    if(pos + 4 > s.size()) {
+        throw std::runtime_error("truncated \\u escape");
+    }
+    unsigned long value = 0;
+    for(size_t i = 0; i < 4; i++) {
+        char c = s[pos++];
+        value <<= 4;
+        if(c >= '0' && c <= '9') value |= c - '0';
+        else if(c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+        else if(c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+        else throw std::runtime_error("invalid \\u escape");
+    }
+    return value;
+}
+
+static std::string parse_string(const std::string& s, size_t& pos) {
+    // pos is at the opening quote; leaves pos just past the closing quote
+    std::string result;
+    pos++;
+    while(pos < s.size() && s[pos] != '"') {
+        char c = s[pos++];
+        if(static_cast<unsigned char>(c) < 0x20) {
+            // must be escaped, or the string couldn't be echoed back as it is
+            throw std::runtime_error("control character in string");
+        }
+        if(c != '\\') {
+            result += c;
+            continue;
+        }
+        if(pos >= s.size()) {
+            break;
+        }
+        char escaped = s[pos++];
+        switch(escaped) {
+            case '"': result += '"'; break;
+            case '\\': result += '\\'; break;
+            case '/': result += '/'; break;
+            case 'b': result += '\b'; break;
+            case 'f': result += '\f'; break;
+            case 'n': result += '\n'; break;
+            case 'r': result += '\r'; break;
+            case 't': result += '\t'; break;
+            case 'u': {
+                unsigned long cp = parse_hex4(s, pos);
+                // characters outside the BMP arrive as a surrogate pair; half
+                // of one on its own isn't a character
+                if(cp >= 0xDC00 && cp < 0xE000) {
+                    throw std::runtime_error("unpaired surrogate in string");
+                }
+                if(cp >= 0xD800 && cp < 0xDC00) {
+                    if(pos + 1 >= s.size() || s[pos] != '\\' || s[pos + 1] != 'u') {
+                        throw std::runtime_error("unpaired surrogate in string");
+                    }
+                    pos += 2;
+                    unsigned long low = parse_hex4(s, pos);
+                    if(low < 0xDC00 || low >= 0xE000) {
+                        throw std::runtime_error("unpaired surrogate in string");
+                    }
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                }
+                append_utf8(result, cp);
+                break;
+            }
+            default:
+                throw std::runtime_error("invalid escape in string");
+        }
+    }
+    if(pos >= s.size()) {
+        throw std::runtime_error("unterminated string");
+    }
+    pos++;
+    return result;
+}
+
+static bool is_json_number(const std::string& text) {
+    // -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+    size_t pos = 0;
+    auto digits = [&]() {
+        size_t start = pos;
+        while(pos < text.size() && text[pos] >= '0' && text[pos] <= '9') {
+            pos++;
+        }
+        return pos - start;
+    };
+    if(pos < text.size() && text[pos] == '-') {
+        pos++;
+    }
+    size_t start = pos;
+    size_t whole = digits();
+    if(whole == 0 || (whole > 1 && text[start] == '0')) {
+        return false;
+    }
+    if(pos < text.size() && text[pos] == '.') {
+        pos++;
+        if(digits() == 0) {
+            return false;
+        }
+    }
+    if(pos < text.size() && (text[pos] == 'e' || text[pos] == 'E')) {
+        pos++;
+        if(pos < text.size() && (text[pos] == '+' || text[pos] == '-')) {
+            pos++;
+        }
+        if(digits() == 0) {
+            return false;
+        }
+    }
+    return pos == text.size();
+}
+
+static std::string parse_scalar(const std::string& s, size_t& pos) {
+    // a number, true, false or null, returned as its JSON text. Anything
+    // else is rejected here, since the text may be echoed into a result.
+    size_t start = pos;
+    while(pos < s.size() && s[pos] != ',' && s[pos] != '}' && s[pos] != ' ' && s[pos] != '\t' && s[pos] != '\r') {
+        pos++;
+    }
+    if(pos == start) {
+        throw std::runtime_error("missing value");
+    }
+    std::string text = s.substr(start, pos - start);
+    if(text != "true" && text != "false" && text != "null" && !is_json_number(text)) {
+        throw std::runtime_error("invalid value");
+    }
+    return text;
+}
+
+std::string json_quote(const std::string& str) {
+    // str as a JSON string literal
+    return "\"" + json_escape(str) + "\"";
+}
+
+static size_t utf8_length(const std::string& str, size_t pos) {
+    // the length of the UTF-8 sequence starting at pos, or 0 if it isn't a
+    // valid one (overlong, a surrogate, past U+10FFFF or cut short)
+    unsigned char c = str[pos];
+    size_t length;
+    unsigned long cp;
+    unsigned long min;
+    if(c < 0x80) {
+        return 1;
+    } else if((c & 0xE0) == 0xC0) {
+        length = 2;
+        cp = c & 0x1F;
+        min = 0x80;
+    } else if((c & 0xF0) == 0xE0) {
+        length = 3;
+        cp = c & 0x0F;
+        min = 0x800;
+    } else if((c & 0xF8) == 0xF0) {
+        length = 4;
+        cp = c & 0x07;
+        min = 0x10000;
+    } else {
+        return 0;
+    }
+    if(pos + length > str.size()) {
+        return 0;
+    }
+    for(size_t i = 1; i < length; i++) {
+        unsigned char next = str[pos + i];
+        if((next & 0xC0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (next & 0x3F);
+    }
+    if(cp < min || cp > 0x10FFFF || (cp >= 0xD800 && cp < 0xE000)) {
+        return 0;
+    }
+    return length;
+}
+
+bool is_utf8(const std::string& str) {
+    for(size_t i = 0; i < str.size();) {
+        size_t length = utf8_length(str, i);
+        if(length == 0) {
+            return false;
+        }
+        i += length;
+    }
+    return true;
+}
+
+std::string json_escape(const std::string& str) {
+    // bytes that aren't valid UTF-8 become U+FFFD, so the result is always
+    // valid JSON; contents that have to survive intact go through json_bytes
+    std::string result;
+    result.reserve(str.size());
+    for(size_t i = 0; i < str.size();) {
+        unsigned char c = str[i];
+        size_t length = utf8_length(str, i);
+        switch(c) {
+            case '"': result += "\\\""; break;
+            case '\\': result += "\\\\"; break;
+            case '\n': result += "\\n"; break;
+            case '\r': result += "\\r"; break;
+            case '\t': result += "\\t"; break;
+            default:
+                if(length == 0) {
+                    result += "\\ufffd";
+                    length = 1;
+                } else if(c < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    result += escaped;
+                } else {
+                    result.append(str, i, length);
+                }
+        }
+        i += length;
+    }
+    return result;
+}
+
+static const char BASE64_DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string base64_encode(const std::string& bytes) {
+    std::string result;
+    result.reserve((bytes.size() + 2) / 3 * 4);
+    size_t i = 0;
+    for(; i + 3 <= bytes.size(); i += 3) {
+        unsigned long group = (static_cast<unsigned long>(static_cast<unsigned char>(bytes[i])) << 16)
+                              | (static_cast<unsigned char>(bytes[i + 1]) << 8) | static_cast<unsigned char>(bytes[i + 2]);
+        for(int shift = 18; shift >= 0; shift -= 6) {
+            result += BASE64_DIGITS[(group >> shift) & 0x3F];
+        }
+    }
+    if(i < bytes.size()) {
+        unsigned long group = static_cast<unsigned long>(static_cast<unsigned char>(bytes[i])) << 16;
+        if(i + 1 < bytes.size()) {
+            group |= static_cast<unsigned char>(bytes[i + 1]) << 8;
+        }
+        result += BASE64_DIGITS[(group >> 18) & 0x3F];
+        result += BASE64_DIGITS[(group >> 12) & 0x3F];
+        result += (i + 1 < bytes.size()) ? BASE64_DIGITS[(group >> 6) & 0x3F] : '=';
+        result += '=';
+    }
+    return result;
+}
+
+std::string base64_decode(const std::string& text) {
+    if(text.size() % 4 != 0) {
+        throw std::runtime_error("invalid base64");
+    }
+    std::string result;
+    result.reserve(text.size() / 4 * 3);
+    for(size_t i = 0; i < text.size(); i += 4) {
+        unsigned long group = 0;
+        size_t padding = 0;
+        for(size_t j = 0; j < 4; j++) {
+            char c = text[i + j];
+            const char* digit = (c == '\0') ? NULL : std::strchr(BASE64_DIGITS, c);
+            if(c == '=' && i + 4 == text.size() && j >= 2) {
+                padding++;
+            } else if(digit == NULL || padding > 0) {
+                throw std::runtime_error("invalid base64");
+            }
+            group = (group << 6) | (digit == NULL ? 0 : digit - BASE64_DIGITS);
+        }
+        result += static_cast<char>(group >> 16);
+        if(padding < 2) {
+            result += static_cast<char>((group >> 8) & 0xFF);
+        }
+        if(padding < 1) {
+            result += static_cast<char>(group & 0xFF);
+        }
+    }
+    return result;
+}
+
+std::string json_bytes(const std::string& member, const std::string& bytes) {
+    return is_utf8(bytes) ? json_quote(member) + ": " + json_quote(bytes)
+                          : json_quote(member + "_b64") + ": \"" + base64_encode(bytes) + "\"";
+}
+
+const std::string& JSONObject::get(const std::string& member) const {
+    auto found = strings.find(member);
+    if(found == strings.end()) {
+        throw std::runtime_error("no string \"" + member + "\"");
+    }
+    return found->second;
+}
+
+std::string JSONObject::get_bytes(const std::string& member) const {
+    auto encoded = strings.find(member + "_b64");
+    return (encoded == strings.end()) ? get(member) : base64_decode(encoded->second);
+}
+
+JSONObject parse_json_object(const std::string& line) {
+    JSONObject object;
+    size_t pos = 0;
+    skip_space(line, pos);
+    if(pos >= line.size() || line[pos] != '{') {
+        throw std::runtime_error("not a JSON object");
+    }
+    pos++;
+    skip_space(line, pos);
+    bool first = true;
+    while(pos < line.size() && line[pos] != '}') {
+        if(!first) {
+            if(line[pos] != ',') {
+                throw std::runtime_error("expected ','");
+            }
+            pos++;
+            skip_space(line, pos);
+        }
+        first = false;
+        if(pos >= line.size() || line[pos] != '"') {
+            throw std::runtime_error("expected a member name");
+        }
+        std::string member = parse_string(line, pos);
+        skip_space(line, pos);
+        if(pos >= line.size() || line[pos] != ':') {
+            throw std::runtime_error("expected ':'");
+        }
+        pos++;
+        skip_space(line, pos);
+        size_t start = pos;
+        if(pos < line.size() && line[pos] == '"') {
+            object.strings[member] = parse_string(line, pos);
+        } else {
+            parse_scalar(line, pos);
+        }
+        object.json[member] = line.substr(start, pos - start);
+        skip_space(line, pos);
+    }
+    if(pos >= line.size()) {
+        throw std::runtime_error("unterminated object");
+    }
+    pos++;
+    skip_space(line, pos);
+    if(pos != line.size()) {
+        throw std::runtime_error("trailing characters after object");
+    }
+    return object;
+}
+
+static std::string run_request(AuthenticatedDBUser& user, const JSONObject& request) {
+    // perform one request; returns the members to add to a successful result
+    const std::string& op = request.get("op");
+    if(op == "read") {
+        return ", " + json_bytes("value", user.retrieve_record(request.get("name")));
+    } else if(op == "write") {
+        std::vector<RecordResult> written = user.write_records(
+            RecordList({std::make_pair(request.get("name"), request.get_bytes("value"))}));
+        if(!written[0].ok) {
+            throw std::runtime_error(written[0].error);
+        }
+        return "";
+    } else if(op == "delete") {
+        user.delete_record(request.get("name"));
+        return "";
+    } else if(op == "list") {
+        std::string names = ", \"names\": [";
+        std::string separator = "";
+        user.for_each_record_name([&](const std::string& name) {
+            names += separator + json_quote(name);
+            separator = ", ";
+        });
+        return names + "]";
+    }
+    throw std::runtime_error("unknown op \"" + op + "\"");
+}
+
+BatchStats run_batch_mode(AuthenticatedDBUser& user, std::istream& in, std::ostream& out) {
+    /*
+    * Run every request read from in, writing results to out.
+    * @returns counts and timings for the whole stream
+    */
+    BatchStats stats = {0, 0, 0, 0, 0};
+    auto begin = std::chrono::steady_clock::now();
+    std::string buffer;
+    std::string line;
+    while(std::getline(in, line)) {
+        if(line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        std::string result = "{";
+        try {
+            JSONObject request = parse_json_object(line);
+            auto id = request.json.find("id");
+            if(id != request.json.end()) {
+                result += "\"id\": " + id->second + ", ";
+            }
+            try {
+                result += "\"ok\": true" + run_request(user, request);
+            } catch(std::exception& e) {
+                result += "\"ok\": false, \"error\": " + json_quote(e.what());
+                stats.failures++;
+            }
+        } catch(std::exception& e) {
+            result += "\"ok\": false, \"error\": " + json_quote(std::string("invalid request: ") + e.what());
+            stats.failures++;
+        }
+        buffer += result + "}\n";
+        std::chrono::duration<double> latency = std::chrono::steady_clock::now() - start;
+        stats.requests++;
+        stats.total_latency += latency.count();
+        if(latency.count() > stats.max_latency) {
+            stats.max_latency = latency.count();
+        }
+
+        if(buffer.size() >= BATCH_OUTPUT_BLOCK) {
+            out.write(buffer.data(), buffer.size());
+            buffer.clear();
+        }
+    }
+    out.write(buffer.data(), buffer.size());
+    out.flush();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - begin;
+    stats.seconds = elapsed.count();
+    return stats;
+}
+
+std::string describe_batch_stats(const BatchStats& stats) {
+    std::ostringstream summary;
+    summary << std::fixed << std::setprecision(3)
+            << stats.requests << " requests (" << stats.failures << " failed) in " << stats.seconds << " s";
+    if(stats.requests > 0) {
+        summary << ": " << std::setprecision(0) << (stats.seconds > 0 ? stats.requests / stats.seconds : 0)
+                << " requests/s, latency mean " << std::setprecision(3)
+                << stats.total_latency / stats.requests * 1000 << " ms, max " << stats.max_latency * 1000 << " ms";
+    }
+    return summary.str();
+}
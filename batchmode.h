@@ -0,0 +1,61 @@
+#include <iostream>
+#include <string>
+#include <map>
+#include "dbmanager.h"
+
+#ifndef __BATCHMODE_H
+#define __BATCHMODE_H
+
+/*
+* Batch mode: runs a stream of requests for one signed-in user, given as
+* JSON Lines (one JSON object per line), and writes one JSON result line per
+* request, in order. Requests:
+*   {"op": "read", "name": NAME}
+*   {"op": "write", "name": NAME, "value": CONTENT}
+*   {"op": "delete", "name": NAME}
+*   {"op": "list"}
+* Results are {"ok": true} plus "value" for reads and "names" for lists, or
+* {"ok": false, "error": MESSAGE}. A value that isn't valid UTF-8, such as
+* a binary file's, is given as "value_b64" instead, in base64, and a write
+* may give its value that way too. A request's "id", if it has one, is copied
+* into its result. Blank lines are skipped; a line that can't be parsed gets
+* an error result and the rest of the stream carries on.
+*/
+
+// A flat JSON object as read from one line: each member's value if it is a
+// string, and every member's JSON text, so that an id can be echoed back
+// exactly as it was given. Nested objects and arrays are not supported.
+struct JSONObject {
+    std::map<std::string, std::string> strings;
+    std::map<std::string, std::string> json;
+
+    const std::string& get(const std::string& member) const; // throws if absent
+    // member, or member + "_b64" decoded from base64 if the object has that
+    std::string get_bytes(const std::string& member) const;
+};
+
+JSONObject parse_json_object(const std::string& line);
+std::string json_quote(const std::string& str);
+std::string json_escape(const std::string& str); // the same, without the quotes
+bool is_utf8(const std::string& str);
+std::string base64_encode(const std::string& bytes);
+std::string base64_decode(const std::string& text); // throws if text isn't base64
+// "member": bytes as a JSON member, or "member_b64" in base64 if bytes isn't
+// valid UTF-8, so that any contents come out as valid JSON and intact
+std::string json_bytes(const std::string& member, const std::string& bytes);
+
+// Results are written out in blocks of about this many bytes, not per line
+const size_t BATCH_OUTPUT_BLOCK = 64 * 1024;
+
+struct BatchStats {
+    size_t requests;
+    size_t failures;
+    double seconds; // wall time for the whole stream
+    double total_latency; // sum of the time spent on each request
+    double max_latency;
+};
+
+BatchStats run_batch_mode(AuthenticatedDBUser& user, std::istream& in, std::ostream& out);
+std::string describe_batch_stats(const BatchStats& stats);
+
+#endif
@@ -0,0 +1,432 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <unistd.h>
+#include "cryptowrapper.h"
+#include "compression.h"
+#include "dbmanager.h"
+#include "schema.h"
+#include "batchmode.h"
+#include "cryptopp890/osrng.h"
+#include "cryptopp890/aes.h"
+
+/* Microbenchmarks */
+
+// What one benchmark measured. Latencies are of a single run of its op, in
+// microseconds.
+struct BenchResult {
+    std::string name;
+    size_t iterations;
+    size_t bytes_per_op;
+    double ops_per_sec;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+
+std::vector<BenchResult> results;
+std::string filter; // only benchmarks whose names contain this are run
+
+bool selected(const std::string& name);
+
+// Run op the given number of times, timing each run, and print its
+// throughput and latency percentiles.
+// bytesPerOp is the payload size handled by one run of op, or 0 if a
+// throughput in bytes is not meaningful for it.
+void runBenchmark(const std::string& name, size_t iterations, size_t bytesPerOp, const std::function<void()>& op);
+
+std::string resultJSON(const BenchResult& result);
+int compareWithBaseline(const std::string& filename, double tolerance);
+
+void benchRandomGeneration();
+void benchEncryption(size_t payloadSize);
+void benchNameDecryption(size_t names);
+void benchCompression(const std::string& kind, const std::string& payload);
+void benchPrimitives(size_t payloadSize);
+void benchKeyDerivation();
+void benchRecords(size_t records);
+
+int usage() {
+    std::cerr << "Usage: bench [--filter TEXT] [--json FILE] [--baseline FILE [--tolerance PERCENT]]\n";
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    /*
+    * Run every benchmark, or those whose names contain TEXT. --json writes
+    * each result to FILE as a line of JSON; --baseline compares this run
+    * with such a file from an earlier run, and fails if any benchmark's
+    * throughput dropped by more than the tolerance (10% by default).
+    */
+    std::string json_file;
+    std::string baseline_file;
+    double tolerance = 10;
+    for(int i = 1; i < argc; i++) {
+        if(std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else if(std::strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_file = argv[++i];
+        } else if(std::strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_file = argv[++i];
+        } else if(std::strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            tolerance = std::atof(argv[++i]);
+        } else {
+            return usage();
+        }
+    }
+
+    std::cout << "Running benchmarks...\n";
+    benchPrimitives(16);
+    benchPrimitives(1024);
+    benchPrimitives(64 * 1024);
+    benchKeyDerivation();
+    benchRandomGeneration();
+    benchEncryption(64);
+    benchEncryption(4096);
+    benchNameDecryption(500);
+
+    // representative record contents: log-style text, and binary data
+    // (random bytes, as for already compressed or encrypted files)
+    std::string text;
+    for(size_t i = 0; text.size() < 64 * 1024; i++) {
+        text += "2024-05-0" + std::to_string(1 + i % 9) + " 12:" + std::to_string(10 + i % 50)
+              + " INFO request " + std::to_string(i * 7919 % 100000) + " served in " + std::to_string(i % 97) + "ms\n";
+    }
+    benchCompression("text", text);
+    benchCompression("binary", crypto::_impl_details::bytes_to_string(crypto::random_block(64 * 1024)));
+
+    benchRecords(10);
+    benchRecords(1000);
+    benchRecords(100000);
+
+    if(!json_file.empty()) {
+        std::ofstream out(json_file);
+        for(size_t i = 0; i < results.size(); i++) {
+            out << resultJSON(results[i]) << '\n';
+        }
+        if(!out) {
+            std::cerr << "Could not write '" << json_file << "'\n";
+            return 1;
+        }
+    }
+    if(!baseline_file.empty()) {
+        return compareWithBaseline(baseline_file, tolerance);
+    }
+    std::cout << "Done!\n";
+    return 0;
+}
+
+bool selected(const std::string& name) {
+    return filter.empty() || name.find(filter) != std::string::npos;
+}
+
+static double percentile(const std::vector<double>& sorted, double p) {
+    // nearest rank: the smallest sample that p% of the samples are at most
+    size_t rank = static_cast<size_t>(p / 100 * sorted.size() + 0.999999);
+    return sorted[std::min(std::max<size_t>(rank, 1), sorted.size()) - 1];
+}
+
+void runBenchmark(const std::string& name, size_t iterations, size_t bytesPerOp, const std::function<void()>& op) {
+    if(!selected(name) || iterations == 0) {
+        return;
+    }
+    std::vector<double> latencies(iterations);
+    auto start = std::chrono::steady_clock::now();
+    auto last = start;
+    for(size_t i = 0; i < iterations; i++) {
+        op();
+        auto now = std::chrono::steady_clock::now();
+        latencies[i] = std::chrono::duration<double, std::micro>(now - last).count();
+        last = now;
+    }
+    std::chrono::duration<double> elapsed = last - start;
+    std::sort(latencies.begin(), latencies.end());
+
+    BenchResult result;
+    result.name = name;
+    result.iterations = iterations;
+    result.bytes_per_op = bytesPerOp;
+    result.ops_per_sec = iterations / elapsed.count();
+    result.p50 = percentile(latencies, 50);
+    result.p90 = percentile(latencies, 90);
+    result.p99 = percentile(latencies, 99);
+    result.max = latencies.back();
+    results.push_back(result);
+
+    std::cout << std::left << std::setw(48) << name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(12) << result.ops_per_sec << " ops/s";
+    if(bytesPerOp > 0) {
+        std::cout << std::setprecision(2) << std::setw(10) << result.ops_per_sec * bytesPerOp / (1024 * 1024) << " MiB/s";
+    } else {
+        std::cout << std::setw(16) << "";
+    }
+    std::cout << std::setprecision(1) << "  p50 " << result.p50 << "us  p99 " << result.p99 << "us\n";
+}
+
+std::string resultJSON(const BenchResult& result) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << "{\"name\": " << json_quote(result.name) << ", \"iterations\": " << result.iterations
+        << ", \"ops_per_sec\": " << result.ops_per_sec;
+    if(result.bytes_per_op > 0) {
+        out << ", \"mib_per_sec\": " << result.ops_per_sec * result.bytes_per_op / (1024 * 1024);
+    }
+    out << ", \"p50_us\": " << result.p50 << ", \"p90_us\": " << result.p90 << ", \"p99_us\": " << result.p99
+        << ", \"max_us\": " << result.max << "}";
+    return out.str();
+}
+
+int compareWithBaseline(const std::string& filename, double tolerance) {
+    /*
+    * Compare each benchmark's throughput with the same benchmark's in the
+    * JSON Lines file filename. Returns 1 if any of them regressed by more
+    * than tolerance percent.
+    */
+    std::ifstream in(filename);
+    if(!in) {
+        std::cerr << "Could not open '" << filename << "'\n";
+        return 1;
+    }
+    std::map<std::string, double> baseline;
+    std::string line;
+    while(std::getline(in, line)) {
+        if(line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        JSONObject result = parse_json_object(line);
+        baseline[result.get("name")] = std::stod(result.json.at("ops_per_sec"));
+    }
+
+    size_t regressions = 0;
+    std::cout << "Compared with '" << filename << "':\n";
+    for(size_t i = 0; i < results.size(); i++) {
+        std::map<std::string, double>::const_iterator found = baseline.find(results[i].name);
+        if(found == baseline.end() || found->second <= 0) {
+            continue;
+        }
+        double change = (results[i].ops_per_sec / found->second - 1) * 100;
+        if(change < -tolerance) {
+            regressions++;
+        }
+        if(change < -tolerance || change > tolerance) {
+            std::cout << std::left << std::setw(48) << results[i].name << std::right << std::fixed << std::setprecision(1)
+                      << std::setw(8) << std::showpos << change << std::noshowpos << "%"
+                      << (change < 0 ? "  REGRESSED" : "") << '\n';
+        }
+    }
+    std::cout << regressions << " of " << results.size() << " benchmarks regressed by more than " << tolerance << "%\n";
+    return regressions > 0 ? 1 : 0;
+}
+
+void benchRandomGeneration() {
+    // IV generation as it was done before: a fresh, freshly seeded pool for
+    // every IV; versus the long-lived per-thread generator
+    CryptoPP::SecByteBlock iv(CryptoPP::AES::BLOCKSIZE);
+    runBenchmark("iv, new AutoSeededRandomPool per call", 2000, 0, [&]() {
+        CryptoPP::AutoSeededRandomPool rgen;
+        rgen.GenerateBlock(iv, iv.size());
+    });
+    runBenchmark("iv, per-thread generator", 200000, 0, [&]() {
+        crypto::_impl_details::random_fill(iv, iv.size());
+    });
+}
+
+void benchEncryption(size_t payloadSize) {
+    // "before" pays for a freshly seeded pool on every encryption, as
+    // aes_cbc_encrypt used to; "after" is crypto::encrypt as it is now
+    std::string payload(payloadSize, 'x');
+    CryptoPP::SecByteBlock key = crypto::random_block(CryptoPP::AES::DEFAULT_KEYLENGTH);
+    std::string label = "encrypt " + std::to_string(payloadSize) + "B";
+
+    runBenchmark(label + ", before (new pool per call)", 2000, payloadSize, [&]() {
+        CryptoPP::SecByteBlock iv(CryptoPP::AES::BLOCKSIZE);
+        CryptoPP::AutoSeededRandomPool rgen;
+        rgen.GenerateBlock(iv, iv.size());
+        crypto::encrypt(payload, key);
+    });
+    runBenchmark(label + ", after (per-thread generator)", 20000, payloadSize, [&]() {
+        crypto::encrypt(payload, key);
+    });
+}
+
+void benchNameDecryption(size_t names) {
+    // listing a user's records decrypts many short names under one key,
+    // each bound to its row: one auth_decrypt per name, versus one
+    // auth_decrypt_batch that puts every name's AES blocks through at once
+    CryptoPP::SecByteBlock key = crypto::random_block(CryptoPP::AES::DEFAULT_KEYLENGTH);
+    std::string user = crypto::raw_hash("bench");
+    std::vector<std::string> cts;
+    std::vector<std::string> contexts;
+    std::vector<crypto::CiphertextView> views;
+    for(size_t i = 0; i < names; i++) {
+        std::string name = "record" + std::to_string(i);
+        contexts.push_back(std::string("Keys.record_name") + '\0' + user + crypto::raw_hash(name));
+        cts.push_back(crypto::auth_encrypt(name, key, contexts.back(), crypto::CIPHER_AES_GCM | crypto::CIPHER_BOUND));
+    }
+    for(size_t i = 0; i < names; i++) {
+        views.push_back(crypto::CiphertextView({cts[i].data(), cts[i].size(), contexts[i]}));
+    }
+    std::string label = "decrypt " + std::to_string(names) + " names";
+
+    runBenchmark(label + ", one call per name", 200, 0, [&]() {
+        for(size_t i = 0; i < names; i++) {
+            crypto::auth_decrypt(cts[i].data(), cts[i].size(), key, contexts[i]);
+        }
+    });
+    runBenchmark(label + ", batched", 200, 0, [&]() {
+        crypto::auth_decrypt_batch(views, key, false);
+    });
+    if(results.size() >= 2 && results[results.size() - 2].name == label + ", one call per name"
+       && results.back().name == label + ", batched") {
+        std::cout << label << ": batched runs " << std::fixed << std::setprecision(1)
+                  << results.back().ops_per_sec / results[results.size() - 2].ops_per_sec << "x as fast\n";
+    }
+}
+
+void benchCompression(const std::string& kind, const std::string& payload) {
+    // what the LZ codec costs and saves on one kind of payload, and what
+    // compressing before encrypting costs next to encrypting alone
+    CryptoPP::SecByteBlock key = crypto::random_block(CryptoPP::AES::DEFAULT_KEYLENGTH);
+    std::string encoded;
+    bool compressed = compression::compress(payload, compression::CODEC_LZ, encoded);
+    std::string label = "lz " + kind + " " + std::to_string(payload.size() / 1024) + "KiB";
+    if(selected(label)) {
+        std::cout << label << ": stored " << (compressed ? encoded.size() : payload.size()) << " of " << payload.size()
+                  << " bytes" << (compressed ? "" : " (left uncompressed)") << '\n';
+    }
+
+    runBenchmark(label + ", compress", 500, payload.size(), [&]() {
+        std::string out;
+        compression::compress(payload, compression::CODEC_LZ, out);
+    });
+    if(compressed) {
+        runBenchmark(label + ", decompress", 500, payload.size(), [&]() {
+            compression::decompress(encoded);
+        });
+    }
+    runBenchmark(label + ", encrypt alone", 500, payload.size(), [&]() {
+        crypto::auth_encrypt(payload, key);
+    });
+    runBenchmark(label + ", compress and encrypt", 500, payload.size(), [&]() {
+        std::string out;
+        if(compression::compress(payload, compression::CODEC_LZ, out)) {
+            crypto::auth_encrypt(out, key, "", crypto::CIPHER_AES_GCM_ENCODED);
+        } else {
+            crypto::auth_encrypt(payload, key);
+        }
+    });
+}
+
+static size_t iterationsFor(size_t payloadSize) {
+    // about 64 MiB of payload, within limits that keep small payloads from
+    // running for too long and large ones from having too few samples
+    return std::min<size_t>(20000, std::max<size_t>(200, 64 * 1024 * 1024 / payloadSize));
+}
+
+void benchPrimitives(size_t payloadSize) {
+    // the building blocks every record operation is made of
+    std::string payload(payloadSize, 'x');
+    CryptoPP::SecByteBlock key = crypto::random_block(CryptoPP::AES::DEFAULT_KEYLENGTH);
+    std::string ct = crypto::encrypt(payload, key);
+    std::string label = std::to_string(payloadSize) + "B";
+    size_t iterations = iterationsFor(payloadSize);
+
+    runBenchmark("hash " + label, iterations, payloadSize, [&]() {
+        crypto::hash(payload);
+    });
+    runBenchmark("encrypt " + label, iterations, payloadSize, [&]() {
+        crypto::encrypt(payload, key);
+    });
+    runBenchmark("decrypt " + label, iterations, payloadSize, [&]() {
+        crypto::decrypt(ct, key);
+    });
+}
+
+void benchKeyDerivation() {
+    // paid once per sign-in
+    std::string uname = crypto::hash("bench");
+    std::string keygenerator = crypto::hash("bench" + std::string("benchpwd"));
+    runBenchmark("master_keygen", 2000, 0, [&]() {
+        crypto::master_keygen(uname, keygenerator);
+    });
+}
+
+void benchRecords(size_t records) {
+    /*
+    * Time each record operation for a user who already has the given
+    * number of records, in a new database of their own that is deleted
+    * afterwards. Each single-record operation is its own transaction, as it
+    * is for securedb.
+    */
+    std::string label = "records " + std::to_string(records) + ", ";
+    const char* operations[] = {"create", "retrieve", "edit", "delete", "list"};
+    bool any = false;
+    for(size_t i = 0; i < sizeof(operations) / sizeof(operations[0]); i++) {
+        any = any || selected(label + operations[i]);
+    }
+    if(!any) {
+        return;
+    }
+
+    const std::string uname = "bench";
+    const std::string pwd = "benchpwd";
+    std::string dbname = "/tmp/securedb-bench-" + std::to_string(getpid()) + ".db";
+    std::string value(100, 'v');
+    {
+        DB db(dbname.c_str());
+        create_schema(db);
+        db.prepared_query("INSERT INTO Users (username, password) VALUES (?, ?)",
+                          ArgumentList({crypto::hash(uname), crypto::hash(crypto::hash(uname + pwd))}));
+    }
+    {
+        AuthenticatedDBUser user(uname, pwd, dbname);
+        std::vector<PreparedRecord> batch;
+        for(size_t i = 0; i < records; i++) {
+            batch.push_back(user.prepare_record("record" + std::to_string(i), value));
+            if(batch.size() == 1000 || i + 1 == records) {
+                user.insert_prepared_records(batch);
+                batch.clear();
+            }
+        }
+
+        // existing records are picked in a fixed pseudorandom order, so
+        // that runs are comparable but lookups don't follow insertion order
+        size_t next = 0;
+        auto existing = [&]() {
+            next = (next * 1103515245 + 12345) % 2147483648u;
+            return "record" + std::to_string(next % records);
+        };
+        size_t created = 0;
+        size_t deleted = 0;
+        size_t writes = std::min<size_t>(500, std::max<size_t>(records, 100));
+        runBenchmark(label + "create", writes, value.size(), [&]() {
+            user.create_record("new" + std::to_string(created++), value);
+        });
+        runBenchmark(label + "retrieve", 2000, value.size(), [&]() {
+            user.retrieve_record(existing());
+        });
+        runBenchmark(label + "edit", writes, value.size(), [&]() {
+            user.edit_record(existing(), value);
+        });
+        runBenchmark(label + "delete", created, 0, [&]() {
+            user.delete_record("new" + std::to_string(deleted++));
+        });
+        runBenchmark(label + "list", std::min<size_t>(200, std::max<size_t>(5, 200000 / records)), 0, [&]() {
+            user.get_record_names();
+        });
+    }
+    std::remove(dbname.c_str());
+    std::remove((dbname + "-wal").c_str());
+    std::remove((dbname + "-shm").c_str());
+}
@@ -0,0 +1,61 @@
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+#ifndef __BOUNDEDQUEUE_H
+#define __BOUNDEDQUEUE_H
+
+/*
+* BoundedQueue: A first-in, first-out queue for handing work between
+* threads. push() waits while the queue is full, so a fast producer is held
+* back to the pace of its consumers rather than buffering without limit;
+* pop() waits while it is empty. Once close() is called, pushes are refused
+* and pops drain whatever is left, then report that the queue is finished.
+*/
+template <class T>
+class BoundedQueue {
+    private:
+        std::mutex lock;
+        std::condition_variable not_full;
+        std::condition_variable not_empty;
+        std::deque<T> items;
+        size_t capacity;
+        bool closed;
+    public:
+        BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+        BoundedQueue(const BoundedQueue&) = delete;
+
+        bool push(T item) {
+            // @returns false, dropping item, if the queue has been closed
+            std::unique_lock<std::mutex> guard(lock);
+            not_full.wait(guard, [this]() { return closed || items.size() < capacity; });
+            if(closed) {
+                return false;
+            }
+            items.push_back(std::move(item));
+            not_empty.notify_one();
+            return true;
+        }
+
+        bool pop(T& item) {
+            // @returns false once the queue is closed and empty
+            std::unique_lock<std::mutex> guard(lock);
+            not_empty.wait(guard, [this]() { return closed || !items.empty(); });
+            if(items.empty()) {
+                return false;
+            }
+            item = std::move(items.front());
+            items.pop_front();
+            not_full.notify_one();
+            return true;
+        }
+
+        void close() {
+            std::lock_guard<std::mutex> guard(lock);
+            closed = true;
+            not_full.notify_all();
+            not_empty.notify_all();
+        }
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+#include "dbmanager.h"
+#include "bulktransfer.h"
+
+std::string get_input_wo_newline() {
+    std::string with_nl;
+    std::getline(std::cin, with_nl);
+    return with_nl;
+}
+
+int usage() {
+    std::cerr << "Usage: bulkdb import|export [--threads N] [--database DATABASE] [FILE]\n";
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    /*
+    * Import records from FILE, or export them to FILE, for the user whose
+    * username and password are the first two lines of stdin. Without FILE,
+    * import reads the rest of stdin and export writes to stdout.
+    */
+    if(argc < 2 || (std::strcmp(argv[1], "import") != 0 && std::strcmp(argv[1], "export") != 0)) {
+        return usage();
+    }
+    bool importing = std::strcmp(argv[1], "import") == 0;
+    size_t threads = std::thread::hardware_concurrency();
+    std::string dbname = "records.db";
+    std::string filename;
+    for(int i = 2; i < argc; i++) {
+        if(std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            threads = std::strtoul(argv[++i], NULL, 10);
+        } else if(std::strcmp(argv[i], "--database") == 0 && i + 1 < argc) {
+            dbname = argv[++i];
+        } else if(filename.empty() && argv[i][0] != '-') {
+            filename = argv[i];
+        } else {
+            return usage();
+        }
+    }
+    if(threads == 0) {
+        threads = 1;
+    }
+
+    std::string uname = get_input_wo_newline();
+    std::string pwd = get_input_wo_newline();
+    AuthenticatedDBUser user;
+    try {
+        user = AuthenticatedDBUser(uname, pwd, dbname);
+    } catch(...) {
+        std::cerr << "Failed to sign in\n";
+        return 1;
+    }
+
+    try {
+        BulkStats stats;
+        if(importing) {
+            std::ifstream file;
+            if(!filename.empty()) {
+                file.open(filename);
+                if(!file) {
+                    std::cerr << "Could not open '" << filename << "'\n";
+                    return 1;
+                }
+            }
+            stats = bulk_import(user, filename.empty() ? std::cin : file, threads, &std::cerr);
+        } else {
+            std::ofstream file;
+            if(!filename.empty()) {
+                file.open(filename);
+                if(!file) {
+                    std::cerr << "Could not open '" << filename << "'\n";
+                    return 1;
+                }
+            }
+            stats = bulk_export(user, filename.empty() ? std::cout : file, threads, &std::cerr);
+        }
+        if(stats.failures > 0) {
+            std::cerr << stats.failures << " records skipped\n";
+        }
+    } catch(std::exception& e) {
+        std::cerr << "Error: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
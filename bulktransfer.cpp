@@ -0,0 +1,377 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <map>
+#include <thread>
+#include <vector>
+#include "bulktransfer.h"
+#include "batchmode.h"
+#include "boundedqueue.h"
+
+// Thrown through a producer to stop it once the pipeline has been aborted
+struct PipelineStopped {};
+
+template <class In, class Out>
+static void run_pipeline(size_t threads,
+                         const std::function<void(const std::function<void(In&&)>&)>& produce,
+                         const std::function<void(In&, Out&)>& work,
+                         const std::function<void(Out&)>& consume) {
+    /*
+    * Run produce on a reader thread, handing each chunk it emits to one of
+    * threads workers, and consume the workers' results on this thread in
+    * the order the chunks were emitted. The first exception thrown by any
+    * stage stops the whole pipeline and is rethrown here.
+    */
+    if(threads == 0) {
+        threads = 1;
+    }
+    typedef std::pair<size_t, In> InChunk;
+    typedef std::pair<size_t, Out> OutChunk;
+    BoundedQueue<InChunk> inputs(2 * threads);
+    BoundedQueue<OutChunk> outputs(2 * threads);
+    // a chunk takes a slot when it is read and frees it once consumed, which
+    // also bounds the chunks held back waiting for an earlier one
+    const size_t in_flight = 4 * threads;
+    BoundedQueue<bool> slots(in_flight);
+    for(size_t i = 0; i < in_flight; i++) {
+        slots.push(true);
+    }
+
+    std::mutex error_lock;
+    std::exception_ptr error;
+    auto fail = [&]() {
+        {
+            std::lock_guard<std::mutex> guard(error_lock);
+            if(!error) {
+                error = std::current_exception();
+            }
+        }
+        inputs.close();
+        outputs.close();
+        slots.close();
+    };
+
+    std::thread reader([&]() {
+        size_t seq = 0;
+        try {
+            produce([&](In&& chunk) {
+                bool slot;
+                if(!slots.pop(slot) || !inputs.push(InChunk(seq++, std::move(chunk)))) {
+                    throw PipelineStopped();
+                }
+            });
+        } catch(PipelineStopped&) {
+        } catch(...) {
+            fail();
+        }
+        inputs.close();
+    });
+
+    std::atomic<size_t> working(threads);
+    std::vector<std::thread> workers;
+    for(size_t i = 0; i < threads; i++) {
+        workers.push_back(std::thread([&]() {
+            try {
+                InChunk chunk;
+                while(inputs.pop(chunk)) {
+                    OutChunk done;
+                    done.first = chunk.first;
+                    work(chunk.second, done.second);
+                    if(!outputs.push(std::move(done))) {
+                        break;
+                    }
+                }
+            } catch(...) {
+                fail();
+            }
+            if(--working == 0) {
+                outputs.close();
+            }
+        }));
+    }
+
+    try {
+        std::map<size_t, Out> waiting;
+        size_t next = 0;
+        OutChunk done;
+        while(outputs.pop(done)) {
+            waiting[done.first] = std::move(done.second);
+            while(!waiting.empty() && waiting.begin()->first == next) {
+                consume(waiting.begin()->second);
+                waiting.erase(waiting.begin());
+                next++;
+                slots.push(true);
+            }
+        }
+    } catch(...) {
+        fail();
+    }
+
+    reader.join();
+    for(size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+    if(error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// Reports progress at most about once a second
+class ProgressReport {
+    private:
+        std::ostream* out;
+        std::string verb;
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point last;
+    public:
+        ProgressReport(std::ostream* out, const std::string& verb) : out(out), verb(verb) {
+            start = last = std::chrono::steady_clock::now();
+        }
+
+        double elapsed() const {
+            std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+            return seconds.count();
+        }
+
+        void update(size_t records, bool final) {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if(out == NULL || (!final && now - last < std::chrono::seconds(1))) {
+                return;
+            }
+            last = now;
+            double seconds = elapsed();
+            *out << verb << ' ' << records << " records";
+            if(seconds > 0) {
+                *out << " (" << static_cast<size_t>(records / seconds) << " records/s)";
+            }
+            *out << (final ? " in total\n" : "\n");
+        }
+};
+
+struct ImportChunk {
+    std::vector<std::string> lines;
+    size_t first_line; // line number of lines[0], for error messages
+};
+
+struct PreparedChunk {
+    std::vector<PreparedRecord> records;
+    std::vector<std::string> names;
+    std::vector<std::string> errors; // lines that could not be imported
+};
+
+BulkStats bulk_import(AuthenticatedDBUser& user, std::istream& in, size_t threads, std::ostream* progress) {
+    /*
+    * Import every record read from in. Parsing, hashing and encryption
+    * happen on the worker threads; only this thread touches the database.
+    */
+    BulkStats stats = {0, 0, 0};
+    ProgressReport report(progress, "imported");
+    std::vector<PreparedRecord> pending;
+    std::vector<std::string> pending_names;
+
+    auto store_pending = [&]() {
+        std::vector<RecordResult> results = user.insert_prepared_records(pending);
+        for(size_t i = 0; i < results.size(); i++) {
+            if(results[i].ok) {
+                stats.records++;
+            } else {
+                stats.failures++;
+                if(progress != NULL) {
+                    *progress << "skipped '" << pending_names[i] << "': " << results[i].error << '\n';
+                }
+            }
+        }
+        pending.clear();
+        pending_names.clear();
+        report.update(stats.records, false);
+    };
+
+    run_pipeline<ImportChunk, PreparedChunk>(threads,
+        [&](const std::function<void(ImportChunk&&)>& emit) {
+            ImportChunk chunk;
+            chunk.first_line = 1;
+            size_t line_number = 0;
+            std::string line;
+            while(std::getline(in, line)) {
+                line_number++;
+                if(chunk.lines.empty()) {
+                    chunk.first_line = line_number;
+                }
+                chunk.lines.push_back(line);
+                if(chunk.lines.size() == BULK_CHUNK_ROWS) {
+                    emit(std::move(chunk));
+                    chunk = ImportChunk();
+                }
+            }
+            if(!chunk.lines.empty()) {
+                emit(std::move(chunk));
+            }
+        },
+        [&](ImportChunk& chunk, PreparedChunk& prepared) {
+            for(size_t i = 0; i < chunk.lines.size(); i++) {
+                if(chunk.lines[i].find_first_not_of(" \t\r") == std::string::npos) {
+                    continue;
+                }
+                try {
+                    JSONObject record = parse_json_object(chunk.lines[i]);
+                    const std::string& name = record.get("name");
+                    prepared.records.push_back(user.prepare_record(name, record.get_bytes("value")));
+                    prepared.names.push_back(name);
+                } catch(std::exception& e) {
+                    prepared.errors.push_back("line " + std::to_string(chunk.first_line + i) + ": " + e.what());
+                }
+            }
+        },
+        [&](PreparedChunk& prepared) {
+            stats.failures += prepared.errors.size();
+            for(size_t i = 0; progress != NULL && i < prepared.errors.size(); i++) {
+                *progress << "skipped " << prepared.errors[i] << '\n';
+            }
+            for(size_t i = 0; i < prepared.records.size(); i++) {
+                pending.push_back(std::move(prepared.records[i]));
+                pending_names.push_back(std::move(prepared.names[i]));
+            }
+            if(pending.size() >= BULK_TRANSACTION_ROWS) {
+                store_pending();
+            }
+        });
+    if(!pending.empty()) {
+        store_pending();
+    }
+
+    stats.seconds = report.elapsed();
+    report.update(stats.records, true);
+    return stats;
+}
+
+// One record, or one chunk of a chunked record, decrypted and ready to be
+// written out
+struct ExportedPiece {
+    bool ok;
+    std::string text; // the JSON it adds to the output
+    std::string error; // why it could not be decrypted, if it couldn't
+    // a chunked record's contents are written in base64, and the chunks
+    // don't end on a 3-byte boundary: lead holds a chunk's first bytes, which
+    // finish the last group of the chunk before, and tail its last bytes,
+    // which start the next one; text holds the whole groups in between
+    std::string lead;
+    std::string tail;
+    bool is_chunk;
+    sqlite3_uint64 chunks; // for a record, how many of its chunks follow it
+    bool completes; // whether text finishes the record's line
+};
+
+BulkStats bulk_export(AuthenticatedDBUser& user, std::ostream& out, size_t threads, std::ostream* progress) {
+    /*
+    * Export every one of the user's records to out. Records are read on the
+    * reader thread and decrypted on the worker threads; this thread only
+    * writes the finished lines out, a chunk at a time. A chunked record
+    * travels as its own pipeline items, one per chunk, and its line is
+    * written out piece by piece.
+    */
+    BulkStats stats = {0, 0, 0};
+    ProgressReport report(progress, "exported");
+    size_t skipping = 0; // chunks still to come of a record that was skipped
+    bool open_line = false; // a chunked record's line is part written
+    std::string carry; // its bytes not yet written, short of a base64 group
+
+    run_pipeline<std::vector<StoredRecord>, std::vector<ExportedPiece>>(threads,
+        [&](const std::function<void(std::vector<StoredRecord>&&)>& emit) {
+            std::vector<StoredRecord> chunk;
+            size_t bytes = 0;
+            user.for_each_stored_record([&](const StoredRecord& record) {
+                chunk.push_back(record);
+                bytes += record.contents.size() + record.chunk.size();
+                if(chunk.size() == BULK_CHUNK_ROWS || bytes >= BULK_CHUNK_BYTES) {
+                    emit(std::move(chunk));
+                    chunk.clear();
+                    bytes = 0;
+                }
+            });
+            if(!chunk.empty()) {
+                emit(std::move(chunk));
+            }
+        },
+        [&](std::vector<StoredRecord>& chunk, std::vector<ExportedPiece>& exported) {
+            exported.resize(chunk.size());
+            for(size_t i = 0; i < chunk.size(); i++) {
+                ExportedPiece& piece = exported[i];
+                piece.is_chunk = chunk[i].is_chunk;
+                piece.chunks = chunk[i].chunks;
+                try {
+                    if(chunk[i].is_chunk) {
+                        std::string contents = user.open_record_chunk(chunk[i]);
+                        piece.completes = chunk[i].chunk_index + 1 == chunk[i].chunks;
+                        size_t start = chunk[i].chunk_index * AuthenticatedDBUser::RECORD_CHUNK_SIZE;
+                        size_t lead = std::min(static_cast<size_t>((3 - start % 3) % 3), contents.size());
+                        size_t whole = piece.completes ? contents.size() : contents.size() - (contents.size() - lead) % 3;
+                        piece.lead = contents.substr(0, lead);
+                        piece.text = base64_encode(contents.substr(lead, whole - lead));
+                        piece.tail = contents.substr(whole);
+                        if(piece.completes) {
+                            piece.text += "\"}\n";
+                        }
+                    } else {
+                        std::pair<std::string, std::string> record = user.open_record(chunk[i]);
+                        if(!is_utf8(record.first)) {
+                            throw std::runtime_error("record name is not valid UTF-8");
+                        }
+                        piece.completes = chunk[i].chunks == 0;
+                        // a chunked record can't be checked for UTF-8 before
+                        // its line is started, so it is always in base64
+                        piece.text = "{\"name\": " + json_quote(record.first) + ", "
+                                     + (piece.completes ? json_bytes("value", record.second) + "}\n" : "\"value_b64\": \"");
+                    }
+                    piece.ok = true;
+                } catch(std::exception& e) {
+                    piece.ok = false;
+                    piece.error = e.what();
+                }
+            }
+        },
+        [&](std::vector<ExportedPiece>& exported) {
+            for(size_t i = 0; i < exported.size(); i++) {
+                ExportedPiece& piece = exported[i];
+                if(piece.is_chunk && skipping > 0) {
+                    skipping--;
+                    continue;
+                }
+                if(piece.is_chunk != open_line) {
+                    throw std::runtime_error("record is missing chunks");
+                }
+                if(!piece.ok) {
+                    if(open_line) {
+                        // the start of the record's line is already out
+                        throw std::runtime_error("could not export a record: " + piece.error);
+                    }
+                    stats.failures++;
+                    skipping = piece.chunks;
+                    if(progress != NULL) {
+                        *progress << "skipped a record: " << piece.error << '\n';
+                    }
+                    continue;
+                }
+                if(!carry.empty() || !piece.lead.empty()) {
+                    std::string group = base64_encode(carry + piece.lead);
+                    out.write(group.data(), group.size());
+                }
+                out.write(piece.text.data(), piece.text.size());
+                carry = piece.tail;
+                open_line = !piece.completes;
+                if(piece.completes) {
+                    stats.records++;
+                }
+            }
+            report.update(stats.records, false);
+        });
+    if(open_line) {
+        throw std::runtime_error("record is missing chunks");
+    }
+    out.flush();
+
+    stats.seconds = report.elapsed();
+    report.update(stats.records, true);
+    return stats;
+}
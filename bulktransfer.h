@@ -0,0 +1,40 @@
+#include <iostream>
+#include <string>
+#include "dbmanager.h"
+
+#ifndef __BULKTRANSFER_H
+#define __BULKTRANSFER_H
+
+/*
+* Bulk import and export of a user's records, as JSON Lines of the form
+*   {"name": NAME, "value": CONTENT}
+* or, for contents that aren't valid UTF-8, {"name": NAME, "value_b64":
+* BASE64}. Export also uses value_b64 for every record stored in chunks.
+* Both run as a pipeline: one thread reads the input a chunk of records at
+* a time, worker threads encrypt or decrypt whole chunks, and the calling
+* thread writes the results back in their original order. The queues between
+* the stages are bounded, and so is the number of chunks in flight, so
+* memory use stays flat however many records there are.
+* Import stores BULK_TRANSACTION_ROWS records per transaction, and skips
+* records whose name the user already has. Export streams the records in
+* creation order; a record stored in chunks goes through the pipeline a
+* chunk at a time, so it is never held in memory whole.
+*/
+
+const size_t BULK_CHUNK_ROWS = 256;
+// export chunks are cut short once they hold this many bytes of ciphertext
+const size_t BULK_CHUNK_BYTES = 1024 * 1024;
+const size_t BULK_TRANSACTION_ROWS = 16384;
+
+struct BulkStats {
+    size_t records; // records imported or exported
+    size_t failures; // records that were skipped
+    double seconds;
+};
+
+// progress: where to report progress about once a second, and skipped
+// records, or NULL to stay quiet
+BulkStats bulk_import(AuthenticatedDBUser& user, std::istream& in, size_t threads, std::ostream* progress);
+BulkStats bulk_export(AuthenticatedDBUser& user, std::ostream& out, size_t threads, std::ostream* progress);
+
+#endif
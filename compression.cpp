@@ -0,0 +1,229 @@
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include "compression.h"
+
+static void write_varint(std::string& out, size_t value) {
+    // seven bits at a time, lowest first, with the top bit set on all but
+    // the last byte
+    while(value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static size_t read_varint(const unsigned char* data, size_t length, size_t& pos) {
+    size_t value = 0;
+    for(int shift = 0; shift < 64; shift += 7) {
+        if(pos >= length) {
+            break;
+        }
+        unsigned char byte = data[pos++];
+        value |= static_cast<size_t>(byte & 0x7f) << shift;
+        if((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error("corrupt compressed data");
+}
+
+static void write_length(std::string& out, size_t length) {
+    // the part of a length that didn't fit in its token nibble
+    while(length >= 255) {
+        out.push_back(static_cast<char>(255));
+        length -= 255;
+    }
+    out.push_back(static_cast<char>(length));
+}
+
+static size_t read_length(const unsigned char* data, size_t length, size_t& pos) {
+    size_t value = 0;
+    unsigned char byte;
+    do {
+        if(pos >= length) {
+            throw std::runtime_error("corrupt compressed data");
+        }
+        byte = data[pos++];
+        value += byte;
+    } while(byte == 255);
+    return value;
+}
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+bool compression::_impl_details::lz_compress(const std::string& data, size_t limit, std::string& out) {
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(data.data());
+    size_t n = data.size();
+    write_varint(out, n);
+
+    // position + 1 of the last place each hashed 4-byte sequence was seen
+    std::vector<uint32_t> table(static_cast<size_t>(1) << LZ_HASH_BITS, 0);
+    size_t anchor = 0; // start of the literals not yet written
+    // write the literals up to literals_end, then a match of match bytes at
+    // offset, if match isn't 0
+    auto emit = [&](size_t literals_end, size_t offset, size_t match) {
+        size_t literals = literals_end - anchor;
+        size_t token_at = out.size();
+        unsigned char token = static_cast<unsigned char>((literals >= 15 ? 15 : literals) << 4);
+        out.push_back(0);
+        if(literals >= 15) {
+            write_length(out, literals - 15);
+        }
+        out.append(data, anchor, literals);
+        if(match != 0) {
+            size_t extra = match - LZ_MIN_MATCH;
+            token |= static_cast<unsigned char>(extra >= 15 ? 15 : extra);
+            out.push_back(static_cast<char>(offset & 0xff));
+            out.push_back(static_cast<char>(offset >> 8));
+            if(extra >= 15) {
+                write_length(out, extra - 15);
+            }
+        }
+        out[token_at] = static_cast<char>(token);
+        return out.size() < limit;
+    };
+
+    size_t i = 0;
+    while(i + LZ_MIN_MATCH <= n) {
+        uint32_t sequence = read32(in + i);
+        size_t slot = static_cast<uint32_t>(sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t candidate = table[slot];
+        table[slot] = static_cast<uint32_t>(i + 1);
+        if(candidate != 0 && i - (candidate - 1) <= LZ_MAX_OFFSET && read32(in + candidate - 1) == sequence) {
+            size_t from = candidate - 1;
+            size_t match = LZ_MIN_MATCH;
+            while(i + match < n && in[from + match] == in[i + match]) {
+                match++;
+            }
+            if(!emit(i, i - from, match)) {
+                return false;
+            }
+            i += match;
+            anchor = i;
+        } else {
+            // step further between attempts the longer nothing has matched,
+            // so that incompressible data is passed over quickly
+            i += 1 + ((i - anchor) >> 6);
+        }
+    }
+    // the stream may end on a match; otherwise the rest is literals
+    return anchor == n || emit(n, 0, 0);
+}
+
+std::string compression::_impl_details::lz_decompress(const char* data, size_t length) {
+    /*
+    * Decode an lz_compress stream. Every length and offset is checked
+    * against both the input and the declared output size, so corrupt input
+    * throws rather than reading or writing out of bounds.
+    */
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+    size_t pos = 0;
+    size_t size = read_varint(in, length, pos);
+    std::string out;
+    out.reserve(size);
+    while(pos < length) {
+        unsigned char token = in[pos++];
+        size_t literals = token >> 4;
+        if(literals == 15) {
+            literals += read_length(in, length, pos);
+        }
+        if(literals > length - pos || literals > size - out.size()) {
+            throw std::runtime_error("corrupt compressed data");
+        }
+        out.append(data + pos, literals);
+        pos += literals;
+        if(pos == length) {
+            break; // the last sequence may have no match
+        }
+
+        if(length - pos < 2) {
+            throw std::runtime_error("corrupt compressed data");
+        }
+        size_t offset = in[pos] | (static_cast<size_t>(in[pos + 1]) << 8);
+        pos += 2;
+        size_t match = (token & 0x0f) + LZ_MIN_MATCH;
+        if((token & 0x0f) == 15) {
+            match += read_length(in, length, pos);
+        }
+        if(offset == 0 || offset > out.size() || match > size - out.size()) {
+            throw std::runtime_error("corrupt compressed data");
+        }
+        // a match may overlap the bytes it is producing, e.g. a run of one
+        // repeated byte, so it is copied forwards at most offset bytes at a
+        // time, each copy reading only bytes that are already there
+        size_t at = out.size();
+        out.resize(at + match);
+        char* o = &out[0];
+        for(size_t copied = 0; copied < match; ) {
+            size_t step = std::min(offset, match - copied);
+            std::memcpy(o + at + copied, o + at + copied - offset, step);
+            copied += step;
+        }
+    }
+    if(out.size() != size) {
+        throw std::runtime_error("corrupt compressed data");
+    }
+    return out;
+}
+
+bool compression::compress(const std::string& data, Codec codec, std::string& encoded) {
+    encoded.clear();
+    if(codec == CODEC_NONE || data.size() < MIN_COMPRESSIBLE_SIZE) {
+        return false;
+    }
+    if(codec != CODEC_LZ) {
+        throw std::runtime_error("unknown codec");
+    }
+    encoded.push_back(static_cast<char>(CODEC_LZ));
+    // give up as soon as the result couldn't be smaller than data
+    if(!compression::_impl_details::lz_compress(data, data.size(), encoded)) {
+        encoded.clear();
+        return false;
+    }
+    return true;
+}
+
+std::string compression::decompress(const std::string& encoded) {
+    return compression::decompress(encoded.data(), encoded.size());
+}
+
+std::string compression::decompress(const char* encoded, size_t length) {
+    if(length < 1) {
+        throw std::runtime_error("corrupt compressed data");
+    }
+    switch(static_cast<unsigned char>(encoded[0])) {
+        case CODEC_NONE:
+            return std::string(encoded + 1, length - 1);
+        case CODEC_LZ:
+            return compression::_impl_details::lz_decompress(encoded + 1, length - 1);
+        default:
+            throw std::runtime_error("unknown codec");
+    }
+}
+
+std::string compression::codec_name(Codec codec) {
+    switch(codec) {
+        case CODEC_NONE:
+            return "none";
+        case CODEC_LZ:
+            return "lz";
+        default:
+            throw std::runtime_error("unknown codec");
+    }
+}
+
+compression::Codec compression::codec_from_name(const std::string& name) {
+    if(name == "none") {
+        return CODEC_NONE;
+    } else if(name == "lz") {
+        return CODEC_LZ;
+    }
+    throw std::runtime_error("unknown codec '" + name + "'");
+}
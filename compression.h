@@ -0,0 +1,45 @@
+#include <string>
+
+#ifndef __COMPRESSION_H
+#define __COMPRESSION_H
+
+/*
+* compression: Codecs applied to record contents before they are encrypted,
+* since ciphertext can't be compressed afterwards. Encoded data starts with
+* a one-byte codec tag, so every record says how it was compressed and a
+* database's codec can change without touching existing records.
+*/
+namespace compression {
+    namespace _impl_details {
+        // An LZ77 codec in the style of LZ4: greedy matching through a hash
+        // table of 4-byte sequences, and byte-aligned output, so both
+        // directions run at memory speed rather than aiming for the best
+        // ratio. The stream is the decoded size as a varint, then sequences
+        // of a token (4 bits of literal length, 4 of match length), the
+        // literals, and a 2-byte match offset; the last sequence may have
+        // no match. Lengths of 15 or more continue in following bytes.
+        const size_t LZ_MIN_MATCH = 4;
+        const size_t LZ_MAX_OFFSET = 65535;
+        const size_t LZ_HASH_BITS = 14;
+        // appends to out; returns false as soon as out would reach limit bytes
+        bool lz_compress(const std::string& data, size_t limit, std::string& out);
+        std::string lz_decompress(const char* data, size_t length);
+    }
+
+    typedef enum { CODEC_NONE = 0, CODEC_LZ = 1 } Codec;
+
+    // Data shorter than this is never worth compressing
+    const size_t MIN_COMPRESSIBLE_SIZE = 64;
+
+    // Encode data with codec into encoded. Returns false, leaving data to be
+    // stored as it is, for CODEC_NONE or when compressing wouldn't make the
+    // data any smaller.
+    bool compress(const std::string& data, Codec codec, std::string& encoded);
+    std::string decompress(const std::string& encoded);
+    std::string decompress(const char* encoded, size_t length);
+
+    std::string codec_name(Codec codec);
+    Codec codec_from_name(const std::string& name); // throws if unknown
+}
+
+#endif
@@ -1,6 +1,11 @@
 #include <iostream>
 #include <string>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <stdexcept>
 #include "cryptowrapper.h"
+#include "metrics.h"
 #include "cryptopp890/sha3.h"
 #include "cryptopp890/filters.h"
 #include "cryptopp890/hex.h"
@@ -9,7 +14,12 @@
 #include "cryptopp890/osrng.h"
 #include "cryptopp890/aes.h"
 #include "cryptopp890/modes.h"
+#include "cryptopp890/gcm.h"
+#include "cryptopp890/misc.h"
 #include "cryptopp890/hkdf.h"
+#include <mutex>
+#include <atomic>
+#include <pthread.h>
 
 // Convert bytes to string, or vice versa.
 // The algorithm for these functions was taken from a suggestion in the 
@@ -29,6 +39,53 @@ CryptoPP::SecByteBlock crypto::_impl_details::string_to_bytes(const std::string&
     return result;
 }
 
+// Per-thread random generation.
+// Constructing an AutoSeededRandomPool reseeds it from the OS, which is as
+// expensive as the AES work it was feeding, so each thread keeps one pool
+// and reseeds it on a schedule instead: after RNG_RESEED_BYTES of output,
+// and in a child process after fork(), so that parent and child never
+// produce the same stream.
+
+namespace {
+    std::atomic<unsigned long> fork_generation(0);
+    std::once_flag fork_handler_registered;
+
+    void note_fork() {
+        fork_generation++;
+    }
+
+    class ThreadRandomPool {
+        private:
+            CryptoPP::AutoSeededRandomPool pool;
+            size_t since_reseed;
+            unsigned long seeded_generation;
+        public:
+            ThreadRandomPool() {
+                since_reseed = 0;
+                seeded_generation = fork_generation;
+            }
+
+            void fill(CryptoPP::byte* output, size_t size) {
+                if(since_reseed >= crypto::_impl_details::RNG_RESEED_BYTES
+                   || seeded_generation != fork_generation) {
+                    pool.Reseed();
+                    since_reseed = 0;
+                    seeded_generation = fork_generation;
+                }
+                pool.GenerateBlock(output, size);
+                since_reseed += size;
+            }
+    };
+}
+
+void crypto::_impl_details::random_fill(CryptoPP::byte* output, size_t size) {
+    std::call_once(fork_handler_registered, []() {
+        pthread_atfork(NULL, NULL, note_fork);
+    });
+    thread_local ThreadRandomPool pool;
+    pool.fill(output, size);
+}
+
 // Implementations of cryptography functions in cryptowrapper.h
 // NOTE: Many of the functions were modified from this site:
 // https://petanode.com/posts/brief-introduction-to-cryptopp/
@@ -36,7 +93,29 @@ CryptoPP::SecByteBlock crypto::_impl_details::string_to_bytes(const std::string&
 // works, and the example routines, or their overall structure, proved
 // to be usable here.
 
-std::string crypto::_impl_details::sha3_hash(const std::string& str) {
+std::string crypto::_impl_details::hex_encode(const std::string& bytes) {
+    std::string result;
+    CryptoPP::StringSource encodemachine(
+        bytes, true,
+        new CryptoPP::HexEncoder(
+            new CryptoPP::StringSink(result)
+        )
+    );
+    return result;
+}
+
+std::string crypto::_impl_details::hex_decode(const std::string& str) {
+    std::string result;
+    CryptoPP::StringSource decodemachine(
+        str, true,
+        new CryptoPP::HexDecoder(
+            new CryptoPP::StringSink(result)
+        )
+    );
+    return result;
+}
+
+std::string crypto::_impl_details::sha3_hash_raw(const std::string& str) {
     auto sha3_machine = CryptoPP::SHA3_512();
     std::string result;
 
@@ -44,76 +123,146 @@ std::string crypto::_impl_details::sha3_hash(const std::string& str) {
         str, true,
         new CryptoPP::HashFilter(
             sha3_machine,
-            new CryptoPP::HexEncoder(
-                new CryptoPP::StringSink(result)
-            )
+            new CryptoPP::StringSink(result)
         )
     );
 
     return result;
 }
 
-std::string crypto::_impl_details::aes_cbc_encrypt(const std::string& str, const CryptoPP::SecByteBlock key) {
-    // Create the machines to perform encryption, encoding, and IV generation
+std::string crypto::_impl_details::sha3_hash(const std::string& str) {
+    return crypto::_impl_details::hex_encode(crypto::_impl_details::sha3_hash_raw(str));
+}
+
+// Every way a ciphertext can fail to decrypt - too short, a bad length or
+// padding, a failed authentication - throws this same error, so that a
+// caller who can see it learns nothing about why (e.g. no padding oracle)
+static const char* const DECRYPTION_FAILED = "ciphertext could not be decrypted";
+
+static size_t cbc_padding(const CryptoPP::byte* out, size_t length) {
+    // the length of the PKCS #7 padding at the end of a decrypted CBC
+    // plaintext, checked without branching on the plaintext: the whole last
+    // block is looked at whatever the padding claims, masking off the bytes
+    // before the padding; each x >> 31 below is 1 just if x went below zero
+    const unsigned int block_size = CryptoPP::AES::BLOCKSIZE;
+    unsigned int padding = out[length - 1];
+    unsigned int bad = ((padding - 1) >> 31) | ((block_size - padding) >> 31); // padding is 0 or over block
+    for(unsigned int i = 1; i <= block_size; i++) {
+        unsigned int in_padding = ((padding - i) >> 31) - 1; // all ones if i <= padding, else 0
+        bad |= in_padding & (out[length - i] ^ padding);
+    }
+    if(bad != 0) {
+        throw std::runtime_error(DECRYPTION_FAILED);
+    }
+    return padding;
+}
+
+static bool cbc_length_valid(size_t length) {
+    // the IV and at least one block of ciphertext, in whole blocks
+    return length >= 2 * CryptoPP::AES::BLOCKSIZE && length % CryptoPP::AES::BLOCKSIZE == 0;
+}
+
+static std::string cbc_decrypt(CryptoPP::AES::Decryption& aes, const char* ct, size_t length) {
+    // decrypt every block in one call, so that Crypto++ can run several
+    // blocks through AES at once, then check and strip the padding
+    const size_t block = CryptoPP::AES::BLOCKSIZE;
+    if(!cbc_length_valid(length)) {
+        throw std::runtime_error(DECRYPTION_FAILED);
+    }
+    const CryptoPP::byte* iv = reinterpret_cast<const CryptoPP::byte*>(ct);
+    std::string result(length - block, '\0');
+    CryptoPP::byte* out = reinterpret_cast<CryptoPP::byte*>(&result[0]);
+    CryptoPP::CBC_Mode_ExternalCipher::Decryption aes_cbc_machine(aes, iv);
+    aes_cbc_machine.ProcessData(out, iv + block, result.size());
+    result.resize(result.size() - cbc_padding(out, result.size()));
+    return result;
+}
+
+std::string crypto::_impl_details::aes_cbc_encrypt_raw(const std::string& str, const CryptoPP::SecByteBlock key) {
+    // Create the machines to perform encryption and IV generation
     auto aes_start = CryptoPP::AES::Encryption(key, key.size());
-    std::string result;
-    CryptoPP::HexEncoder encoder(new CryptoPP::StringSink(result));
 
     // Generate the IV
     CryptoPP::SecByteBlock iv(CryptoPP::AES::BLOCKSIZE);
-    CryptoPP::AutoSeededRandomPool rgen;
-    rgen.GenerateBlock(iv, iv.size());
+    crypto::_impl_details::random_fill(iv, iv.size());
 
     auto aes_cbc_machine = CryptoPP::CBC_Mode_ExternalCipher::Encryption(aes_start, iv.data());
 
-    // Encrypt the text using the IV
-    std::string ctext;
+    // The result is the IV followed by the encryption of the text under it
+    std::string result(reinterpret_cast<const char*>(iv.data()), iv.size());
     CryptoPP::StringSource transformer(
         str, true,
         new CryptoPP::StreamTransformationFilter(
             aes_cbc_machine,
-            new CryptoPP::StringSink(ctext)
+            new CryptoPP::StringSink(result)
         )
     );
-    
-    // Fill the result string with the iv and encryption, and encode it
-    encoder.Put(iv, iv.size());
-    encoder.Put(reinterpret_cast<const CryptoPP::byte*>(ctext.data()), ctext.size());
 
     // return
     return result;
 }
 
+std::string crypto::_impl_details::aes_cbc_decrypt_raw(const std::string& str, const CryptoPP::SecByteBlock key) {
+    return crypto::_impl_details::aes_cbc_decrypt_raw(str.data(), str.size(), key);
+}
+
+std::string crypto::_impl_details::aes_cbc_decrypt_raw(const char* ct, size_t length, const CryptoPP::SecByteBlock key) {
+    // the IV is the first block; the rest is the ciphertext proper
+    CryptoPP::AES::Decryption aes_start(key.data(), key.size());
+    return cbc_decrypt(aes_start, ct, length);
+}
+
+std::string crypto::_impl_details::aes_cbc_encrypt(const std::string& str, const CryptoPP::SecByteBlock key) {
+    return crypto::_impl_details::hex_encode(crypto::_impl_details::aes_cbc_encrypt_raw(str, key));
+}
+
 std::string crypto::_impl_details::aes_cbc_decrypt(const std::string& str, const CryptoPP::SecByteBlock key) {
-    auto aes_start = CryptoPP::AES::Decryption(key.data(), key.size());
-    std::string result;
-    CryptoPP::HexDecoder decoder(new CryptoPP::StringSink(result));
+    return crypto::_impl_details::aes_cbc_decrypt_raw(crypto::_impl_details::hex_decode(str), key);
+}
 
-    // decode the string
-    std::string decoded;
-    CryptoPP::StringSource decodemachine(
-        str, true,
-        new CryptoPP::HexDecoder(
-            new CryptoPP::StringSink(decoded)
-        )
-    );
+std::string crypto::_impl_details::aes_gcm_encrypt(const std::string& str, const CryptoPP::SecByteBlock key, const std::string& aad) {
+    // Crypto++ picks the AES-NI and carry-less multiply code paths for GCM
+    // on its own when the processor supports them
+    CryptoPP::SecByteBlock nonce(GCM_NONCE_SIZE);
+    crypto::_impl_details::random_fill(nonce, nonce.size());
 
-    // split IV from the actual encryption
-    std::string ivstr = decoded.substr(0, CryptoPP::AES::BLOCKSIZE);
-    std::string ciphertext = decoded.substr(CryptoPP::AES::BLOCKSIZE, std::string::npos);
+    CryptoPP::GCM<CryptoPP::AES>::Encryption aes_gcm_machine;
+    aes_gcm_machine.SetKeyWithIV(key, key.size(), nonce, nonce.size());
 
-    // use IV and key to decrypt the ciphertext
-    CryptoPP::SecByteBlock iv = crypto::_impl_details::string_to_bytes(ivstr);
-    auto aes_cbc_machine = CryptoPP::CBC_Mode_ExternalCipher::Decryption(aes_start, iv.data());
-    CryptoPP::StringSource decryptmachine(
-        ciphertext, true,
-        new CryptoPP::StreamTransformationFilter(
-            aes_cbc_machine,
-            new CryptoPP::StringSink(result)
-        )
-    );
+    // lay out nonce || ciphertext || tag, encrypting straight into place
+    std::string result(GCM_NONCE_SIZE + str.size() + GCM_TAG_SIZE, '\0');
+    CryptoPP::byte* out = reinterpret_cast<CryptoPP::byte*>(&result[0]);
+    std::memcpy(out, nonce.data(), GCM_NONCE_SIZE);
+    aes_gcm_machine.EncryptAndAuthenticate(
+        out + GCM_NONCE_SIZE, out + GCM_NONCE_SIZE + str.size(), GCM_TAG_SIZE,
+        nonce, nonce.size(),
+        reinterpret_cast<const CryptoPP::byte*>(aad.data()), aad.size(),
+        reinterpret_cast<const CryptoPP::byte*>(str.data()), str.size());
 
-    // return
+    return result;
+}
+
+std::string crypto::_impl_details::aes_gcm_decrypt(const char* ct, size_t length, const CryptoPP::SecByteBlock key, const std::string& aad) {
+    if(length < GCM_NONCE_SIZE + GCM_TAG_SIZE) {
+        throw std::runtime_error(DECRYPTION_FAILED);
+    }
+    const CryptoPP::byte* nonce = reinterpret_cast<const CryptoPP::byte*>(ct);
+    const CryptoPP::byte* ciphertext = nonce + GCM_NONCE_SIZE;
+    size_t textLength = length - GCM_NONCE_SIZE - GCM_TAG_SIZE;
+    const CryptoPP::byte* tag = ciphertext + textLength;
+
+    CryptoPP::GCM<CryptoPP::AES>::Decryption aes_gcm_machine;
+    aes_gcm_machine.SetKeyWithIV(key, key.size(), nonce, GCM_NONCE_SIZE);
+
+    std::string result(textLength, '\0');
+    bool valid = aes_gcm_machine.DecryptAndVerify(
+        reinterpret_cast<CryptoPP::byte*>(&result[0]), tag, GCM_TAG_SIZE,
+        nonce, GCM_NONCE_SIZE,
+        reinterpret_cast<const CryptoPP::byte*>(aad.data()), aad.size(),
+        ciphertext, textLength);
+    if(!valid) {
+        throw std::runtime_error(DECRYPTION_FAILED);
+    }
     return result;
 }
 
@@ -132,22 +281,479 @@ CryptoPP::SecByteBlock crypto::_impl_details::keygen_hkdf_sha3(const std::string
 
 
 std::string crypto::hash(const std::string& str) {
+    metrics::Timer timer(metrics::CRYPTO_HASH, metrics::CRYPTO_BYTES_HASHED, str.size());
     return crypto::_impl_details::sha3_hash(str);
 }
 
 std::string crypto::encrypt(const std::string& str, const CryptoPP::SecByteBlock key) {
+    metrics::Timer timer(metrics::CRYPTO_ENCRYPT, metrics::CRYPTO_BYTES_ENCRYPTED, str.size());
     return crypto::_impl_details::aes_cbc_encrypt(str, key);
 }
 
 std::string crypto::decrypt(const std::string& ct, const CryptoPP::SecByteBlock key) {
+    metrics::Timer timer(metrics::CRYPTO_DECRYPT, metrics::CRYPTO_BYTES_DECRYPTED, ct.size());
     return crypto::_impl_details::aes_cbc_decrypt(ct, key);
 }
 
+std::string crypto::raw_hash(const std::string& str) {
+    metrics::Timer timer(metrics::CRYPTO_HASH, metrics::CRYPTO_BYTES_HASHED, str.size());
+    return crypto::_impl_details::sha3_hash_raw(str);
+}
+
+std::string crypto::raw_encrypt(const std::string& str, const CryptoPP::SecByteBlock key) {
+    metrics::Timer timer(metrics::CRYPTO_ENCRYPT, metrics::CRYPTO_BYTES_ENCRYPTED, str.size());
+    return crypto::_impl_details::aes_cbc_encrypt_raw(str, key);
+}
+
+std::string crypto::raw_decrypt(const std::string& ct, const CryptoPP::SecByteBlock key) {
+    metrics::Timer timer(metrics::CRYPTO_DECRYPT, metrics::CRYPTO_BYTES_DECRYPTED, ct.size());
+    return crypto::_impl_details::aes_cbc_decrypt_raw(ct, key);
+}
+
+std::string crypto::raw_decrypt(const char* ct, size_t length, const CryptoPP::SecByteBlock key) {
+    metrics::Timer timer(metrics::CRYPTO_DECRYPT, metrics::CRYPTO_BYTES_DECRYPTED, length);
+    return crypto::_impl_details::aes_cbc_decrypt_raw(ct, length, key);
+}
+
+std::string crypto::hex_encode(const std::string& bytes) {
+    return crypto::_impl_details::hex_encode(bytes);
+}
+
+std::string crypto::hex_decode(const std::string& str) {
+    return crypto::_impl_details::hex_decode(str);
+}
+
+std::string crypto::auth_encrypt(const std::string& str, const CryptoPP::SecByteBlock key) {
+    metrics::Timer timer(metrics::CRYPTO_ENCRYPT, metrics::CRYPTO_BYTES_ENCRYPTED, str.size());
+    // the cipher tag is passed as associated data, so it can't be altered
+    // to steer decryption elsewhere without failing authentication
+    std::string tag(1, static_cast<char>(crypto::CIPHER_AES_GCM));
+    return tag + crypto::_impl_details::aes_gcm_encrypt(str, key, tag);
+}
+
+std::string crypto::auth_decrypt(const std::string& ct, const CryptoPP::SecByteBlock key) {
+    return crypto::auth_decrypt(ct.data(), ct.size(), key);
+}
+
+std::string crypto::auth_decrypt(const char* ct, size_t length, const CryptoPP::SecByteBlock key) {
+    metrics::Timer timer(metrics::CRYPTO_DECRYPT, metrics::CRYPTO_BYTES_DECRYPTED, length);
+    if(length < 1) {
+        throw std::runtime_error(DECRYPTION_FAILED);
+    }
+    switch(static_cast<CryptoPP::byte>(ct[0])) {
+        case crypto::CIPHER_AES_GCM:
+        case crypto::CIPHER_AES_GCM_ENCODED:
+            return crypto::_impl_details::aes_gcm_decrypt(ct + 1, length - 1, key, std::string(1, ct[0]));
+        case crypto::CIPHER_AES_CBC:
+            return crypto::_impl_details::aes_cbc_decrypt_raw(ct + 1, length - 1, key);
+        default:
+            throw std::runtime_error("unknown cipher tag");
+    }
+}
+
+// a tag with CIPHER_BOUND masked off
+static CryptoPP::byte cipher_of(const char* ct) {
+    return static_cast<CryptoPP::byte>(ct[0]) & ~crypto::CIPHER_BOUND;
+}
+
+bool crypto::is_authenticated(const char* ct, size_t length) {
+    return length > 0 && cipher_of(ct) == crypto::CIPHER_AES_GCM;
+}
+
+std::string crypto::auth_encrypt(const std::string& str, const CryptoPP::SecByteBlock key, const std::string& context,
+                                 CryptoPP::byte tag) {
+    metrics::Timer timer(metrics::CRYPTO_ENCRYPT, metrics::CRYPTO_BYTES_ENCRYPTED, str.size());
+    std::string tag_str(1, static_cast<char>(tag));
+    return tag_str + crypto::_impl_details::aes_gcm_encrypt(str, key, tag_str + context);
+}
+
+std::string crypto::auth_decrypt(const char* ct, size_t length, const CryptoPP::SecByteBlock key, const std::string& context) {
+    metrics::Timer timer(metrics::CRYPTO_DECRYPT, metrics::CRYPTO_BYTES_DECRYPTED, length);
+    // only GCM ciphertexts carry context; there is no legacy CBC form
+    if(length < 1) {
+        throw std::runtime_error(DECRYPTION_FAILED);
+    }
+    CryptoPP::byte tag = cipher_of(ct);
+    if(tag != crypto::CIPHER_AES_GCM && tag != crypto::CIPHER_AES_GCM_ENCODED && tag != crypto::CIPHER_CHUNKED) {
+        throw std::runtime_error("unknown cipher tag");
+    }
+    return crypto::_impl_details::aes_gcm_decrypt(ct + 1, length - 1, key, std::string(1, ct[0]) + context);
+}
+
+bool crypto::is_chunked(const char* ct, size_t length) {
+    return length > 0 && cipher_of(ct) == crypto::CIPHER_CHUNKED;
+}
+
+bool crypto::is_encoded(const char* ct, size_t length) {
+    return length > 0 && cipher_of(ct) == crypto::CIPHER_AES_GCM_ENCODED;
+}
+
+bool crypto::is_bound(const char* ct, size_t length) {
+    return length > 0 && (static_cast<CryptoPP::byte>(ct[0]) & crypto::CIPHER_BOUND) != 0;
+}
+
+static uint64_t load64(const CryptoPP::byte* in) {
+    // big-endian, as GCM lays out its blocks
+    uint64_t value = 0;
+    for(size_t i = 0; i < 8; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+static void store64(CryptoPP::byte* out, uint64_t value) {
+    for(size_t i = 8; i > 0; i--) {
+        out[i - 1] = static_cast<CryptoPP::byte>(value);
+        value >>= 8;
+    }
+}
+
+static uint64_t ghash_bmul64(uint64_t x, uint64_t y) {
+    // the low half of the carry-less product of x and y. Each operand is
+    // split into every fourth bit, so that the carries of the integer
+    // multiplies below land in the gaps and are masked off.
+    const uint64_t m0 = 0x1111111111111111ULL;
+    const uint64_t m1 = 0x2222222222222222ULL;
+    const uint64_t m2 = 0x4444444444444444ULL;
+    const uint64_t m3 = 0x8888888888888888ULL;
+    uint64_t x0 = x & m0, x1 = x & m1, x2 = x & m2, x3 = x & m3;
+    uint64_t y0 = y & m0, y1 = y & m1, y2 = y & m2, y3 = y & m3;
+    uint64_t z0 = (x0 * y0) ^ (x1 * y3) ^ (x2 * y2) ^ (x3 * y1);
+    uint64_t z1 = (x0 * y1) ^ (x1 * y0) ^ (x2 * y3) ^ (x3 * y2);
+    uint64_t z2 = (x0 * y2) ^ (x1 * y1) ^ (x2 * y0) ^ (x3 * y3);
+    uint64_t z3 = (x0 * y3) ^ (x1 * y2) ^ (x2 * y1) ^ (x3 * y0);
+    return (z0 & m0) | (z1 & m1) | (z2 & m2) | (z3 & m3);
+}
+
+static uint64_t ghash_rev64(uint64_t x) {
+    // x with its bits in the opposite order
+    x = ((x & 0x5555555555555555ULL) << 1) | ((x >> 1) & 0x5555555555555555ULL);
+    x = ((x & 0x3333333333333333ULL) << 2) | ((x >> 2) & 0x3333333333333333ULL);
+    x = ((x & 0x0F0F0F0F0F0F0F0FULL) << 4) | ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL);
+    x = ((x & 0x00FF00FF00FF00FFULL) << 8) | ((x >> 8) & 0x00FF00FF00FF00FFULL);
+    x = ((x & 0x0000FFFF0000FFFFULL) << 16) | ((x >> 16) & 0x0000FFFF0000FFFFULL);
+    return (x << 32) | (x >> 32);
+}
+
+static void ghash_product_ctmul(uint64_t y0, uint64_t y1, uint64_t h0, uint64_t h1, uint64_t* v) {
+    // the 256-bit carry-less product of (y1:y0) and (h1:h0), Karatsuba
+    // style; the high half of each 64-bit product is the low half of the
+    // product of the bit reversed operands, reversed
+    uint64_t y0r = ghash_rev64(y0);
+    uint64_t y1r = ghash_rev64(y1);
+    uint64_t h0r = ghash_rev64(h0);
+    uint64_t h1r = ghash_rev64(h1);
+    uint64_t z0 = ghash_bmul64(y0, h0);
+    uint64_t z1 = ghash_bmul64(y1, h1);
+    uint64_t z2 = ghash_bmul64(y0 ^ y1, h0 ^ h1);
+    uint64_t z0h = ghash_bmul64(y0r, h0r);
+    uint64_t z1h = ghash_bmul64(y1r, h1r);
+    uint64_t z2h = ghash_bmul64(y0r ^ y1r, h0r ^ h1r);
+    z2 ^= z0 ^ z1;
+    z2h ^= z0h ^ z1h;
+    z0h = ghash_rev64(z0h) >> 1;
+    z1h = ghash_rev64(z1h) >> 1;
+    z2h = ghash_rev64(z2h) >> 1;
+    v[0] = z0;
+    v[1] = z0h ^ z2;
+    v[2] = z1 ^ z2h;
+    v[3] = z1h;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <wmmintrin.h>
+#define GHASH_CLMUL
+
+__attribute__((target("pclmul")))
+static void ghash_product_clmul(uint64_t y0, uint64_t y1, uint64_t h0, uint64_t h1, uint64_t* v) {
+    // the same product with the carry-less multiply instruction, which
+    // Crypto++'s own GCM uses too where the processor has it
+    __m128i y = _mm_set_epi64x(static_cast<long long>(y1), static_cast<long long>(y0));
+    __m128i h = _mm_set_epi64x(static_cast<long long>(h1), static_cast<long long>(h0));
+    __m128i low = _mm_clmulepi64_si128(y, h, 0x00);
+    __m128i high = _mm_clmulepi64_si128(y, h, 0x11);
+    __m128i middle = _mm_xor_si128(_mm_clmulepi64_si128(y, h, 0x01), _mm_clmulepi64_si128(y, h, 0x10));
+    v[0] = _mm_cvtsi128_si64(low);
+    v[1] = _mm_cvtsi128_si64(_mm_unpackhi_epi64(low, low)) ^ _mm_cvtsi128_si64(middle);
+    v[2] = _mm_cvtsi128_si64(high) ^ _mm_cvtsi128_si64(_mm_unpackhi_epi64(middle, middle));
+    v[3] = _mm_cvtsi128_si64(_mm_unpackhi_epi64(high, high));
+}
+#endif
+
+// GHASH, the authenticator inside GCM, for BatchDecryptor, which does GCM's
+// AES work itself. Products in GF(2^128) are taken with the carry-less
+// multiply instruction if the processor has one, and otherwise with integer
+// multiplies, after BearSSL's ghash_ctmul64; either way no branch or memory
+// access depends on the hash key or the data. Input is absorbed a block at
+// a time, and the state after each block of a message's start can be saved
+// and restored, so that messages which start alike are only hashed from
+// where they differ.
+class GHash {
+    public:
+        struct State {
+            uint64_t y0, y1; // the running hash, low half and high half
+        };
+
+    private:
+        uint64_t h0, h1; // the hash key, low half and high half
+        State state;
+        void (*product)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t*);
+
+        void multiply() {
+            // state = state * H, reduced modulo GCM's polynomial. GCM's bits
+            // are reflected, so the product is shifted up by one first.
+            uint64_t v[4];
+            product(state.y0, state.y1, h0, h1, v);
+            v[3] = (v[3] << 1) | (v[2] >> 63);
+            v[2] = (v[2] << 1) | (v[1] >> 63);
+            v[1] = (v[1] << 1) | (v[0] >> 63);
+            v[0] = (v[0] << 1);
+            v[2] ^= v[0] ^ (v[0] >> 1) ^ (v[0] >> 2) ^ (v[0] >> 7);
+            v[1] ^= (v[0] << 63) ^ (v[0] << 62) ^ (v[0] << 57);
+            v[3] ^= v[1] ^ (v[1] >> 1) ^ (v[1] >> 2) ^ (v[1] >> 7);
+            v[2] ^= (v[1] << 63) ^ (v[1] << 62) ^ (v[1] << 57);
+            state.y0 = v[2];
+            state.y1 = v[3];
+        }
+
+    public:
+        explicit GHash(const CryptoPP::byte* key) {
+            h1 = load64(key);
+            h0 = load64(key + 8);
+            state.y0 = state.y1 = 0;
+            product = ghash_product_ctmul;
+#ifdef GHASH_CLMUL
+            if(__builtin_cpu_supports("pclmul")) {
+                product = ghash_product_clmul;
+            }
+#endif
+        }
+
+        const State& current() const {
+            return state;
+        }
+
+        void restore(const State& saved) {
+            state = saved;
+        }
+
+        void update(const CryptoPP::byte* data, size_t length) {
+            // absorb data, zero padded to a whole number of blocks
+            const size_t block = CryptoPP::AES::BLOCKSIZE;
+            for(size_t at = 0; at < length; at += block) {
+                CryptoPP::byte padded[block] = {0};
+                std::memcpy(padded, data + at, std::min(block, length - at));
+                state.y1 ^= load64(padded);
+                state.y0 ^= load64(padded + 8);
+                multiply();
+            }
+        }
+
+        void finish(uint64_t aad_length, uint64_t text_length, CryptoPP::byte* digest) {
+            // absorb the lengths in bits, which end every GHASH input
+            state.y1 ^= aad_length * 8;
+            state.y0 ^= text_length * 8;
+            multiply();
+            store64(digest, state.y1);
+            store64(digest + 8, state.y0);
+        }
+};
+
+// Decrypts a batch of ciphertexts under one key with as few calls into AES
+// as there are ciphers. A name is only a block or two, too short for
+// Crypto++'s multi-block AES-NI code to get going on its own, so the blocks
+// of every item are queued first: the counter blocks of the AES-GCM items,
+// and the ciphertext blocks of the AES-CBC ones. run() then puts each kind
+// through AES in a single AdvancedProcessBlocks call for the whole batch,
+// which also XORs in the ciphertexts and tags, and only checks each GCM
+// item's GHASH and each CBC item's padding on its own.
+class BatchDecryptor {
+    private:
+        struct GCMItem {
+            size_t index; // of its plaintext in the results
+            const CryptoPP::byte* text;
+            size_t length;
+            std::string aad;
+            size_t offset; // of its blocks in counters and masked
+        };
+        struct CBCItem {
+            size_t index;
+            size_t offset; // of its blocks in cbc_blocks and cbc_chain
+            size_t length;
+        };
+
+        CryptoPP::AES::Encryption aes_encrypt;
+        CryptoPP::AES::Decryption aes_decrypt;
+        CryptoPP::SecByteBlock hash_key;
+        // per GCM item, the counter block J0 then one per block of text, and
+        // the tag then the text, zero padded; AES turns them into the tag
+        // XOR E(J0), which must equal the GHASH, then the plaintext
+        std::vector<GCMItem> gcm_items;
+        std::vector<CryptoPP::byte> counters;
+        std::vector<CryptoPP::byte> masked;
+        // per CBC item, its ciphertext blocks and the block before each
+        std::vector<CBCItem> cbc_items;
+        std::vector<CryptoPP::byte> cbc_blocks;
+        std::vector<CryptoPP::byte> cbc_chain;
+
+    public:
+        BatchDecryptor(const CryptoPP::SecByteBlock& key)
+            : aes_encrypt(key.data(), key.size()), aes_decrypt(key.data(), key.size()), hash_key(CryptoPP::AES::BLOCKSIZE) {
+            CryptoPP::byte zero[CryptoPP::AES::BLOCKSIZE] = {0};
+            aes_encrypt.ProcessBlock(zero, hash_key.data());
+        }
+
+        void add_gcm(size_t index, const char* ct, size_t length, const std::string& aad) {
+            // ct is the nonce, the ciphertext, then the tag
+            const size_t block = CryptoPP::AES::BLOCKSIZE;
+            const size_t nonce_size = crypto::_impl_details::GCM_NONCE_SIZE;
+            if(length < nonce_size + crypto::_impl_details::GCM_TAG_SIZE) {
+                throw std::runtime_error(DECRYPTION_FAILED);
+            }
+            const CryptoPP::byte* nonce = reinterpret_cast<const CryptoPP::byte*>(ct);
+            GCMItem item = {index, nonce + nonce_size, length - nonce_size - crypto::_impl_details::GCM_TAG_SIZE, aad,
+                            counters.size()};
+            size_t blocks = (item.length + block - 1) / block;
+            for(size_t i = 0; i <= blocks; i++) {
+                // J0 is the nonce then a 32-bit 1, and the text's counters
+                // carry on from it
+                counters.insert(counters.end(), nonce, nonce + nonce_size);
+                uint32_t counter = static_cast<uint32_t>(i + 1);
+                for(int shift = 24; shift >= 0; shift -= 8) {
+                    counters.push_back(static_cast<CryptoPP::byte>(counter >> shift));
+                }
+            }
+            masked.insert(masked.end(), item.text + item.length, item.text + item.length + crypto::_impl_details::GCM_TAG_SIZE);
+            masked.insert(masked.end(), item.text, item.text + item.length);
+            masked.resize(counters.size(), 0);
+            gcm_items.push_back(item);
+        }
+
+        void add_cbc(size_t index, const char* ct, size_t length) {
+            // ct is the IV then the ciphertext
+            const size_t block = CryptoPP::AES::BLOCKSIZE;
+            if(!cbc_length_valid(length)) {
+                throw std::runtime_error(DECRYPTION_FAILED);
+            }
+            const CryptoPP::byte* bytes = reinterpret_cast<const CryptoPP::byte*>(ct);
+            CBCItem item = {index, cbc_blocks.size(), length - block};
+            cbc_blocks.insert(cbc_blocks.end(), bytes + block, bytes + length);
+            cbc_chain.insert(cbc_chain.end(), bytes, bytes + length - block);
+            cbc_items.push_back(item);
+        }
+
+        std::vector<std::string> run(size_t count) {
+            // decrypt every queued item; throws if any fails
+            const size_t block = CryptoPP::AES::BLOCKSIZE;
+            const CryptoPP::word32 flags = CryptoPP::BlockTransformation::BT_AllowParallel;
+            std::vector<std::string> results(count);
+
+            CryptoPP::SecByteBlock opened(masked.size());
+            if(!masked.empty()) {
+                aes_encrypt.AdvancedProcessBlocks(counters.data(), masked.data(), opened.data(), masked.size(), flags);
+            }
+            GHash ghash(hash_key.data());
+            // the GHASH state after each block of the last item's AAD; the
+            // names of one record or one user share their context's first
+            // blocks, which are hashed once. An AAD is no secret, so
+            // comparing them may take as long as it likes.
+            std::vector<GHash::State> aad_states(1, ghash.current());
+            const std::string* last_aad = NULL;
+            for(size_t i = 0; i < gcm_items.size(); i++) {
+                const GCMItem& item = gcm_items[i];
+                const CryptoPP::byte* aad = reinterpret_cast<const CryptoPP::byte*>(item.aad.data());
+                size_t shared = 0;
+                if(last_aad != NULL) {
+                    size_t whole = std::min(item.aad.size(), last_aad->size()) / block;
+                    while(shared < whole && std::memcmp(aad + shared * block, last_aad->data() + shared * block, block) == 0) {
+                        shared++;
+                    }
+                }
+                aad_states.resize(shared + 1);
+                ghash.restore(aad_states[shared]);
+                for(size_t at = shared * block; at < item.aad.size(); at += block) {
+                    ghash.update(aad + at, std::min(block, item.aad.size() - at));
+                    aad_states.push_back(ghash.current());
+                }
+                last_aad = &item.aad;
+
+                CryptoPP::byte digest[block];
+                ghash.update(item.text, item.length);
+                ghash.finish(item.aad.size(), item.length, digest);
+                if(!CryptoPP::VerifyBufsEqual(digest, opened.data() + item.offset, block)) {
+                    throw std::runtime_error(DECRYPTION_FAILED);
+                }
+                results[item.index].assign(reinterpret_cast<const char*>(opened.data() + item.offset + block), item.length);
+            }
+
+            CryptoPP::SecByteBlock plain(cbc_blocks.size());
+            if(!cbc_blocks.empty()) {
+                aes_decrypt.AdvancedProcessBlocks(cbc_blocks.data(), cbc_chain.data(), plain.data(), cbc_blocks.size(), flags);
+            }
+            for(size_t i = 0; i < cbc_items.size(); i++) {
+                const CBCItem& item = cbc_items[i];
+                const CryptoPP::byte* text = plain.data() + item.offset;
+                results[item.index].assign(reinterpret_cast<const char*>(text), item.length - cbc_padding(text, item.length));
+            }
+            return results;
+        }
+};
+
+std::vector<std::string> crypto::auth_decrypt_batch(const std::vector<crypto::CiphertextView>& cts, const CryptoPP::SecByteBlock key,
+                                                    bool legacy) {
+    metrics::Timer timer(metrics::CRYPTO_DECRYPT);
+    if(metrics::enabled()) {
+        for(size_t i = 0; i < cts.size(); i++) {
+            metrics::add(metrics::CRYPTO_BYTES_DECRYPTED, cts[i].length);
+        }
+    }
+    BatchDecryptor decryptor(key);
+    const std::string gcm_tag(1, static_cast<char>(crypto::CIPHER_AES_GCM));
+    for(size_t i = 0; i < cts.size(); i++) {
+        if(cts[i].length < 1) {
+            throw std::runtime_error(DECRYPTION_FAILED);
+        }
+        if(crypto::is_bound(cts[i].data, cts[i].length) && cipher_of(cts[i].data) == crypto::CIPHER_AES_GCM) {
+            decryptor.add_gcm(i, cts[i].data + 1, cts[i].length - 1, std::string(1, cts[i].data[0]) + cts[i].context);
+            continue;
+        }
+        if(!legacy) {
+            throw std::runtime_error("ciphertext is not bound to its record");
+        }
+        switch(static_cast<CryptoPP::byte>(cts[i].data[0])) {
+            case crypto::CIPHER_AES_GCM:
+                decryptor.add_gcm(i, cts[i].data + 1, cts[i].length - 1, gcm_tag);
+                break;
+            case crypto::CIPHER_AES_CBC:
+                decryptor.add_cbc(i, cts[i].data + 1, cts[i].length - 1);
+                break;
+            default:
+                throw std::runtime_error("unknown cipher tag");
+        }
+    }
+    return decryptor.run(cts.size());
+}
+
+std::vector<std::string> crypto::raw_decrypt_batch(const std::vector<crypto::CiphertextView>& cts, const CryptoPP::SecByteBlock key) {
+    metrics::Timer timer(metrics::CRYPTO_DECRYPT);
+    if(metrics::enabled()) {
+        for(size_t i = 0; i < cts.size(); i++) {
+            metrics::add(metrics::CRYPTO_BYTES_DECRYPTED, cts[i].length);
+        }
+    }
+    BatchDecryptor decryptor(key);
+    for(size_t i = 0; i < cts.size(); i++) {
+        decryptor.add_cbc(i, cts[i].data, cts[i].length);
+    }
+    return decryptor.run(cts.size());
+}
+
 CryptoPP::SecByteBlock crypto::master_keygen(const std::string& uname, const std::string& pwd) {
     /*
     * generate a master key for the user with username "uname", using password
     * "pwd" and "uname" as the salt
     */
+    metrics::Timer timer(metrics::CRYPTO_KEYGEN);
     return crypto::_impl_details::keygen_hkdf_sha3(pwd, uname);
 }
 
@@ -155,8 +761,15 @@ std::string crypto::random_token() {
     /*
     * Generate a cryptographically secure random hash
     */
-    CryptoPP::SecByteBlock token(CryptoPP::AES::BLOCKSIZE);
-    CryptoPP::AutoSeededRandomPool rgen;
-    rgen.GenerateBlock(token, token.size());
+    CryptoPP::SecByteBlock token = crypto::random_block(CryptoPP::AES::BLOCKSIZE);
     return crypto::hash(crypto::_impl_details::bytes_to_string(token));
+}
+
+CryptoPP::SecByteBlock crypto::random_block(size_t size) {
+    /*
+    * Generate size cryptographically secure random bytes, e.g. for a new key
+    */
+    CryptoPP::SecByteBlock result(size);
+    crypto::_impl_details::random_fill(result, result.size());
+    return result;
 }
\ No newline at end of file
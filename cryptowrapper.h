@@ -1,3 +1,4 @@
+#include <vector>
 #include "cryptopp890/secblock.h"
 
 namespace crypto {
@@ -10,18 +11,99 @@ namespace crypto {
         std::string bytes_to_string(const CryptoPP::SecByteBlock bytes);
         CryptoPP::SecByteBlock string_to_bytes(const std::string& str);
 
+        // A long-lived generator for the calling thread, reseeded from the
+        // OS after every RNG_RESEED_BYTES of output and after a fork()
+        const size_t RNG_RESEED_BYTES = 1 << 20;
+        void random_fill(CryptoPP::byte* output, size_t size);
+
+        std::string hex_encode(const std::string& bytes);
+        std::string hex_decode(const std::string& str);
+
         std::string sha3_hash(const std::string& str);
+        std::string sha3_hash_raw(const std::string& str);
         std::string aes_cbc_encrypt(const std::string& str, const CryptoPP::SecByteBlock key);
         std::string aes_cbc_decrypt(const std::string& str, const CryptoPP::SecByteBlock key);
-        std::string aes_cbc_auth_encrypt(const std::string& str, const CryptoPP::SecByteBlock key);
-        std::string aes_cbc_auth_decrypt(const std::string& str, const CryptoPP::SecByteBlock key);
+        std::string aes_cbc_encrypt_raw(const std::string& str, const CryptoPP::SecByteBlock key);
+        std::string aes_cbc_decrypt_raw(const std::string& str, const CryptoPP::SecByteBlock key);
+        std::string aes_cbc_decrypt_raw(const char* ct, size_t length, const CryptoPP::SecByteBlock key);
+        // AES-GCM: encryption and authentication in a single pass. The
+        // result is the nonce, the ciphertext, then the tag; aad is
+        // authenticated but not stored
+        const size_t GCM_NONCE_SIZE = 12;
+        const size_t GCM_TAG_SIZE = 16;
+        std::string aes_gcm_encrypt(const std::string& str, const CryptoPP::SecByteBlock key, const std::string& aad);
+        std::string aes_gcm_decrypt(const char* ct, size_t length, const CryptoPP::SecByteBlock key, const std::string& aad);
         CryptoPP::SecByteBlock keygen_hkdf_sha3(const std::string& str, const std::string& salt);
     }
 
     std::string hash(const std::string& str);
     std::string encrypt(const std::string& str, const CryptoPP::SecByteBlock key);
     std::string decrypt(const std::string& ct, const CryptoPP::SecByteBlock key);
+
+    // raw_* variants work on unencoded bytes: the digest, or the IV followed
+    // by the ciphertext. hash/encrypt/decrypt are their hex-encoded forms.
+    std::string raw_hash(const std::string& str);
+    std::string raw_encrypt(const std::string& str, const CryptoPP::SecByteBlock key);
+    std::string raw_decrypt(const std::string& ct, const CryptoPP::SecByteBlock key);
+    std::string raw_decrypt(const char* ct, size_t length, const CryptoPP::SecByteBlock key);
+    std::string hex_encode(const std::string& bytes);
+    std::string hex_decode(const std::string& str);
+
+    // auth_encrypt produces an authenticated ciphertext: a one-byte cipher
+    // tag followed by an AES-GCM encryption. auth_decrypt reads any tagged
+    // ciphertext; CIPHER_AES_CBC marks legacy raw_encrypt output that was
+    // tagged in place and is decrypted without authentication.
+    const CryptoPP::byte CIPHER_AES_CBC = 0x00;
+    const CryptoPP::byte CIPHER_AES_GCM = 0x01;
+    std::string auth_encrypt(const std::string& str, const CryptoPP::SecByteBlock key);
+    std::string auth_decrypt(const std::string& ct, const CryptoPP::SecByteBlock key);
+    std::string auth_decrypt(const char* ct, size_t length, const CryptoPP::SecByteBlock key);
+    bool is_authenticated(const char* ct, size_t length);
+
+    // Chunked records are stored as a series of separately encrypted chunks
+    // plus a manifest, which is tagged CIPHER_CHUNKED but otherwise encrypted
+    // like auth_encrypt. The context variants also authenticate context,
+    // e.g. a chunk's position in its record, which must then be given again
+    // to decrypt: a chunk moved to another position fails authentication.
+    const CryptoPP::byte CIPHER_CHUNKED = 0x02;
+    std::string auth_encrypt(const std::string& str, const CryptoPP::SecByteBlock key, const std::string& context,
+                             CryptoPP::byte tag = CIPHER_AES_GCM);
+    std::string auth_decrypt(const char* ct, size_t length, const CryptoPP::SecByteBlock key, const std::string& context);
+    bool is_chunked(const char* ct, size_t length);
+
+    // CIPHER_AES_GCM_ENCODED marks an AES-GCM ciphertext of data that was
+    // compressed before encryption (see compression.h). auth_decrypt returns
+    // such data still compressed; is_encoded tells the caller to decompress.
+    const CryptoPP::byte CIPHER_AES_GCM_ENCODED = 0x03;
+    bool is_encoded(const char* ct, size_t length);
+
+    // CIPHER_BOUND is set in the tag of a GCM ciphertext whose context names
+    // where it is stored, e.g. the record it belongs to, so that one sealed
+    // before that was done can be told apart by its tag alone. The context
+    // variant of auth_decrypt reads tags with or without it.
+    const CryptoPP::byte CIPHER_BOUND = 0x80;
+    bool is_bound(const char* ct, size_t length);
+
+    // Batch decryption of many ciphertexts under one key, e.g. all of a
+    // user's record names: the key schedule is set up once, and the AES
+    // blocks of every item go through AES together, in one call per cipher,
+    // so that AES-NI can work on several blocks at once even though each
+    // name is only a block or two. Each item's tag or padding is then
+    // checked on its own. Each CiphertextView refers to the caller's buffer, which must outlive the
+    // call. A bound item is decrypted under its context; items that aren't
+    // bound (AES-CBC, or GCM sealed without a context) are refused unless
+    // legacy is set. Throws if any item fails to decrypt.
+    struct CiphertextView {
+        const char* data;
+        size_t length;
+        std::string context;
+    };
+    std::vector<std::string> auth_decrypt_batch(const std::vector<CiphertextView>& cts, const CryptoPP::SecByteBlock key,
+                                                bool legacy);
+    std::vector<std::string> raw_decrypt_batch(const std::vector<CiphertextView>& cts, const CryptoPP::SecByteBlock key);
+
     CryptoPP::SecByteBlock master_keygen(const std::string& uname, const std::string& pwd);
 
     std::string random_token();
+    CryptoPP::SecByteBlock random_block(size_t size);
 }
\ No newline at end of file
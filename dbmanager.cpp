@@ -1,114 +1,904 @@
 #include "sqlite/sqlite3.h"
 #include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <strings.h>
 #include <iostream>
 #include <sstream>
+#include <iomanip>
 #include <string>
 #include <vector>
 #include <stdexcept>
 #include <map>
 #include <set>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <atomic>
 #include "dbmanager.h"
 #include "cryptowrapper.h"
-#include "cryptopp890/osrng.h"
+#include "compression.h"
+#include "schema.h"
+#include "metrics.h"
+#include "cryptopp890/aes.h"
+
+// the slow query log's settings, shared by every connection
+static std::atomic<sqlite3_int64> slow_query_threshold(0); // nanoseconds; 0 when off
+static std::mutex slow_query_lock; // guards the rest
+static std::ostream* slow_query_out = NULL;
+static bool slow_query_explain = false;
+static std::set<std::string> slow_queries_explained;
 
 DB::DB() {
     db = NULL;
+    transaction_depth = 0;
+    cache_hits = 0;
+    cache_misses = 0;
 }
 
-DB::DB(const char* dbname) {
-    // open up a new SQLite3 database by initiating sqlite3* db
-    int r = sqlite3_open(dbname, &db);
-    if(r != 0) { // couldn't open the database properly
+DB::DB(const char* dbname, const DBOptions& options) {
+    /*
+    * Open up a new SQLite3 database by initiating sqlite3* db, and configure
+    * the connection as options asks.
+    * @results throws std::runtime_error if the database can't be opened or
+        options can't be applied
+    */
+    cache_hits = 0;
+    cache_misses = 0;
+    transaction_depth = 0;
+    int flags = options.read_only ? SQLITE_OPEN_READONLY : (SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE);
+    int r = sqlite3_open_v2(dbname, &db, flags, NULL);
+    if(r != SQLITE_OK) { // couldn't open the database properly
+        std::string error = (db != NULL) ? sqlite3_errmsg(db) : "out of memory";
+        sqlite3_close(db);
+        db = NULL;
+        throw std::runtime_error("unable to open database: " + error);
+    }
+    // wait out other processes' locks rather than failing at once
+    sqlite3_busy_handler(db, &DB::busy_wait, NULL);
+    try {
+        configure(options);
+    } catch(...) {
+        // the destructor won't run for a half-built DB
+        clear_statement_cache();
         sqlite3_close(db);
+        db = NULL;
+        throw;
+    }
+    if(slow_query_threshold.load(std::memory_order_relaxed) > 0) {
+        // the vector stays put when the DB is moved, so SQLite can hold on
+        // to it
+        slow_queries.reset(new std::vector<SlowQuery>());
+        sqlite3_trace_v2(db, SQLITE_TRACE_PROFILE, &DB::profile, slow_queries.get());
+    }
+}
+
+static void check_pragma_value(const std::string& value, const std::vector<std::string>& allowed) {
+    // pragma values can't be bound as arguments, so only known words may be
+    // spliced into the query
+    for(size_t i = 0; i < allowed.size(); i++) {
+        if(strcasecmp(value.c_str(), allowed[i].c_str()) == 0) {
+            return;
+        }
+    }
+    throw std::runtime_error("invalid database option: " + value);
+}
+
+void DB::configure(const DBOptions& options) {
+    // page_size has to be set before anything else touches a new database
+    // a read-only connection can change neither it nor the journal mode
+    if(options.page_size != 0 && !options.read_only) {
+        prepared_query("PRAGMA page_size = " + std::to_string(options.page_size), ArgumentList({}));
+    }
+    if(!options.journal_mode.empty() && !options.read_only) {
+        check_pragma_value(options.journal_mode, {"DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF"});
+        prepared_query("PRAGMA journal_mode = " + options.journal_mode, ArgumentList({}));
+    }
+    if(!options.synchronous.empty()) {
+        check_pragma_value(options.synchronous, {"OFF", "NORMAL", "FULL", "EXTRA"});
+        prepared_query("PRAGMA synchronous = " + options.synchronous, ArgumentList({}));
+    }
+    if(options.mmap_size != 0) {
+        prepared_query("PRAGMA mmap_size = " + std::to_string(options.mmap_size), ArgumentList({}));
+    }
+    if(options.cache_size != 0) {
+        prepared_query("PRAGMA cache_size = " + std::to_string(options.cache_size), ArgumentList({}));
+    }
+    if(!options.temp_store.empty()) {
+        check_pragma_value(options.temp_store, {"DEFAULT", "FILE", "MEMORY"});
+        prepared_query("PRAGMA temp_store = " + options.temp_store, ArgumentList({}));
     }
 }
 
+DBOptions DB::effective_options() {
+    /*
+    * Read back the settings SQLite is actually using for this connection,
+    * which may differ from those asked for: e.g. a database in use by other
+    * connections can't leave WAL mode, mmap_size is capped at compile time,
+    * and page_size only changes for a new database.
+    */
+    static const char* synchronous_names[] = {"OFF", "NORMAL", "FULL", "EXTRA"};
+    static const char* temp_store_names[] = {"DEFAULT", "FILE", "MEMORY"};
+    DBOptions effective;
+    query_rows("PRAGMA journal_mode", ArgumentList({}), [&](const DBRow& row) {
+        effective.journal_mode = row[0];
+        for(size_t i = 0; i < effective.journal_mode.size(); i++) {
+            effective.journal_mode[i] = std::toupper(effective.journal_mode[i]);
+        }
+    });
+    query_rows("PRAGMA synchronous", ArgumentList({}), [&](const DBRow& row) {
+        sqlite3_int64 level = row.integer(0);
+        effective.synchronous = (level >= 0 && level <= 3) ? synchronous_names[level] : row[0];
+    });
+    query_rows("PRAGMA mmap_size", ArgumentList({}), [&](const DBRow& row) {
+        effective.mmap_size = row.integer(0);
+    });
+    query_rows("PRAGMA cache_size", ArgumentList({}), [&](const DBRow& row) {
+        effective.cache_size = row.integer(0);
+    });
+    query_rows("PRAGMA page_size", ArgumentList({}), [&](const DBRow& row) {
+        effective.page_size = row.integer(0);
+    });
+    query_rows("PRAGMA temp_store", ArgumentList({}), [&](const DBRow& row) {
+        sqlite3_int64 store = row.integer(0);
+        effective.temp_store = (store >= 0 && store <= 2) ? temp_store_names[store] : row[0];
+    });
+    effective.read_only = sqlite3_db_readonly(db, "main") == 1;
+    return effective;
+}
+
+DBOptions::DBOptions() {
+    mmap_size = 0;
+    cache_size = 0;
+    page_size = 0;
+    read_only = false;
+}
+
+DBOptions DBOptions::durable() {
+    DBOptions options;
+    options.journal_mode = "DELETE";
+    options.synchronous = "FULL";
+    return options;
+}
+
+DBOptions DBOptions::balanced() {
+    DBOptions options;
+    options.journal_mode = "WAL";
+    options.synchronous = "NORMAL"; // in WAL mode, still safe against corruption
+    options.mmap_size = 256 << 20;
+    options.cache_size = -16384; // 16 MiB
+    options.temp_store = "MEMORY";
+    return options;
+}
+
+DBOptions DBOptions::bulk_load() {
+    DBOptions options;
+    options.journal_mode = "MEMORY";
+    options.synchronous = "OFF";
+    options.mmap_size = 256 << 20;
+    options.cache_size = -65536; // 64 MiB
+    options.temp_store = "MEMORY";
+    return options;
+}
+
+std::string DBOptions::describe() const {
+    // one "name=value" per setting, leaving out those left at SQLite's default
+    std::ostringstream out;
+    std::string separator = "";
+    if(!journal_mode.empty()) {
+        out << separator << "journal_mode=" << journal_mode;
+        separator = " ";
+    }
+    if(!synchronous.empty()) {
+        out << separator << "synchronous=" << synchronous;
+        separator = " ";
+    }
+    if(mmap_size != 0) {
+        out << separator << "mmap_size=" << mmap_size;
+        separator = " ";
+    }
+    if(cache_size != 0) {
+        out << separator << "cache_size=" << cache_size;
+        separator = " ";
+    }
+    if(page_size != 0) {
+        out << separator << "page_size=" << page_size;
+        separator = " ";
+    }
+    if(!temp_store.empty()) {
+        out << separator << "temp_store=" << temp_store;
+        separator = " ";
+    }
+    if(read_only) {
+        out << separator << "read_only";
+    }
+    return out.str();
+}
+
 DB::DB(DB&& database) {
-    // move database's db pointer into current object
-    sqlite3_close(db);
+    // move database's db pointer and statement cache into current object
     db = database.db;
+    statement_cache.swap(database.statement_cache);
+    statement_index.swap(database.statement_index);
+    cache_hits = database.cache_hits;
+    cache_misses = database.cache_misses;
+    transaction_depth = database.transaction_depth;
+    slow_queries = std::move(database.slow_queries);
     database.db = NULL;
+    database.cache_hits = 0;
+    database.cache_misses = 0;
+    database.transaction_depth = 0;
 }
 
 DB& DB::operator=(DB&& database) {
-    // move database's db pointer into current object
+    // move database's db pointer and statement cache into current object
+    // our own statements must be finalized before our connection can close
+    clear_statement_cache();
     sqlite3_close(db);
     db = database.db;
+    statement_cache.swap(database.statement_cache);
+    statement_index.swap(database.statement_index);
+    cache_hits = database.cache_hits;
+    cache_misses = database.cache_misses;
+    transaction_depth = database.transaction_depth;
+    slow_queries = std::move(database.slow_queries);
     database.db = NULL;
+    database.cache_hits = 0;
+    database.cache_misses = 0;
+    database.transaction_depth = 0;
     return *this;
 }
 
 DB::~DB() {
-    // close the database
+    // finalize all cached statements, then close the database
+    clear_statement_cache();
     sqlite3_close(db);
 }
 
+static void busy_backoff(size_t attempt) {
+    /*
+    * Sleep before retrying something that found the database locked: twice
+    * as long on each attempt up to a cap, and randomised so that processes
+    * that collided once don't retry in lockstep and collide again.
+    */
+    const unsigned max_delay_us = 50000;
+    unsigned delay_us = (attempt < 10) ? (100u << attempt) : max_delay_us;
+    if(delay_us > max_delay_us) {
+        delay_us = max_delay_us;
+    }
+    unsigned jitter;
+    crypto::_impl_details::random_fill(reinterpret_cast<CryptoPP::byte*>(&jitter), sizeof(jitter));
+    delay_us = delay_us / 2 + jitter % (delay_us / 2 + 1);
+    std::this_thread::sleep_for(std::chrono::microseconds(delay_us));
+}
+
+int DB::busy_wait(void*, int attempts) {
+    // SQLite's busy handler: returning nonzero retries the locked operation,
+    // zero gives up and reports SQLITE_BUSY
+    if(attempts >= BUSY_RETRY_LIMIT) {
+        return 0;
+    }
+    busy_backoff(attempts);
+    return 1;
+}
+
+void DB::log_slow_queries(double threshold_ms, std::ostream* out, bool explain) {
+    std::lock_guard<std::mutex> guard(slow_query_lock);
+    slow_query_out = (threshold_ms > 0) ? out : NULL;
+    slow_query_explain = explain;
+    slow_queries_explained.clear();
+    sqlite3_int64 threshold = static_cast<sqlite3_int64>(threshold_ms * 1000000);
+    slow_query_threshold.store((out != NULL && threshold_ms > 0) ? std::max<sqlite3_int64>(threshold, 1000000) : 0);
+}
+
+std::string DB::normalize_sql(const std::string& sql) {
+    /*
+    * Reduce sql to its shape: literal numbers, strings and blobs become ?,
+    * as bound arguments already are, and runs of whitespace become a single
+    * space. Statements that differ only in their values then read the same.
+    */
+    std::string result;
+    bool in_identifier = false; // a literal can't start part way through a name
+    for(size_t i = 0; i < sql.size(); i++) {
+        char c = sql[i];
+        if(std::isspace(static_cast<unsigned char>(c))) {
+            if(!result.empty() && result.back() != ' ') {
+                result += ' ';
+            }
+            in_identifier = false;
+            continue;
+        }
+        bool blob = (c == 'x' || c == 'X') && !in_identifier && i + 1 < sql.size() && sql[i + 1] == '\'';
+        if(c == '\'' || blob) {
+            i += blob ? 2 : 1;
+            while(i < sql.size() && !(sql[i] == '\'' && (i + 1 >= sql.size() || sql[i + 1] != '\''))) {
+                i += (sql[i] == '\'') ? 2 : 1; // '' is an escaped quote
+            }
+            result += '?';
+            in_identifier = false;
+            continue;
+        }
+        if(std::isdigit(static_cast<unsigned char>(c)) && !in_identifier) {
+            while(i + 1 < sql.size() && (std::isalnum(static_cast<unsigned char>(sql[i + 1])) || sql[i + 1] == '.')) {
+                i++;
+            }
+            result += '?';
+            continue;
+        }
+        in_identifier = std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+        result += c;
+    }
+    if(!result.empty() && result.back() == ' ') {
+        result.erase(result.size() - 1);
+    }
+    return result;
+}
+
+int DB::profile(unsigned type, void* context, void* statement, void* elapsed) {
+    /*
+    * SQLite's profile callback, run as each statement finishes. Nothing may
+    * be run on the connection from in here, so a slow statement is only
+    * noted, for log_pending_slow_queries to write out.
+    */
+    sqlite3_int64 threshold = slow_query_threshold.load(std::memory_order_relaxed);
+    sqlite3_int64 nanoseconds = *static_cast<sqlite3_int64*>(elapsed);
+    if(type != SQLITE_TRACE_PROFILE || threshold == 0 || nanoseconds < threshold) {
+        return 0;
+    }
+    sqlite3_stmt* pstmt = static_cast<sqlite3_stmt*>(statement);
+    SlowQuery slow;
+    const char* sql = sqlite3_sql(pstmt);
+    slow.sql = (sql != NULL) ? sql : "";
+    slow.nanoseconds = nanoseconds;
+    slow.full_scan_steps = sqlite3_stmt_status(pstmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0);
+    slow.vm_steps = sqlite3_stmt_status(pstmt, SQLITE_STMTSTATUS_VM_STEP, 0);
+    static_cast<std::vector<SlowQuery>*>(context)->push_back(slow);
+    return 0;
+}
+
+std::string DB::explain_query_plan(const std::string& q) {
+    // the plan SQLite picks for q, one step per line, indented under the
+    // step it is part of; empty if q can't be explained
+    sqlite3_stmt* pstmt;
+    if(sqlite3_prepare_v2(db, ("EXPLAIN QUERY PLAN " + q).c_str(), -1, &pstmt, NULL) != SQLITE_OK) {
+        return "";
+    }
+    std::string plan;
+    std::map<int, int> depth; // of each step, by id
+    while(sqlite3_step(pstmt) == SQLITE_ROW) {
+        int id = sqlite3_column_int(pstmt, 0);
+        int parent = sqlite3_column_int(pstmt, 1);
+        depth[id] = depth.count(parent) ? depth[parent] + 1 : 0;
+        const unsigned char* detail = sqlite3_column_text(pstmt, 3);
+        plan += "  plan: " + std::string(2 * depth[id], ' ') + (detail ? reinterpret_cast<const char*>(detail) : "") + '\n';
+    }
+    sqlite3_finalize(pstmt);
+    return plan;
+}
+
+void DB::log_pending_slow_queries() {
+    /*
+    * Write out the slow statements this connection has noted, now that the
+    * query that ran them is finished and the connection is free to explain
+    * them.
+    */
+    if(!slow_queries || slow_queries->empty()) {
+        return;
+    }
+    std::vector<SlowQuery> pending;
+    pending.swap(*slow_queries);
+    for(size_t i = 0; i < pending.size(); i++) {
+        std::string sql = normalize_sql(pending[i].sql);
+        bool explain;
+        {
+            std::lock_guard<std::mutex> guard(slow_query_lock);
+            explain = slow_query_explain && slow_queries_explained.insert(sql).second;
+        }
+        std::string plan = explain ? explain_query_plan(pending[i].sql) : "";
+
+        std::ostringstream entry;
+        entry << "slow query: " << std::fixed << std::setprecision(3) << pending[i].nanoseconds / 1e6 << " ms, "
+              << pending[i].full_scan_steps << " rows stepped in full scans, " << pending[i].vm_steps
+              << " vm steps: " << sql << '\n' << plan;
+        std::lock_guard<std::mutex> guard(slow_query_lock);
+        if(slow_query_out != NULL) {
+            *slow_query_out << entry.str() << std::flush;
+        }
+    }
+}
+
 sqlite3* DB::get_db() {
     // for debugging only
     return db;
 }
 
-DBTable DB::prepared_query(std::string q, const ArgumentList& args) {
+size_t DB::statement_cache_hits() const {
+    return cache_hits;
+}
+
+size_t DB::statement_cache_misses() const {
+    return cache_misses;
+}
+
+sqlite3_stmt* DB::acquire_statement(const std::string& q) {
     /*
-    * Execute a prepared query with respect to the currently active database.
-    * @arguments
-    * ~ q: contains a prepared query string
-    * ~ args: contains a list of arguments, which will be binded to the
-        prepared values in the query q
-    * @expects args.size() == number of '?'s in q
-    * @returns DBTable containing results of query on success, throws
-        std::runtime_error on failure
+    * Look up the compiled statement for q in the statement cache, compiling
+    * and caching it if it isn't there yet. The least recently used statement
+    * is finalized once the cache holds more than STATEMENT_CACHE_SIZE entries.
+    * @returns a statement with no bindings, ready to be bound and stepped;
+        throws std::runtime_error if q cannot be compiled
     */
+    std::map<std::string, StatementList::iterator>::iterator found = statement_index.find(q);
+    bool in_use = false;
+    if(found != statement_index.end()) {
+        if(!sqlite3_stmt_busy(found->second->second)) {
+            // move the statement to the front of the LRU list
+            statement_cache.splice(statement_cache.begin(), statement_cache, found->second);
+            cache_hits++;
+            return found->second->second;
+        }
+        // the cached copy is mid-iteration in an enclosing query_rows;
+        // compile a private copy that release_statement will finalize
+        in_use = true;
+    }
+
     sqlite3_stmt* pstmt;
     int e = sqlite3_prepare_v2(db, q.c_str(), q.size(), &pstmt, NULL);
+    if(e == SQLITE_BUSY || e == SQLITE_LOCKED) {
+        throw DBBusy("unable to prepare statement: database is locked");
+    }
     if(e != SQLITE_OK) {
         std::cerr << "Internal error: " << sqlite3_errmsg(db) << '\n';
         throw std::runtime_error("unable to prepare statement");
     }
+    cache_misses++;
+    if(in_use) {
+        return pstmt;
+    }
+
+    statement_cache.push_front(std::make_pair(q, pstmt));
+    statement_index[q] = statement_cache.begin();
+    if(statement_cache.size() > STATEMENT_CACHE_SIZE) {
+        // evict the least recently used statement that isn't being stepped
+        for(StatementList::iterator i = --statement_cache.end(); i != statement_cache.begin(); i--) {
+            if(!sqlite3_stmt_busy(i->second)) {
+                sqlite3_finalize(i->second);
+                statement_index.erase(i->first);
+                statement_cache.erase(i);
+                break;
+            }
+        }
+    }
+    return pstmt;
+}
+
+void DB::release_statement(const std::string& q, sqlite3_stmt* pstmt) {
+    // return a cached statement to a clean state for its next use, or
+    // finalize it if it was compiled outside the cache. The statement is
+    // looked up by the key it was acquired under, q, not by the SQL text
+    // SQLite hands back, which needn't match it byte for byte
+    std::map<std::string, StatementList::iterator>::iterator found = statement_index.find(q);
+    if(found == statement_index.end() || found->second->second != pstmt) {
+        sqlite3_finalize(pstmt);
+        return;
+    }
+    sqlite3_reset(pstmt);
+    sqlite3_clear_bindings(pstmt);
+}
+
+void DB::clear_statement_cache() {
+    for(StatementList::iterator i = statement_cache.begin(); i != statement_cache.end(); i++) {
+        sqlite3_finalize(i->second);
+    }
+    statement_cache.clear();
+    statement_index.clear();
+}
+
+DBArgument::DBArgument(Type t) {
+    type = t;
+    owns = false;
+    data = NULL;
+    length = 0;
+    integer_value = 0;
+}
+
+DBArgument::DBArgument(const std::string& v) : DBArgument(TEXT) {
+    data = v.data();
+    length = v.size();
+}
+
+DBArgument::DBArgument(std::string&& v) : DBArgument(TEXT) {
+    owns = true;
+    owned = std::move(v);
+    length = owned.size();
+}
+
+DBArgument::DBArgument(const char* v) : DBArgument(TEXT) {
+    data = v;
+    length = std::strlen(v);
+}
+
+DBArgument DBArgument::text(const char* v, size_t n) {
+    DBArgument result(TEXT);
+    result.data = v;
+    result.length = n;
+    return result;
+}
+
+DBArgument DBArgument::blob(const std::string& bytes) {
+    return blob(bytes.data(), bytes.size());
+}
+
+DBArgument DBArgument::blob(std::string&& bytes) {
+    DBArgument result(std::move(bytes));
+    result.type = BLOB;
+    return result;
+}
+
+DBArgument DBArgument::blob(const void* bytes, size_t n) {
+    DBArgument result(BLOB);
+    result.data = reinterpret_cast<const char*>(bytes);
+    result.length = n;
+    return result;
+}
+
+DBArgument DBArgument::integer(sqlite3_int64 v) {
+    DBArgument result(INTEGER);
+    result.integer_value = v;
+    return result;
+}
+
+DBArgument DBArgument::null() {
+    return DBArgument(NULL_VALUE);
+}
+
+DBArgument::Type DBArgument::get_type() const {
+    return type;
+}
+
+const char* DBArgument::get_data() const {
+    // owned values are looked up on every call, since copying or moving the
+    // argument moves the owned string's buffer
+    return owns ? owned.data() : data;
+}
+
+size_t DBArgument::get_size() const {
+    return length;
+}
+
+sqlite3_int64 DBArgument::get_integer() const {
+    return integer_value;
+}
+
+std::string DBView::str() const {
+    return std::string(data, size);
+}
+
+DBRow::DBRow(sqlite3_stmt* stmt) {
+    pstmt = stmt;
+}
+
+int DBRow::size() const {
+    return sqlite3_column_count(pstmt);
+}
+
+std::string DBRow::operator[](int i) const {
+    // copy column i of the current row; NULL columns read as ""
+    return view(i).str();
+}
+
+DBView DBRow::view(int i) const {
+    // point at column i of the current row in place. BLOB columns are read
+    // byte for byte, including any embedded NULs; NULL columns are empty.
+    // note: a cast is necessary because SQLite hands out const void* and
+    // const unsigned char* buffers
+    DBView result;
+    int type = sqlite3_column_type(pstmt, i);
+    const void* colData = NULL;
+    if(type == SQLITE_BLOB) {
+        colData = sqlite3_column_blob(pstmt, i);
+    } else if(type != SQLITE_NULL) {
+        colData = sqlite3_column_text(pstmt, i);
+    }
+    result.size = (colData == NULL) ? 0 : sqlite3_column_bytes(pstmt, i);
+    result.data = (colData == NULL) ? "" : reinterpret_cast<const char*>(colData);
+    return result;
+}
+
+sqlite3_int64 DBRow::integer(int i) const {
+    return sqlite3_column_int64(pstmt, i);
+}
+
+bool DBRow::is_blob(int i) const {
+    return sqlite3_column_type(pstmt, i) == SQLITE_BLOB;
+}
+
+bool DBRow::is_null(int i) const {
+    return sqlite3_column_type(pstmt, i) == SQLITE_NULL;
+}
+
+void DB::query_rows(std::string q, const ArgumentList& args, const RowVisitor& visit) {
+    /*
+    * Execute a prepared query with respect to the currently active database,
+    * handing each result row to visit as soon as it is stepped, rather than
+    * collecting the whole result set first.
+    * @arguments
+    * ~ q: contains a prepared query string
+    * ~ args: contains a list of arguments, which will be binded to the
+        prepared values in the query q
+    * ~ visit: called once per result row, in order. The DBRow it receives is
+        only valid during that call.
+    * @expects args.size() == number of '?'s in q
+    * @results throws std::runtime_error on failure, or DBBusy if the
+        database stayed locked; exceptions thrown by visit stop the query and
+        are passed on to the caller
+    */
+    // the time spent in visit is the caller's, not SQLite's
+    metrics::Timer timer(metrics::SQL_QUERY);
+    sqlite3_stmt* pstmt = acquire_statement(q);
+    // a cached statement's counters run on from its last use; start them
+    // again so that they describe this run alone
+    sqlite3_stmt_status(pstmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 1);
+    sqlite3_stmt_status(pstmt, SQLITE_STMTSTATUS_VM_STEP, 1);
+
     // bind all arguments in the ArgumentList to the query
+    // SQLITE_STATIC: SQLite reads the argument buffers in place, which is
+    // safe because they outlive the query
     for(size_t i = 0; i < args.size(); i++) {
-        if(sqlite3_bind_text(pstmt, i+1, args[i].c_str(), -1, SQLITE_STATIC) != SQLITE_OK) {
+        int e;
+        switch(args[i].get_type()) {
+            case DBArgument::BLOB:
+                e = sqlite3_bind_blob(pstmt, i+1, args[i].get_data(), args[i].get_size(), SQLITE_STATIC);
+                break;
+            case DBArgument::INTEGER:
+                e = sqlite3_bind_int64(pstmt, i+1, args[i].get_integer());
+                break;
+            case DBArgument::NULL_VALUE:
+                e = sqlite3_bind_null(pstmt, i+1);
+                break;
+            default:
+                e = sqlite3_bind_text(pstmt, i+1, args[i].get_data(), args[i].get_size(), SQLITE_STATIC);
+        }
+        if(e != SQLITE_OK) {
+            release_statement(q, pstmt);
             throw std::runtime_error("unable to bind argument");
         }
     }
 
-    // now, add results into the DBTable. 
-    DBTable result;
-
     int s;
+    std::uint64_t rows = 0;
     while((s = sqlite3_step(pstmt)) != SQLITE_DONE) {
         if(s == SQLITE_ROW) {
-            // we've hit a new row, create one to add to the DBTable
-            std::vector<std::string> row;
-            int colNum = sqlite3_column_count(pstmt);
-
-            // go through every column in the current row, and insert it into
-            // the variable "row"
-            for(int i = 0; i < colNum; i++) {
-                // insert the current column value into our row
-                // note: a cast is necessary because the std::string
-                // constructor can't interpret a const unsigned char*
-                if(sqlite3_column_type(pstmt, i) != SQLITE_NULL) {
-                    const unsigned char* uColText = sqlite3_column_text(pstmt, i);
-                    const char* colText = reinterpret_cast<const char*>(uColText);
-                    row.push_back(std::string(colText));
-                } else {
-                    row.push_back(std::string(""));
-                }
+            rows++;
+            timer.pause();
+            try {
+                visit(DBRow(pstmt));
+            } catch(...) {
+                release_statement(q, pstmt);
+                throw;
+            }
+            timer.resume();
+        } else {
+            // any other result code is an error; leave the cached statement
+            // reset so that it can be reused
+            release_statement(q, pstmt);
+            if(s == SQLITE_BUSY || s == SQLITE_LOCKED) {
+                throw DBBusy("database is locked");
             }
-            // now, add this new row into the DBTable
-            result.push_back(row);
-
-        } else if(s == SQLITE_ERROR) {
-            sqlite3_finalize(pstmt);
             throw std::runtime_error("error on parsing statement");
         }
     }
 
-    // we've finished the query; clean up and return
-    sqlite3_finalize(pstmt);
+    // we've finished the query; clean up
+    if(metrics::enabled()) {
+        metrics::add(metrics::SQL_ROWS_RETURNED, rows);
+        metrics::add(metrics::SQL_FULL_SCAN_STEPS, sqlite3_stmt_status(pstmt, SQLITE_STMTSTATUS_FULLSCAN_STEP, 0));
+    }
+    release_statement(q, pstmt);
+    log_pending_slow_queries();
+}
+
+DBTable DB::prepared_query(std::string q, const ArgumentList& args) {
+    /*
+    * Execute a prepared query with respect to the currently active database.
+    * @arguments
+    * ~ q: contains a prepared query string
+    * ~ args: contains a list of arguments, which will be binded to the
+        prepared values in the query q
+    * @expects args.size() == number of '?'s in q
+    * @returns DBTable containing results of query on success, throws
+        std::runtime_error on failure
+    */
+    DBTable result;
+    query_rows(q, args, [&result](const DBRow& r) {
+        // copy every column of the current row into the DBTable
+        std::vector<std::string> row;
+        for(int i = 0; i < r.size(); i++) {
+            row.push_back(r[i]);
+        }
+        result.push_back(row);
+    });
     return result;
+}
+
+Transaction::Transaction(DB& db, bool immediate) : database(db) {
+    /*
+    * Open a transaction on db, or a savepoint if one is already open.
+    * @arguments
+    * ~ immediate: for an outermost transaction that will write, take the
+        write lock now rather than at the first write
+    */
+    depth = database.transaction_depth;
+    finished = false;
+    if(depth == 0) {
+        database.prepared_query(immediate ? "BEGIN IMMEDIATE TRANSACTION" : "BEGIN TRANSACTION", ArgumentList({}));
+    } else {
+        database.prepared_query("SAVEPOINT " + savepoint(), ArgumentList({}));
+    }
+    database.transaction_depth++;
+}
+
+Transaction::~Transaction() {
+    // roll back anything that wasn't committed; destructors must not throw
+    if(!finished) {
+        try {
+            rollback();
+        } catch(...) {
+        }
+    }
+}
+
+std::string Transaction::savepoint() const {
+    return "transaction_" + std::to_string(depth);
+}
+
+void Transaction::commit() {
+    if(finished) {
+        throw std::runtime_error("transaction already finished");
+    }
+    if(depth == 0) {
+        database.prepared_query("COMMIT TRANSACTION", ArgumentList({}));
+    } else {
+        database.prepared_query("RELEASE SAVEPOINT " + savepoint(), ArgumentList({}));
+    }
+    finished = true;
+    database.transaction_depth--;
+}
+
+void Transaction::rollback() {
+    if(finished) {
+        throw std::runtime_error("transaction already finished");
+    }
+    // whatever happens, this transaction is over
+    finished = true;
+    database.transaction_depth--;
+    if(depth == 0) {
+        database.prepared_query("ROLLBACK TRANSACTION", ArgumentList({}));
+    } else {
+        database.prepared_query("ROLLBACK TRANSACTION TO SAVEPOINT " + savepoint(), ArgumentList({}));
+        database.prepared_query("RELEASE SAVEPOINT " + savepoint(), ArgumentList({}));
+    }
+}
 
+StorageFormat DB::storage_format() {
+    /*
+    * Read which format this database stores hashes and ciphertexts in.
+    * Databases that predate binary storage have a user_version of 0.
+    */
+    DBTable version = prepared_query("PRAGMA user_version", ArgumentList({}));
+    int v = (version.size() == 1) ? std::atoi(version[0][0].c_str()) : 0;
+    if(v >= AUTHENTICATED_STORAGE) {
+        return AUTHENTICATED_STORAGE;
+    } else if(v == BINARY_STORAGE) {
+        return BINARY_STORAGE;
+    }
+    return HEX_STORAGE;
+}
+
+compression::Codec DB::record_codec() {
+    /*
+    * Read the codec this database compresses new record contents with.
+    * Databases that have never had one set don't compress.
+    */
+    DBTable settings = prepared_query("SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name='Settings'",
+                                      ArgumentList({}));
+    if(settings.size() != 1 || settings[0][0] == "0") {
+        return compression::CODEC_NONE;
+    }
+    DBTable codec = prepared_query("SELECT value FROM Settings WHERE name='codec'", ArgumentList({}));
+    return (codec.size() == 1) ? compression::codec_from_name(codec[0][0]) : compression::CODEC_NONE;
+}
+
+void DB::set_record_codec(compression::Codec codec) {
+    // record contents written from now on use codec; every existing record
+    // is tagged with its own codec, so it stays readable as it is. Settings
+    // is created by the schema, from version 3 on
+    prepared_query("INSERT OR REPLACE INTO Settings (name, value) VALUES ('codec', ?)",
+                   ArgumentList({compression::codec_name(codec)}));
+}
+
+static void convert_columns(DB& database, const std::string& table, const std::vector<std::string>& columns,
+                            const std::function<std::string(const std::string&)>& convert) {
+    /*
+    * Replace every listed column of table with convert(its value), stored as
+    * a BLOB. Rows are read a batch at a time in rowid order, so memory use
+    * doesn't depend on the size of the table.
+    */
+    std::string select = "SELECT rowid";
+    std::string update = "UPDATE " + table + " SET ";
+    for(size_t i = 0; i < columns.size(); i++) {
+        select += ", " + columns[i];
+        update += (i == 0 ? "" : ", ") + columns[i] + "=?";
+    }
+    select += " FROM " + table + " WHERE rowid>? ORDER BY rowid LIMIT 1000";
+    update += " WHERE rowid=?";
+
+    sqlite3_int64 last = -1;
+    DBTable batch;
+    while((batch = database.prepared_query(select, ArgumentList({DBArgument::integer(last)}))).size() > 0) {
+        for(size_t r = 0; r < batch.size(); r++) {
+            ArgumentList args;
+            for(size_t c = 1; c < batch[r].size(); c++) {
+                args.push_back(DBArgument::blob(convert(batch[r][c])));
+            }
+            args.push_back(batch[r][0]);
+            database.prepared_query(update, args);
+        }
+        last = std::atoll(batch.back()[0].c_str());
+    }
+}
+
+static void convert_storage(DB& database, StorageFormat target, const std::function<void()>& convert) {
+    // run one format conversion and record the new format, all or nothing
+    Transaction conversion(database, true);
+    convert();
+    database.prepared_query("PRAGMA user_version = " + std::to_string(target), ArgumentList({}));
+    conversion.commit();
+}
+
+void migrate_to_binary_storage(DB& database) {
+    /*
+    * Convert a HEX_STORAGE database to BINARY_STORAGE in place, in a single
+    * transaction. No keys are needed: every stored hash and ciphertext is
+    * simply hex-decoded. User credentials in the Users table stay as they are.
+    * Does nothing if the database is already in binary format.
+    */
+    if(database.storage_format() != HEX_STORAGE) {
+        return;
+    }
+    convert_storage(database, BINARY_STORAGE, [&database]() {
+        convert_columns(database, "Keys", std::vector<std::string>({"user", "record_name", "record_identifier", "key"}),
+                        crypto::hex_decode);
+        convert_columns(database, "Records", std::vector<std::string>({"owner", "name", "record"}),
+                        crypto::hex_decode);
+    });
+}
+
+void migrate_to_authenticated_storage(DB& database) {
+    /*
+    * Convert a BINARY_STORAGE database to AUTHENTICATED_STORAGE in place, in
+    * a single transaction, by tagging every existing ciphertext as legacy
+    * AES-CBC. No keys are needed, so nothing is re-encrypted here: existing
+    * records stay readable, and are re-encrypted with AES-GCM as they are
+    * written or by AuthenticatedDBUser::upgrade_record_encryption.
+    * Does nothing if the database is already in authenticated format.
+    */
+    if(database.storage_format() != BINARY_STORAGE) {
+        return;
+    }
+    std::function<std::string(const std::string&)> tag_as_cbc = [](const std::string& ct) {
+        return std::string(1, static_cast<char>(crypto::CIPHER_AES_CBC)) + ct;
+    };
+    convert_storage(database, AUTHENTICATED_STORAGE, [&]() {
+        convert_columns(database, "Keys", std::vector<std::string>({"record_name", "key"}), tag_as_cbc);
+        convert_columns(database, "Records", std::vector<std::string>({"record"}), tag_as_cbc);
+    });
+}
+
+void upgrade_storage_format(DB& database) {
+    // bring a database of any format up to the current one
+    migrate_to_binary_storage(database);
+    migrate_to_authenticated_storage(database);
 }
 
 
@@ -125,6 +915,10 @@ void AuthenticatedDBUser::authenticate(const std::string& username_plain, const
     * @results Successful initialization on valid authentication; exception on 
     * invalid authentication
     */
+    metrics::Timer timer(metrics::USER_SIGN_IN);
+    // signing in only reads, so that sign-ins over a pool run side by side;
+    // the writer is only taken if the schema turns out to need upgrading
+    std::unique_ptr<Borrow> borrow(new Borrow(*this, false));
 
     // get hashes
     uname_hash = crypto::hash(username_plain);
@@ -132,7 +926,7 @@ void AuthenticatedDBUser::authenticate(const std::string& username_plain, const
     salted_pwd_hash = crypto::hash(keygenerator);
     // authenticate the user
     // NOTE: this is a first draft. TODO review the security of this authentication method
-    DBTable check = prepared_query("SELECT username FROM Users WHERE username=? AND password=?",
+    DBTable check = connection().prepared_query("SELECT username FROM Users WHERE username=? AND password=?",
                                     ArgumentList({uname_hash, salted_pwd_hash}));
     
     // make sure that EXACTLY one record matches these critiera
@@ -145,6 +939,52 @@ void AuthenticatedDBUser::authenticate(const std::string& username_plain, const
     // that records can be read.
     lockdown = false;
     master_key = crypto::master_keygen(uname_hash, keygenerator);
+    key_cache_hits = 0;
+    // bring the tables and indexes up to date before anything reads them
+    if(schema_needs_upgrade(connection())) {
+        // the read connection has to go back before the writer is borrowed
+        borrow.reset();
+        borrow.reset(new Borrow(*this, true));
+        open_schema(connection());
+    }
+    format = connection().storage_format();
+    codec = connection().record_codec();
+    // legacy ciphertexts are refused once the user is marked as having none
+    // left, and for this session if there are none left anyway, e.g. for a
+    // new user; the mark is only ever set by upgrade_record_encryption
+    legacy_ciphers = format != AUTHENTICATED_STORAGE
+                     || (!has_bound_ciphers() && has_legacy_ciphers(stored_hash(uname_hash)));
+}
+
+bool AuthenticatedDBUser::has_bound_ciphers() {
+    // whether the user has been marked by drop_legacy_ciphers
+    DBTable check = connection().prepared_query("SELECT bound_ciphers FROM Users WHERE username=? AND password=?",
+                                                ArgumentList({uname_hash, salted_pwd_hash}));
+    if(check.size() != 1) {
+        throw std::runtime_error("could not check record encryption");
+    }
+    return check[0][0] != "0";
+}
+
+bool AuthenticatedDBUser::has_legacy_ciphers(const std::string& muser) {
+    // whether any of the user's names, keys or records lack CIPHER_BOUND
+    DBTable check = connection().prepared_query("SELECT EXISTS(SELECT 1 FROM Keys JOIN Records"
+                                                " ON Records.owner=Keys.user AND Records.name=Keys.record_identifier"
+                                                " WHERE Keys.user=? AND (substr(Keys.record_name, 1, 1)<X'80'"
+                                                " OR substr(Keys.key, 1, 1)<X'80' OR substr(Records.record, 1, 1)<X'80'))",
+                                                ArgumentList({stored_arg(muser)}));
+    if(check.size() != 1) {
+        throw std::runtime_error("could not check record encryption");
+    }
+    return check[0][0] != "0";
+}
+
+void AuthenticatedDBUser::drop_legacy_ciphers() {
+    // mark the user as having only bound ciphertexts, so that later sessions
+    // refuse any others; the caller has checked that there are none left,
+    // and clears legacy_ciphers once this is committed
+    connection().prepared_query("UPDATE Users SET bound_ciphers=1 WHERE username=? AND password=?",
+                                ArgumentList({uname_hash, salted_pwd_hash}));
 }
 
 AuthenticatedDBUser::AuthenticatedDBUser() : DB::DB() {
@@ -156,6 +996,13 @@ AuthenticatedDBUser::AuthenticatedDBUser() : DB::DB() {
     uname_hash = "";
     salted_pwd_hash = "";
     lockdown = true;
+    format = HEX_STORAGE;
+    legacy_ciphers = true;
+    codec = compression::CODEC_NONE;
+    key_cache_hits = 0;
+    pool = NULL;
+    borrowed = NULL;
+    borrowed_writes = false;
 }
 
 AuthenticatedDBUser::AuthenticatedDBUser(const std::string& username_plain, const std::string& password_plain) : DB::DB("records.db") {
@@ -171,15 +1018,34 @@ AuthenticatedDBUser::AuthenticatedDBUser(const std::string& username_plain, cons
     * @results Successful initialization on valid authentication; exception on 
     * invalid authentication
     */
+    pool = NULL;
+    borrowed = NULL;
+    borrowed_writes = false;
 
     authenticate(username_plain, password_plain);
 }
 
 AuthenticatedDBUser::AuthenticatedDBUser(const std::string& username_plain, const std::string& password_plain, const std::string& dbname) : DB::DB(dbname.c_str()) {
     /*
-    * Same as above, but logs a user into a different database
-    * THIS FUNCTION IS FOR TEST PURPOSES ONLY
+    * Same as above, but logs a user into a different database, e.g. for
+    * tests and for the bulk import/export tool
+    */
+    pool = NULL;
+    borrowed = NULL;
+    borrowed_writes = false;
+
+    authenticate(username_plain, password_plain);
+}
+
+AuthenticatedDBUser::AuthenticatedDBUser(const std::string& username_plain, const std::string& password_plain, ConnectionPool& pool) : DB::DB() {
+    /*
+    * Same as above, but rather than opening a connection of its own, the
+    * user borrows one from pool for each operation. The user must still
+    * only be used by one thread at a time; many users may share the pool.
     */
+    this->pool = &pool;
+    borrowed = NULL;
+    borrowed_writes = false;
 
     authenticate(username_plain, password_plain);
 }
@@ -189,10 +1055,21 @@ AuthenticatedDBUser::AuthenticatedDBUser(AuthenticatedDBUser&& database) : DB::D
     salted_pwd_hash = database.salted_pwd_hash;
     master_key = database.master_key;
     lockdown = database.lockdown;
+    format = database.format;
+    legacy_ciphers = database.legacy_ciphers;
+    codec = database.codec;
+    record_key_cache.swap(database.record_key_cache);
+    record_key_index.swap(database.record_key_index);
+    key_cache_hits = database.key_cache_hits;
+    pool = database.pool;
+    borrowed = NULL;
+    borrowed_writes = false;
+    decrypt_pool = std::move(database.decrypt_pool);
 
     database.uname_hash = "";
     database.salted_pwd_hash = "";
     database.lockdown = true;
+    database.key_cache_hits = 0;
 }
 
 AuthenticatedDBUser& AuthenticatedDBUser::operator=(AuthenticatedDBUser&& database) {
@@ -201,95 +1078,585 @@ AuthenticatedDBUser& AuthenticatedDBUser::operator=(AuthenticatedDBUser&& databa
     salted_pwd_hash = database.salted_pwd_hash;
     master_key = database.master_key;
     lockdown = database.lockdown;
+    format = database.format;
+    legacy_ciphers = database.legacy_ciphers;
+    codec = database.codec;
+    clear_record_key_cache();
+    record_key_cache.swap(database.record_key_cache);
+    record_key_index.swap(database.record_key_index);
+    key_cache_hits = database.key_cache_hits;
+    pool = database.pool;
+    borrowed = NULL;
+    borrowed_writes = false;
+    decrypt_pool = std::move(database.decrypt_pool);
+
+    database.uname_hash = "";
+    database.salted_pwd_hash = "";
+    database.lockdown = true;
+    database.key_cache_hits = 0;
+
+    return *this;
+}
+
+AuthenticatedDBUser::~AuthenticatedDBUser() {
+    /*
+    * Zero out all sensitive variables
+    */
+    uname_hash = "";
+    salted_pwd_hash = "";
+    lockdown = true;
+    clear_record_key_cache();
+    // master_key and any cached record keys will zero themselves out
+}
+
+AuthenticatedDBUser::Borrow::Borrow(AuthenticatedDBUser& user, bool writes) : user(user) {
+    if(user.pool == NULL) {
+        return; // the user's own connection is always there
+    }
+    if(user.borrowed != NULL) {
+        // nested in another operation, which already holds a connection
+        if(writes && !user.borrowed_writes) {
+            throw std::runtime_error("cannot write on a read connection");
+        }
+        return;
+    }
+    lease.reset(new ConnectionPool::Lease(writes ? user.pool->write() : user.pool->read()));
+    user.borrowed = &**lease;
+    user.borrowed_writes = writes;
+}
+
+AuthenticatedDBUser::Borrow::~Borrow() {
+    if(lease) {
+        user.borrowed = NULL;
+    }
+}
+
+DB& AuthenticatedDBUser::connection() {
+    // the connection the current operation runs on
+    if(pool == NULL) {
+        return *this;
+    }
+    if(borrowed == NULL) {
+        throw std::runtime_error("no connection borrowed");
+    }
+    return *borrowed;
+}
+
+void AuthenticatedDBUser::assert_safe() {
+    /*
+    * Make sure that we have not entered a locked-down status for any reason.
+    * If we have, throw an exception immediately.
+    */
+    if(lockdown) {
+        throw std::runtime_error("Database access invalid");
+    }
+}
+
+std::string AuthenticatedDBUser::stored_hash(const std::string& str) const {
+    if(format != HEX_STORAGE) {
+        return crypto::raw_hash(str);
+    }
+    return crypto::hash(str);
+}
+
+static std::string row_context(const std::string& column, const std::string& muser, const std::string& record_id) {
+    // where a ciphertext is stored: its column, and the user and record
+    // whose row it is in. Both hashes are of fixed length.
+    return column + std::string(1, '\0') + muser + record_id;
+}
+
+std::string AuthenticatedDBUser::stored_encrypt(const std::string& str, const CryptoPP::SecByteBlock key,
+                                                const std::string& context) const {
+    if(format == AUTHENTICATED_STORAGE) {
+        return crypto::auth_encrypt(str, key, context, crypto::CIPHER_AES_GCM | crypto::CIPHER_BOUND);
+    } else if(format == BINARY_STORAGE) {
+        return crypto::raw_encrypt(str, key);
+    }
+    return crypto::encrypt(str, key);
+}
+
+std::string AuthenticatedDBUser::seal_contents(const std::string& v, const CryptoPP::SecByteBlock key,
+                                               const std::string& context) const {
+    // encrypt record contents, compressing them with the database's codec
+    // first if that makes them any smaller
+    if(format != AUTHENTICATED_STORAGE) {
+        return stored_encrypt(v, key, context);
+    }
+    std::string encoded;
+    if(compression::compress(v, codec, encoded)) {
+        return crypto::auth_encrypt(encoded, key, context, crypto::CIPHER_AES_GCM_ENCODED | crypto::CIPHER_BOUND);
+    }
+    return crypto::auth_encrypt(v, key, context, crypto::CIPHER_AES_GCM | crypto::CIPHER_BOUND);
+}
+
+static std::string decoded(const char* ct, size_t length, std::string plain) {
+    // decompress plain, if ct says it was compressed before it was encrypted
+    if(crypto::is_encoded(ct, length)) {
+        return compression::decompress(plain);
+    }
+    return plain;
+}
+
+std::string AuthenticatedDBUser::open_sealed(const char* ct, size_t length, const CryptoPP::SecByteBlock key,
+                                             const std::string& context) const {
+    // a bound ciphertext only opens under the context it was sealed for; an
+    // unbound one is legacy, and only opens while the user still has some
+    if(crypto::is_bound(ct, length)) {
+        return crypto::auth_decrypt(ct, length, key, context);
+    }
+    if(!legacy_ciphers) {
+        throw std::runtime_error("ciphertext is not bound to its record");
+    }
+    if(crypto::is_chunked(ct, length)) {
+        return crypto::auth_decrypt(ct, length, key, "");
+    }
+    return crypto::auth_decrypt(ct, length, key);
+}
+
+std::string AuthenticatedDBUser::stored_decrypt(const std::string& ct, const CryptoPP::SecByteBlock key,
+                                                const std::string& context) const {
+    if(format == AUTHENTICATED_STORAGE) {
+        return decoded(ct.data(), ct.size(), open_sealed(ct.data(), ct.size(), key, context));
+    } else if(format == BINARY_STORAGE) {
+        return crypto::raw_decrypt(ct, key);
+    }
+    return crypto::decrypt(ct, key);
+}
+
+std::string AuthenticatedDBUser::stored_decrypt(const DBView& ct, const CryptoPP::SecByteBlock key,
+                                                const std::string& context) const {
+    // decrypt straight out of SQLite's buffer in binary databases
+    if(format == AUTHENTICATED_STORAGE) {
+        return decoded(ct.data, ct.size, open_sealed(ct.data, ct.size, key, context));
+    } else if(format == BINARY_STORAGE) {
+        return crypto::raw_decrypt(ct.data, ct.size, key);
+    }
+    return crypto::decrypt(ct.str(), key);
+}
+
+std::vector<std::string> AuthenticatedDBUser::stored_decrypt_batch(const std::vector<std::string>& cts,
+                                                                   const std::vector<std::string>& contexts,
+                                                                   const CryptoPP::SecByteBlock key) const {
+    // decrypt many values under one key, setting up the cipher only once
+    std::vector<crypto::CiphertextView> views;
+    views.reserve(cts.size());
+    for(size_t i = 0; i < cts.size(); i++) {
+        views.push_back(crypto::CiphertextView({cts[i].data(), cts[i].size(), contexts[i]}));
+    }
+    if(format == AUTHENTICATED_STORAGE) {
+        return crypto::auth_decrypt_batch(views, key, legacy_ciphers);
+    } else if(format == BINARY_STORAGE) {
+        return crypto::raw_decrypt_batch(views, key);
+    }
+    std::vector<std::string> results;
+    for(size_t i = 0; i < cts.size(); i++) {
+        results.push_back(crypto::decrypt(cts[i], key));
+    }
+    return results;
+}
+
+DBArgument AuthenticatedDBUser::stored_arg(const std::string& value) const {
+    if(format != HEX_STORAGE) {
+        return DBArgument::blob(value);
+    }
+    return DBArgument(value);
+}
+
+int AuthenticatedDBUser::record_match(const std::string& n) {
+    /*
+    * Confirm that the user owns record with name n
+    * Looks the record up by its stored identifier hash rather than decrypting
+    * every one of the user's record names, so the cost of the check does not
+    * grow with the number of records the user holds
+    * @returns the number of Keys entries the user holds for n
+    */
+
+    std::string muser = stored_hash(uname_hash);
+    std::string record_id = stored_hash(n);
+    DBTable check = connection().prepared_query("SELECT COUNT(*) FROM Keys WHERE user=? AND record_identifier=?",
+                                    ArgumentList({stored_arg(muser), stored_arg(record_id)}));
+
+    if(check.size() != 1) {
+        throw std::runtime_error("could not check record ownership");
+    }
+    return std::atoi(check[0][0].c_str());
+}
+
+void AuthenticatedDBUser::create_record(const std::string& n, const std::string& v) {
+    /*
+    * Create a new record with the current user as the owner. The new record
+    * will have a name n and will contain the string v.
+    */
+    Borrow borrow(*this, true);
+    if(format == AUTHENTICATED_STORAGE && v.size() > RECORD_CHUNK_SIZE) {
+        // large contents are chunked, so that ranges of them can be read alone
+        std::istringstream in(v);
+        create_record(n, in);
+        return;
+    }
+    metrics::Timer timer(metrics::USER_CREATE); // the streaming overload times chunked records
+    PreparedRecord record = prepare_record(n, v);
+
+    // store key in Keys database table
+    /*std::string muser = crypto::hash(uname_hash);
+    // std::string record_name = crypto::hash(n); // TODO ensure no conflicts if multiple users have same record name
+    DBTable check = prepared_query("SELECT * FROM Keys WHERE user=? AND record_name=?",
+                                    ArgumentList({muser, record_name}));
+    
+    // confirm that no records under user's name currently exist
+    if(check.size() > 0) {
+        throw std::runtime_error("Could not create record: record already exists");
+    }*/
+    // the existence check and both inserts happen atomically, so that a
+    // failure part way through never leaves an orphaned key behind
+    Transaction create(connection(), true);
+    if(!insert_prepared(stored_hash(uname_hash), record)) {
+        throw std::runtime_error("Could not create record: record already exists");
+    }
+    create.commit();
+}
+
+void AuthenticatedDBUser::create_record(const std::string& n, std::istream& v) {
+    /*
+    * Create a new record n with the contents read from v, as a chunked
+    * record: v is read, encrypted and stored RECORD_CHUNK_SIZE bytes at a
+    * time, so the record may be far larger than available memory. Nothing is
+    * stored unless all of v is.
+    */
+    metrics::Timer timer(metrics::USER_CREATE);
+    Borrow borrow(*this, true);
+    if(format != AUTHENTICATED_STORAGE) {
+        throw std::runtime_error("database does not support chunked records");
+    }
+    CryptoPP::SecByteBlock key = crypto::random_block(CryptoPP::AES::DEFAULT_KEYLENGTH);
+    PreparedRecord record = prepare_record(n, "", key);
+    std::string muser = stored_hash(uname_hash);
+
+    Transaction create(connection(), true);
+    if(!insert_prepared(muser, record)) {
+        throw std::runtime_error("Could not create record: record already exists");
+    }
+    ChunkManifest manifest = write_chunks(muser, record.identifier, v, key);
+    connection().prepared_query("UPDATE Records SET record=? WHERE owner=? AND name=?",
+                                ArgumentList({DBArgument::blob(seal_manifest(manifest, key,
+                                                                             row_context("Records.record", muser, record.identifier))),
+                                              stored_arg(muser), stored_arg(record.identifier)}));
+    create.commit();
+}
+
+static std::string encode_u64(sqlite3_uint64 value) {
+    // big-endian, so that the encoding doesn't depend on the host
+    std::string bytes(8, '\0');
+    for(int i = 7; i >= 0; i--) {
+        bytes[i] = static_cast<char>(value & 0xff);
+        value >>= 8;
+    }
+    return bytes;
+}
+
+static sqlite3_uint64 decode_u64(const std::string& bytes, size_t at) {
+    sqlite3_uint64 value = 0;
+    for(size_t i = at; i < at + 8; i++) {
+        value = (value << 8) | static_cast<unsigned char>(bytes[i]);
+    }
+    return value;
+}
+
+std::string AuthenticatedDBUser::seal_manifest(const ChunkManifest& manifest, const CryptoPP::SecByteBlock key,
+                                               const std::string& context) const {
+    // generation || size || chunks, under the record key, followed once the
+    // record has been spliced by writes || count || (chunk || version)...
+    std::string plain = manifest.generation + encode_u64(manifest.size) + encode_u64(manifest.chunks);
+    if(manifest.writes > 0) {
+        plain += encode_u64(manifest.writes) + encode_u64(manifest.versions.size());
+        for(std::map<sqlite3_uint64, sqlite3_uint64>::const_iterator it = manifest.versions.begin();
+            it != manifest.versions.end(); ++it) {
+            plain += encode_u64(it->first) + encode_u64(it->second);
+        }
+    }
+    return crypto::auth_encrypt(plain, key, context, crypto::CIPHER_CHUNKED | crypto::CIPHER_BOUND);
+}
+
+AuthenticatedDBUser::ChunkManifest AuthenticatedDBUser::open_manifest(const char* ct, size_t length,
+                                                                      const CryptoPP::SecByteBlock key,
+                                                                      const std::string& context) const {
+    std::string plain = open_sealed(ct, length, key, context);
+    if(plain.size() != 24 && (plain.size() < 40 || (plain.size() - 40) % 16 != 0)) {
+        throw std::runtime_error("malformed chunk manifest");
+    }
+    ChunkManifest manifest;
+    manifest.generation = plain.substr(0, 8);
+    manifest.size = decode_u64(plain, 8);
+    manifest.chunks = decode_u64(plain, 16);
+    manifest.writes = 0;
+    if(plain.size() > 24) {
+        manifest.writes = decode_u64(plain, 24);
+        if(decode_u64(plain, 32) != (plain.size() - 40) / 16) {
+            throw std::runtime_error("malformed chunk manifest");
+        }
+        for(size_t at = 40; at < plain.size(); at += 16) {
+            manifest.versions[decode_u64(plain, at)] = decode_u64(plain, at + 8);
+        }
+    }
+    return manifest;
+}
+
+std::string AuthenticatedDBUser::chunk_context(const ChunkManifest& manifest, sqlite3_uint64 index) const {
+    // each chunk is bound to its position in this generation of the record,
+    // and to the splice that last wrote it, if any
+    std::map<sqlite3_uint64, sqlite3_uint64>::const_iterator version = manifest.versions.find(index);
+    if(version == manifest.versions.end()) {
+        return manifest.generation + encode_u64(index);
+    }
+    return manifest.generation + encode_u64(index) + encode_u64(version->second);
+}
+
+std::string AuthenticatedDBUser::open_chunk(const char* ct, size_t length, const ChunkManifest& manifest,
+                                            sqlite3_uint64 index, const CryptoPP::SecByteBlock key) const {
+    return decoded(ct, length, crypto::auth_decrypt(ct, length, key, chunk_context(manifest, index)));
+}
+
+AuthenticatedDBUser::ChunkManifest AuthenticatedDBUser::write_chunks(const std::string& muser, const std::string& record_id,
+                                                                     std::istream& in, const CryptoPP::SecByteBlock key) {
+    /*
+    * Encrypt and store the contents read from in as record_id's chunks,
+    * holding only one chunk in memory at a time. The caller provides the
+    * transaction, and stores the returned manifest.
+    */
+    ChunkManifest manifest;
+    manifest.generation = crypto::_impl_details::bytes_to_string(crypto::random_block(8));
+    manifest.size = 0;
+    manifest.chunks = 0;
+    manifest.writes = 0;
+    std::string chunk(RECORD_CHUNK_SIZE, '\0');
+    while(in) {
+        in.read(&chunk[0], RECORD_CHUNK_SIZE);
+        size_t got = in.gcount();
+        if(got == 0) {
+            break;
+        }
+        chunk.resize(got); // only ever shrinks, for the last chunk
+        std::string ct = seal_contents(chunk, key, chunk_context(manifest, manifest.chunks));
+        connection().prepared_query("INSERT INTO RecordChunks (owner, name, seq, chunk) VALUES (?, ?, ?, ?)",
+                                    ArgumentList({stored_arg(muser), stored_arg(record_id),
+                                                  DBArgument::integer(manifest.chunks), DBArgument::blob(ct)}));
+        manifest.size += got;
+        manifest.chunks++;
+    }
+    if(in.bad()) {
+        throw std::runtime_error("could not read record contents");
+    }
+    return manifest;
+}
 
-    database.uname_hash = "";
-    database.salted_pwd_hash = "";
-    database.lockdown = true;
+void AuthenticatedDBUser::read_chunks(const std::string& muser, const std::string& record_id, const ChunkManifest& manifest,
+                                      const CryptoPP::SecByteBlock key, std::ostream& out) {
+    /*
+    * Decrypt record_id's chunks to out in order, one at a time. A missing,
+    * reordered or replaced chunk fails to decrypt at its position, so this
+    * throws, having written out only the chunks before it.
+    */
+    sqlite3_uint64 index = 0;
+    sqlite3_uint64 size = 0;
+    connection().query_rows("SELECT chunk FROM RecordChunks WHERE owner=? AND name=? ORDER BY seq",
+                            ArgumentList({stored_arg(muser), stored_arg(record_id)}),
+                            [&](const DBRow& row) {
+        DBView ct = row.view(0);
+        std::string chunk = open_chunk(ct.data, ct.size, manifest, index++, key);
+        out.write(chunk.data(), chunk.size());
+        if(!out) {
+            throw std::runtime_error("could not write record contents");
+        }
+        size += chunk.size();
+    });
+    if(index != manifest.chunks || size != manifest.size) {
+        throw std::runtime_error("record is missing chunks");
+    }
+}
 
-    return *this;
+void AuthenticatedDBUser::delete_chunks(const std::string& muser, const std::string& record_id) {
+    // drop any chunks record_id has, when it is replaced or deleted
+    if(format != AUTHENTICATED_STORAGE) {
+        return;
+    }
+    connection().prepared_query("DELETE FROM RecordChunks WHERE owner=? AND name=?",
+                                ArgumentList({stored_arg(muser), stored_arg(record_id)}));
 }
 
-AuthenticatedDBUser::~AuthenticatedDBUser() {
+PreparedRecord AuthenticatedDBUser::prepare_record(const std::string& n, const std::string& v) const {
     /*
-    * Zero out all sensitive variables
+    * Do all of the work of creating record n with contents v that doesn't
+    * touch the database: generate its record key, and hash and encrypt
+    * everything that will be stored
     */
-    uname_hash = "";
-    salted_pwd_hash = "";
-    lockdown = true;
-    // master_key will zero itself out
+    metrics::Timer timer(metrics::USER_PREPARE);
+    // generate secure new key
+    return prepare_record(n, v, crypto::random_block(CryptoPP::AES::DEFAULT_KEYLENGTH));
 }
 
-void AuthenticatedDBUser::assert_safe() {
+PreparedRecord AuthenticatedDBUser::prepare_record(const std::string& n, const std::string& v, const CryptoPP::SecByteBlock newKey) const {
+    // the same, with newKey as the record key
+    PreparedRecord record;
+    std::string muser = stored_hash(uname_hash);
+    record.identifier = stored_hash(n);
+    // encrypt the record key newKey with the user's master_key, to be
+    // placed in the Keys table
+    record.wrapped_name = stored_encrypt(n, master_key, row_context("Keys.record_name", muser, record.identifier));
+    record.wrapped_key = stored_encrypt(crypto::_impl_details::bytes_to_string(newKey), master_key,
+                                        row_context("Keys.key", muser, record.identifier));
+    // encrypt v with newKey before adding to the Records table, chunked as
+    // create_record would store it if it is large
+    std::string context = row_context("Records.record", muser, record.identifier);
+    if(format != AUTHENTICATED_STORAGE || v.size() <= RECORD_CHUNK_SIZE) {
+        record.contents = seal_contents(v, newKey, context);
+        return record;
+    }
+    ChunkManifest manifest;
+    manifest.generation = crypto::_impl_details::bytes_to_string(crypto::random_block(8));
+    manifest.size = v.size();
+    manifest.chunks = 0;
+    manifest.writes = 0;
+    for(size_t at = 0; at < v.size(); at += RECORD_CHUNK_SIZE) {
+        record.chunks.push_back(seal_contents(v.substr(at, RECORD_CHUNK_SIZE), newKey, chunk_context(manifest, manifest.chunks)));
+        manifest.chunks++;
+    }
+    record.contents = seal_manifest(manifest, newKey, context);
+    return record;
+}
+
+bool AuthenticatedDBUser::insert_prepared(const std::string& muser, const PreparedRecord& record) {
     /*
-    * Make sure that we have not entered a locked-down status for any reason.
-    * If we have, throw an exception immediately.
+    * Store a prepared record, unless the user already has one by that name.
+    * The caller provides the transaction.
+    * @returns false, having stored nothing, if the record already exists
     */
-    if(lockdown) {
-        throw std::runtime_error("Database access invalid");
+    DBTable check = connection().prepared_query("SELECT COUNT(*) FROM Keys WHERE user=? AND record_identifier=?",
+                                                ArgumentList({stored_arg(muser), stored_arg(record.identifier)}));
+    if(check.size() != 1) {
+        throw std::runtime_error("could not check record ownership");
     }
+    if(std::atoi(check[0][0].c_str()) != 0) {
+        return false;
+    }
+    connection().prepared_query("INSERT INTO Keys (user, record_name, record_identifier, key) VALUES (?, ?, ?, ?)",
+                                ArgumentList({stored_arg(muser), stored_arg(record.wrapped_name),
+                                              stored_arg(record.identifier), stored_arg(record.wrapped_key)}));
+    connection().prepared_query("INSERT INTO Records (owner, name, record) VALUES (?, ?, ?)",
+                                ArgumentList({stored_arg(muser), stored_arg(record.identifier), stored_arg(record.contents)}));
+    for(size_t i = 0; i < record.chunks.size(); i++) {
+        connection().prepared_query("INSERT INTO RecordChunks (owner, name, seq, chunk) VALUES (?, ?, ?, ?)",
+                                    ArgumentList({stored_arg(muser), stored_arg(record.identifier),
+                                                  DBArgument::integer(i), DBArgument::blob(record.chunks[i])}));
+    }
+    return true;
 }
 
-int AuthenticatedDBUser::record_match(const std::string& n) {
+std::vector<RecordResult> AuthenticatedDBUser::insert_prepared_records(const std::vector<PreparedRecord>& records) {
     /*
-    * Confirm that the user owns record with name n
+    * Store many prepared records in a single transaction. A record whose
+    * name the user already has is reported as failed and skipped; the
+    * others are still stored. Any other error rolls back the whole batch.
     */
-
-    std::string muser = crypto::hash(uname_hash);
-    DBTable check = prepared_query("SELECT record_name FROM Keys WHERE user=?", ArgumentList({muser}));
-
-    int result = 0;
-    for(size_t i = 0; i < check.size(); i++) {
-        if(crypto::decrypt(check[i][0], master_key) == n) {
-            result++;
+    metrics::Timer timer(metrics::USER_INSERT_PREPARED);
+    Borrow borrow(*this, true);
+    std::string muser = stored_hash(uname_hash);
+    std::vector<RecordResult> results(records.size());
+    Transaction insert(connection(), true);
+    for(size_t i = 0; i < records.size(); i++) {
+        results[i].ok = insert_prepared(muser, records[i]);
+        if(!results[i].ok) {
+            results[i].error = "record already exists";
         }
     }
-    return result;
+    insert.commit();
+    return results;
 }
 
-void AuthenticatedDBUser::create_record(const std::string& n, const std::string& v) {
+void AuthenticatedDBUser::for_each_stored_record(const std::function<void(const StoredRecord&)>& visit) {
     /*
-    * Create a new record with the current user as the owner. The new record
-    * will have a name n and will contain the string v.
+    * Hand each of the user's records to visit still encrypted, in creation
+    * order, one row at a time. A chunked record is followed by each of its
+    * chunks in turn, so no more than one chunk is held here at once.
     */
-    // generate secure new key
-    CryptoPP::SecByteBlock newKey(CryptoPP::AES::DEFAULT_KEYLENGTH);
-    CryptoPP::AutoSeededRandomPool generator;
-    generator.GenerateBlock(newKey, newKey.size());
+    metrics::Timer timer(metrics::USER_READ_STORED);
+    Borrow borrow(*this, false);
+    std::string muser = stored_hash(uname_hash);
+    StoredRecord record;
+    connection().query_rows("SELECT Keys.record_name, Keys.key, Records.record, Records.name FROM Keys JOIN Records"
+                            " ON Records.owner=Keys.user AND Records.name=Keys.record_identifier"
+                            " WHERE Keys.user=? ORDER BY Keys.rowid",
+                            ArgumentList({stored_arg(muser)}),
+                            [&](const DBRow& row) {
+        record.identifier = row.view(3).str();
+        record.wrapped_name = row.view(0).str();
+        record.wrapped_key = row.view(1).str();
+        record.contents = row.view(2).str();
+        record.chunks = 0;
+        record.is_chunk = false;
+        record.chunk_index = 0;
+        record.chunk.clear();
+        bool chunked = format == AUTHENTICATED_STORAGE && crypto::is_chunked(record.contents.data(), record.contents.size());
+        if(chunked) {
+            DBTable count = connection().prepared_query("SELECT COUNT(*) FROM RecordChunks WHERE owner=? AND name=?",
+                                                        ArgumentList({stored_arg(muser), DBArgument::blob(record.identifier)}));
+            record.chunks = std::stoull(count[0][0]);
+        }
+        visit(record);
+        if(chunked) {
+            record.is_chunk = true;
+            connection().query_rows("SELECT chunk FROM RecordChunks WHERE owner=? AND name=? ORDER BY seq",
+                                    ArgumentList({stored_arg(muser), DBArgument::blob(record.identifier)}),
+                                    [&](const DBRow& chunk) {
+                record.chunk = chunk.view(0).str();
+                visit(record);
+                record.chunk_index++;
+            });
+        }
+    });
+}
 
-    // store key in Keys database table
-    /*std::string muser = crypto::hash(uname_hash);
-    // std::string record_name = crypto::hash(n); // TODO ensure no conflicts if multiple users have same record name
-    DBTable check = prepared_query("SELECT * FROM Keys WHERE user=? AND record_name=?",
-                                    ArgumentList({muser, record_name}));
-    
-    // confirm that no records under user's name currently exist
-    if(check.size() > 0) {
-        throw std::runtime_error("Could not create record: record already exists");
-    }*/
-    int numRecords = record_match(n);
-    if(numRecords != 0) {
-        throw std::runtime_error("Could not create record: record already exists");
+std::pair<std::string, std::string> AuthenticatedDBUser::open_record(const StoredRecord& record) const {
+    metrics::Timer timer(metrics::USER_OPEN);
+    // decrypt a stored record's name and contents; a chunked record's
+    // manifest is only checked against the chunks that follow it
+    std::string muser = stored_hash(uname_hash);
+    CryptoPP::SecByteBlock record_key = crypto::_impl_details::string_to_bytes(
+        stored_decrypt(record.wrapped_key, master_key, row_context("Keys.key", muser, record.identifier)));
+    std::string name = stored_decrypt(record.wrapped_name, master_key, row_context("Keys.record_name", muser, record.identifier));
+    std::string context = row_context("Records.record", muser, record.identifier);
+    if(format != AUTHENTICATED_STORAGE || !crypto::is_chunked(record.contents.data(), record.contents.size())) {
+        return std::make_pair(name, stored_decrypt(record.contents, record_key, context));
     }
+    ChunkManifest manifest = open_manifest(record.contents.data(), record.contents.size(), record_key, context);
+    if(record.chunks != manifest.chunks || (manifest.chunks == 0 && manifest.size != 0)) {
+        throw std::runtime_error("record is missing chunks");
+    }
+    return std::make_pair(name, "");
+}
 
-    // encrypt the record key newKey with the user's master_key and place
-    // it in the Keys table
-    // * the following two lines are new *
-    std::string muser = crypto::hash(uname_hash);
-    std::string record_id = crypto::hash(n);
-    std::string record_name = crypto::encrypt(n, master_key);
-
-    // continue
-    std::string key_encrypt = crypto::encrypt(crypto::_impl_details::bytes_to_string(newKey), master_key);
-    prepared_query("INSERT INTO Keys (user, record_name, record_identifier, key) VALUES (?, ?, ?, ?)", 
-                   ArgumentList({muser, record_name, record_id, key_encrypt}));
-    
-    // encrypt owner, n, and v with newKey before adding to the Records table
-    std::string encryptedV = crypto::encrypt(v, newKey);
-
-    // add encrypted values to Records database table
-    prepared_query("INSERT INTO Records (owner, name, record) VALUES (?, ?, ?)",
-                    ArgumentList({muser, record_id, encryptedV}));
-    
+std::string AuthenticatedDBUser::open_record_chunk(const StoredRecord& piece) const {
+    /*
+    * Decrypt one chunk of a chunked record, as handed over by
+    * for_each_stored_record. Each chunk is checked on its own against the
+    * manifest, so that a missing, reordered or cut short chunk fails here.
+    */
+    metrics::Timer timer(metrics::USER_OPEN);
+    std::string muser = stored_hash(uname_hash);
+    CryptoPP::SecByteBlock record_key = crypto::_impl_details::string_to_bytes(
+        stored_decrypt(piece.wrapped_key, master_key, row_context("Keys.key", muser, piece.identifier)));
+    ChunkManifest manifest = open_manifest(piece.contents.data(), piece.contents.size(), record_key,
+                                           row_context("Records.record", muser, piece.identifier));
+    sqlite3_uint64 start = piece.chunk_index * RECORD_CHUNK_SIZE;
+    if(piece.chunks != manifest.chunks || piece.chunk_index >= manifest.chunks || start >= manifest.size) {
+        throw std::runtime_error("record is missing chunks");
+    }
+    std::string chunk = open_chunk(piece.chunk.data(), piece.chunk.size(), manifest, piece.chunk_index, record_key);
+    // every chunk but the last is full, and the last ends the record
+    sqlite3_uint64 expected = (piece.chunk_index + 1 < manifest.chunks) ? RECORD_CHUNK_SIZE : manifest.size - start;
+    if(chunk.size() != expected) {
+        throw std::runtime_error("malformed chunked record");
+    }
+    return chunk;
 }
 
 CryptoPP::SecByteBlock AuthenticatedDBUser::get_record_key(const std::string& muser, const std::string& hashed_record_name) {
@@ -298,22 +1665,84 @@ CryptoPP::SecByteBlock AuthenticatedDBUser::get_record_key(const std::string& mu
     * decrypts it, and returns it ready for use
     */
 
-    // retrieve the encrypted key
-    DBTable key_info = prepared_query("SELECT key FROM Keys WHERE user=? AND record_identifier=?",
-                                    ArgumentList({muser, hashed_record_name}));
+    // retrieve the encrypted key and unwrap it, reading the ciphertext in
+    // place rather than copying it out of the row
+    size_t matches = 0;
+    CryptoPP::SecByteBlock record_key;
+    connection().query_rows("SELECT key FROM Keys WHERE user=? AND record_identifier=?",
+                            ArgumentList({stored_arg(muser), stored_arg(hashed_record_name)}),
+                            [&](const DBRow& row) {
+        if(matches++ == 0) {
+            record_key = unwrap_record_key(muser, hashed_record_name, row.view(0));
+        }
+    });
     
     // ensure that only one such key exists
-    if(key_info.size() != 1) {
+    if(matches != 1) {
         throw std::runtime_error("could not retrieve record");
     }
-    std::string encrypted_key = key_info[0][0];
-    
-    // decrypt the record key using the master key
-    std::string record_key_string = crypto::decrypt(encrypted_key, master_key);
-    CryptoPP::SecByteBlock record_key = crypto::_impl_details::string_to_bytes(record_key_string);
     return record_key;
 }
 
+CryptoPP::SecByteBlock AuthenticatedDBUser::unwrap_record_key(const std::string& muser, const std::string& hashed_record_name,
+                                                              const DBView& wrapped_key) {
+    /*
+    * Decrypt a record key with the master key, going through a small LRU
+    * cache of keys unwrapped earlier in this session. A cached key is only
+    * used if it was unwrapped from exactly the same ciphertext, so a key that
+    * has since been replaced (e.g. by another session) is never reused.
+    */
+    std::map<std::string, RecordKeyList::iterator>::iterator found = record_key_index.find(hashed_record_name);
+    if(found != record_key_index.end()) {
+        const std::string& cached = found->second->wrapped_key;
+        if(cached.size() == wrapped_key.size
+           && std::memcmp(cached.data(), wrapped_key.data, wrapped_key.size) == 0) {
+            record_key_cache.splice(record_key_cache.begin(), record_key_cache, found->second);
+            key_cache_hits++;
+            return found->second->key;
+        }
+        forget_record_key(hashed_record_name);
+    }
+
+    std::string record_key_string = stored_decrypt(wrapped_key, master_key, row_context("Keys.key", muser, hashed_record_name));
+    CachedRecordKey entry;
+    entry.hashed_record_name = hashed_record_name;
+    entry.wrapped_key = wrapped_key.str();
+    entry.key = crypto::_impl_details::string_to_bytes(record_key_string);
+
+    record_key_cache.push_front(entry);
+    record_key_index[hashed_record_name] = record_key_cache.begin();
+    if(record_key_cache.size() > RECORD_KEY_CACHE_SIZE) {
+        // the evicted SecByteBlock zeroes itself out as it is destroyed
+        record_key_index.erase(record_key_cache.back().hashed_record_name);
+        record_key_cache.pop_back();
+    }
+    return entry.key;
+}
+
+void AuthenticatedDBUser::forget_record_key(const std::string& hashed_record_name) {
+    /*
+    * Drop a record's key from the key cache. Any operation that removes or
+    * rewraps a record key (deletion, sharing, rekeying) must call this.
+    */
+    std::map<std::string, RecordKeyList::iterator>::iterator found = record_key_index.find(hashed_record_name);
+    if(found != record_key_index.end()) {
+        record_key_cache.erase(found->second);
+        record_key_index.erase(found);
+    }
+}
+
+void AuthenticatedDBUser::clear_record_key_cache() {
+    // each cached SecByteBlock zeroes itself out as it is destroyed; this
+    // must also be called whenever master_key changes
+    record_key_cache.clear();
+    record_key_index.clear();
+}
+
+size_t AuthenticatedDBUser::record_key_cache_hits() const {
+    return key_cache_hits;
+}
+
 void AuthenticatedDBUser::assert_existence(const std::string& n) {
     if(record_match(n) < 1) {
         throw std::runtime_error("could not retrieve record");
@@ -321,6 +1750,8 @@ void AuthenticatedDBUser::assert_existence(const std::string& n) {
 }
 
 bool AuthenticatedDBUser::record_exists(const std::string& n) {
+    metrics::Timer timer(metrics::USER_EXISTS);
+    Borrow borrow(*this, false);
     try {
         assert_existence(n);
         return true;
@@ -329,61 +1760,368 @@ bool AuthenticatedDBUser::record_exists(const std::string& n) {
     }
 }
 
-std::vector<std::string> AuthenticatedDBUser::get_record_names() {
-    std::string muser = crypto::hash(uname_hash);
-    DBTable name_info = prepared_query("SELECT record_name FROM Keys WHERE user=?", ArgumentList({muser}));
+void AuthenticatedDBUser::for_each_record_name(const std::function<void(const std::string&)>& visit) {
+    /*
+    * Decrypt the names of all of the user's records, handing each to visit
+    * in creation order. Names are decrypted a window at a time, so memory use
+    * does not grow with the number of records the user has; with decryption
+    * threads set, a window is shared out across them.
+    */
+    metrics::Timer timer(metrics::USER_LIST);
+    Borrow borrow(*this, false);
+    std::string muser = stored_hash(uname_hash);
+    size_t window = NAME_BATCH_SIZE;
+    if(decrypt_pool) {
+        window = std::max(PARALLEL_DECRYPT_MIN, NAME_BATCH_SIZE * (decrypt_pool->size() + 1));
+    }
 
-    std::vector<std::string> result;
+    // names are all under the master key, so decrypt them in batches of up
+    // to NAME_BATCH_SIZE rather than one at a time
+    std::vector<std::string> pending;
+    std::vector<std::string> contexts; // each name's row_context
+    auto decrypt_pending = [&]() {
+        std::vector<std::string> names;
+        if(!decrypt_pool || pending.size() < PARALLEL_DECRYPT_MIN) {
+            names = stored_decrypt_batch(pending, contexts, master_key);
+        } else {
+            // each range writes only its own slots, so no locking is needed,
+            // and the names come out in the same order as sequentially
+            names.resize(pending.size());
+            decrypt_pool->parallel_for(pending.size(), NAME_BATCH_SIZE / 4, [&](size_t begin, size_t end) {
+                std::vector<std::string> range(pending.begin() + begin, pending.begin() + end);
+                std::vector<std::string> range_contexts(contexts.begin() + begin, contexts.begin() + end);
+                std::vector<std::string> decrypted = stored_decrypt_batch(range, range_contexts, master_key);
+                for(size_t i = 0; i < decrypted.size(); i++) {
+                    names[begin + i] = std::move(decrypted[i]);
+                }
+            });
+        }
+        pending.clear();
+        contexts.clear();
+        for(size_t i = 0; i < names.size(); i++) {
+            visit(names[i]);
+        }
+    };
+    // list in creation order, independent of which index serves the lookup
+    connection().query_rows("SELECT record_name, record_identifier FROM Keys WHERE user=? ORDER BY rowid",
+                            ArgumentList({stored_arg(muser)}),
+                            [&](const DBRow& row) {
+        pending.push_back(row.view(0).str());
+        contexts.push_back(row_context("Keys.record_name", muser, row.view(1).str()));
+        if(pending.size() == window) {
+            decrypt_pending();
+        }
+    });
+    decrypt_pending();
+}
 
-    for(size_t i = 0; i < name_info.size(); i++) {
-        result.push_back(crypto::decrypt(name_info[i][0], master_key));
+void AuthenticatedDBUser::set_decrypt_threads(size_t threads) {
+    /*
+    * Decrypt long record listings on threads worker threads, alongside the
+    * calling thread. 0 goes back to decrypting on the calling thread alone.
+    */
+    decrypt_pool.reset();
+    if(threads > 0) {
+        decrypt_pool.reset(new ThreadPool(threads));
     }
+}
+
+size_t AuthenticatedDBUser::decrypt_threads() const {
+    return decrypt_pool ? decrypt_pool->size() : 0;
+}
+
+std::vector<std::string> AuthenticatedDBUser::get_record_names() {
+    std::vector<std::string> result;
+    for_each_record_name([&result](const std::string& name) {
+        result.push_back(name);
+    });
     return result;
 }
 
+bool AuthenticatedDBUser::find_record(const std::string& muser, const std::string& record_id, CryptoPP::SecByteBlock& key,
+                                      std::string& contents, ChunkManifest& manifest) {
+    /*
+    * Retrieve the record along with its record key from the Keys table (if
+    * one exists) in a single lookup, and unwrap the key, reading both
+    * ciphertexts in place. A whole record is decrypted into contents; for a
+    * chunked record only the manifest is read, leaving the chunks to
+    * read_chunks.
+    * @returns whether the record is chunked; throws if it doesn't exist
+    */
+    size_t matches = 0;
+    bool chunked = false;
+    connection().query_rows("SELECT Records.record, Keys.key FROM Records JOIN Keys"
+                            " ON Keys.user=Records.owner AND Keys.record_identifier=Records.name"
+                            " WHERE Records.owner=? AND Records.name=?",
+                            ArgumentList({stored_arg(muser), stored_arg(record_id)}),
+                            [&](const DBRow& row) {
+        if(matches++ == 0) {
+            key = unwrap_record_key(muser, record_id, row.view(1));
+            DBView stored = row.view(0);
+            std::string context = row_context("Records.record", muser, record_id);
+            chunked = format == AUTHENTICATED_STORAGE && crypto::is_chunked(stored.data, stored.size);
+            if(chunked) {
+                manifest = open_manifest(stored.data, stored.size, key, context);
+            } else {
+                contents = stored_decrypt(stored, key, context);
+            }
+        }
+    });
+    
+    // ensure that exactly one such record and key exist
+    if(matches != 1) {
+        throw std::runtime_error("could not retrieve record");
+    }
+    return chunked;
+}
+
 std::string AuthenticatedDBUser::retrieve_record(const std::string& n) {
     /*
     * Access and decrypt the record n from the Records database, returning
     * it as a string
     */
+    metrics::Timer timer(metrics::USER_RETRIEVE);
+    Borrow borrow(*this, false);
 
-    // retrieve record key from Keys table (if one exists)
-    std::string muser = crypto::hash(uname_hash);
-    std::string record_id = crypto::hash(n);
-    
-    CryptoPP::SecByteBlock record_key = get_record_key(muser, record_id);
+    std::string muser = stored_hash(uname_hash);
+    std::string record_id = stored_hash(n);
+    CryptoPP::SecByteBlock key;
+    std::string record;
+    ChunkManifest manifest;
+    // the manifest and its chunks must be read from the same snapshot
+    Transaction read(connection());
+    if(find_record(muser, record_id, key, record, manifest)) {
+        std::ostringstream out;
+        read_chunks(muser, record_id, manifest, key, out);
+        record = out.str();
+    }
+    read.commit();
+    return record;
+}
 
-    // retrieve the record
-    DBTable entry = prepared_query("SELECT owner, name, record FROM Records WHERE owner=? AND name=?",
-                                    ArgumentList({muser, record_id}));
-    
-    // ensure that only one such record exists
-    if(entry.size() != 1) {
-        throw std::runtime_error("could not retrieve record");
+void AuthenticatedDBUser::retrieve_record(const std::string& n, std::ostream& out) {
+    /*
+    * Decrypt the record n to out. A chunked record is written a chunk at a
+    * time, never held in memory whole.
+    */
+    metrics::Timer timer(metrics::USER_RETRIEVE);
+    Borrow borrow(*this, false);
+
+    std::string muser = stored_hash(uname_hash);
+    std::string record_id = stored_hash(n);
+    CryptoPP::SecByteBlock key;
+    std::string record;
+    ChunkManifest manifest;
+    Transaction read(connection());
+    if(find_record(muser, record_id, key, record, manifest)) {
+        read_chunks(muser, record_id, manifest, key, out);
+    } else {
+        out.write(record.data(), record.size());
+        if(!out) {
+            throw std::runtime_error("could not write record contents");
+        }
     }
-    std::string encrypted_record = entry[0][2];
+    read.commit();
+}
 
-    // decrypt the record using the record key, and return
-    std::string record = crypto::decrypt(encrypted_record, record_key);
-    return record;
+std::string AuthenticatedDBUser::retrieve_record_range(const std::string& n, size_t offset, size_t length) {
+    /*
+    * Read length bytes of record n starting at offset, or as many as there
+    * are before the end of the record; nothing if offset is past the end.
+    * Every chunk but the last holds exactly RECORD_CHUNK_SIZE bytes, so the
+    * chunks covering the range are known up front and only those are read
+    * and decrypted. A record stored whole is decrypted whole and cut down.
+    */
+    metrics::Timer timer(metrics::USER_RETRIEVE_RANGE);
+    Borrow borrow(*this, false);
+
+    std::string muser = stored_hash(uname_hash);
+    std::string record_id = stored_hash(n);
+    CryptoPP::SecByteBlock key;
+    std::string record;
+    ChunkManifest manifest;
+    Transaction read(connection());
+    if(!find_record(muser, record_id, key, record, manifest)) {
+        read.commit();
+        return offset < record.size() ? record.substr(offset, length) : "";
+    }
+
+    std::string result;
+    if(offset < manifest.size && length > 0) {
+        sqlite3_uint64 end = (length > manifest.size - offset) ? manifest.size : offset + length;
+        sqlite3_uint64 first = offset / RECORD_CHUNK_SIZE;
+        sqlite3_uint64 last = (end - 1) / RECORD_CHUNK_SIZE;
+        sqlite3_uint64 index = first;
+        result.reserve(end - offset);
+        connection().query_rows("SELECT chunk FROM RecordChunks WHERE owner=? AND name=? AND seq BETWEEN ? AND ? ORDER BY seq",
+                                ArgumentList({stored_arg(muser), stored_arg(record_id),
+                                              DBArgument::integer(first), DBArgument::integer(last)}),
+                                [&](const DBRow& row) {
+            DBView ct = row.view(0);
+            std::string chunk = open_chunk(ct.data, ct.size, manifest, index, key);
+            if(index + 1 < manifest.chunks && chunk.size() != RECORD_CHUNK_SIZE) {
+                throw std::runtime_error("malformed chunked record");
+            }
+            // the part of [offset, end) that falls in this chunk
+            sqlite3_uint64 chunk_start = index * RECORD_CHUNK_SIZE;
+            size_t from = (offset > chunk_start) ? offset - chunk_start : 0;
+            size_t to = std::min<sqlite3_uint64>(chunk.size(), end - chunk_start);
+            if(from < to) {
+                result.append(chunk, from, to - from);
+            }
+            index++;
+        });
+        if(index != last + 1 || result.size() != end - offset) {
+            throw std::runtime_error("record is missing chunks");
+        }
+    }
+    read.commit();
+    return result;
 }
 
 void AuthenticatedDBUser::edit_record(const std::string& n, const std::string& v) {
     /*
     * Edit an already existing record n, replacing its existing data with v
     */
+    metrics::Timer timer(metrics::USER_EDIT);
+    Borrow borrow(*this, true);
     // retrieve the record key
-    std::string muser = crypto::hash(uname_hash);
-    std::string record_id = crypto::hash(n);
+    std::string muser = stored_hash(uname_hash);
+    std::string record_id = stored_hash(n);
+    Transaction edit(connection(), true);
     CryptoPP::SecByteBlock record_key = get_record_key(muser, record_id);
 
     // ensure that the record actually exists
     assert_existence(n);
 
-    // encrypt the text v and update the record
-    std::string new_encrypted_text = crypto::encrypt(v, record_key);
-    prepared_query("UPDATE Records SET record=? WHERE owner=? AND name=?",
-                   ArgumentList({new_encrypted_text, muser, record_id}));
+    // encrypt the text v and update the record, chunking large contents as
+    // create_record does
+    delete_chunks(muser, record_id);
+    std::string context = row_context("Records.record", muser, record_id);
+    std::string new_encrypted_text;
+    if(format == AUTHENTICATED_STORAGE && v.size() > RECORD_CHUNK_SIZE) {
+        std::istringstream in(v);
+        new_encrypted_text = seal_manifest(write_chunks(muser, record_id, in, record_key), record_key, context);
+    } else {
+        new_encrypted_text = seal_contents(v, record_key, context);
+    }
+    connection().prepared_query("UPDATE Records SET record=? WHERE owner=? AND name=?",
+                                ArgumentList({stored_arg(new_encrypted_text), stored_arg(muser), stored_arg(record_id)}));
+    edit.commit();
+}
+
+void AuthenticatedDBUser::append_record(const std::string& n, const std::string& v) {
+    /*
+    * Add v to the end of record n
+    */
+    metrics::Timer timer(metrics::USER_APPEND);
+    Borrow borrow(*this, true);
+    splice_record(n, 0, true, v);
+}
+
+void AuthenticatedDBUser::patch_record(const std::string& n, size_t offset, const std::string& v) {
+    /*
+    * Overwrite record n with v from byte offset on, growing the record if v
+    * runs past its end. offset may be at most the record's size.
+    */
+    metrics::Timer timer(metrics::USER_PATCH);
+    Borrow borrow(*this, true);
+    splice_record(n, offset, false, v);
+}
+
+void AuthenticatedDBUser::splice_record(const std::string& n, sqlite3_uint64 offset, bool append, const std::string& v) {
+    /*
+    * Write v into record n at offset, or at its end if append is set. A
+    * chunked record has only the chunks v falls in rewritten, plus its
+    * manifest. A record stored whole is rewritten whole, by edit_record,
+    * which chunks it once it outgrows a chunk so later changes are cheap.
+    */
+    std::string muser = stored_hash(uname_hash);
+    std::string record_id = stored_hash(n);
+    CryptoPP::SecByteBlock key;
+    std::string record;
+    ChunkManifest manifest;
+
+    Transaction splice(connection(), true);
+    if(!find_record(muser, record_id, key, record, manifest)) {
+        if(append) {
+            offset = record.size();
+        } else if(offset > record.size()) {
+            throw std::runtime_error("offset is past the end of the record");
+        }
+        if(offset + v.size() > record.size()) {
+            record.resize(offset + v.size());
+        }
+        record.replace(offset, v.size(), v);
+        edit_record(n, record);
+        splice.commit();
+        return;
+    }
+
+    if(append) {
+        offset = manifest.size;
+    } else if(offset > manifest.size) {
+        throw std::runtime_error("offset is past the end of the record");
+    }
+    write_chunk_range(muser, record_id, manifest, key, offset, v);
+    connection().prepared_query("UPDATE Records SET record=? WHERE owner=? AND name=?",
+                                ArgumentList({DBArgument::blob(seal_manifest(manifest, key,
+                                                                             row_context("Records.record", muser, record_id))),
+                                              stored_arg(muser), stored_arg(record_id)}));
+    splice.commit();
+}
+
+void AuthenticatedDBUser::write_chunk_range(const std::string& muser, const std::string& record_id, ChunkManifest& manifest,
+                                            const CryptoPP::SecByteBlock key, sqlite3_uint64 offset, const std::string& data) {
+    /*
+    * Overwrite a chunked record's contents with data from offset, which is
+    * at most the record's size, growing the record if data runs past its
+    * end. Each chunk data touches is read, changed and rewritten under the
+    * record's generation and a new version, so that what it held before
+    * no longer opens; chunks stay full up to the last one, and manifest is
+    * updated to match. The caller stores the manifest.
+    */
+    manifest.writes++;
+    size_t written = 0;
+    while(written < data.size()) {
+        sqlite3_uint64 position = offset + written;
+        sqlite3_uint64 index = position / RECORD_CHUNK_SIZE;
+        size_t from = position - index * RECORD_CHUNK_SIZE;
+        size_t count = std::min<size_t>(RECORD_CHUNK_SIZE - from, data.size() - written);
+
+        std::string chunk;
+        if(index < manifest.chunks) {
+            size_t found = 0;
+            connection().query_rows("SELECT chunk FROM RecordChunks WHERE owner=? AND name=? AND seq=?",
+                                    ArgumentList({stored_arg(muser), stored_arg(record_id), DBArgument::integer(index)}),
+                                    [&](const DBRow& row) {
+                DBView ct = row.view(0);
+                chunk = open_chunk(ct.data, ct.size, manifest, index, key);
+                found++;
+            });
+            if(found != 1) {
+                throw std::runtime_error("record is missing chunks");
+            }
+        }
+        if(from > chunk.size()) {
+            throw std::runtime_error("malformed chunked record");
+        }
+        if(from + count > chunk.size()) {
+            chunk.resize(from + count);
+        }
+        chunk.replace(from, count, data, written, count);
+
+        manifest.versions[index] = manifest.writes;
+        std::string ct = seal_contents(chunk, key, chunk_context(manifest, index));
+        connection().prepared_query("INSERT OR REPLACE INTO RecordChunks (owner, name, seq, chunk) VALUES (?, ?, ?, ?)",
+                                    ArgumentList({stored_arg(muser), stored_arg(record_id),
+                                                  DBArgument::integer(index), DBArgument::blob(ct)}));
+        if(index >= manifest.chunks) {
+            manifest.chunks = index + 1;
+        }
+        written += count;
+    }
+    manifest.size = std::max<sqlite3_uint64>(manifest.size, offset + data.size());
 }
 
 void AuthenticatedDBUser::delete_record(const std::string& n) {
@@ -391,51 +2129,370 @@ void AuthenticatedDBUser::delete_record(const std::string& n) {
     * Delete the record n
     * Requires that record n exists and that the current user is n's owner
     */
-    std::string muser = crypto::hash(uname_hash);
-    std::string record_id = crypto::hash(n);
+    metrics::Timer timer(metrics::USER_DELETE);
+    Borrow borrow(*this, true);
+    std::string muser = stored_hash(uname_hash);
+    std::string record_id = stored_hash(n);
 
+    Transaction removal(connection(), true);
     assert_existence(n);
 
     // Delete both the record itself and the owner's record key
-    DB::prepared_query("DELETE FROM Records WHERE owner=? AND name=?",
-                        ArgumentList({muser, record_id}));
-    DB::prepared_query("DELETE FROM Keys WHERE user=? AND record_identifier=?",
-                        ArgumentList({muser, record_id}));
+    connection().prepared_query("DELETE FROM Records WHERE owner=? AND name=?",
+                        ArgumentList({stored_arg(muser), stored_arg(record_id)}));
+    connection().prepared_query("DELETE FROM Keys WHERE user=? AND record_identifier=?",
+                        ArgumentList({stored_arg(muser), stored_arg(record_id)}));
+    delete_chunks(muser, record_id);
+    removal.commit();
+    forget_record_key(record_id);
+}
+
+size_t AuthenticatedDBUser::upgrade_record_encryption() {
+    /*
+    * Re-encrypt every one of the user's records that still has a legacy
+    * ciphertext (its name, wrapped key or contents, in AES-CBC or in AES-GCM
+    * not bound to its row) with AES-GCM bound to its row, so that it is
+    * authenticated from then on. Record keys are unchanged; only their
+    * wrapping is. Once none are left, the user is marked in Users so that
+    * legacy ciphertexts are refused in every later session, even if one is
+    * put back in place. A database rolled back as a whole, that mark
+    * included, to a copy from before the upgrade is out of scope.
+    * @returns the number of records that were upgraded
+    */
+    metrics::Timer timer(metrics::USER_UPGRADE);
+    Borrow borrow(*this, true);
+    if(format != AUTHENTICATED_STORAGE) {
+        throw std::runtime_error("database does not support authenticated encryption");
+    }
+    std::string muser = stored_hash(uname_hash);
+    size_t upgraded = 0;
+
+    Transaction upgrade(connection(), true);
+    // work through the legacy entries a batch at a time, in rowid order
+    sqlite3_int64 last = -1;
+    DBTable batch;
+    while((batch = connection().prepared_query("SELECT Keys.rowid, Records.rowid, Keys.record_name, Keys.key, Records.record,"
+                                               " Keys.record_identifier FROM Keys JOIN Records"
+                                               " ON Records.owner=Keys.user AND Records.name=Keys.record_identifier"
+                                               " WHERE Keys.user=? AND Keys.rowid>?"
+                                               " AND (substr(Keys.record_name, 1, 1)<X'80' OR substr(Keys.key, 1, 1)<X'80'"
+                                               " OR substr(Records.record, 1, 1)<X'80')"
+                                               " ORDER BY Keys.rowid LIMIT 100",
+                                               ArgumentList({stored_arg(muser), DBArgument::integer(last)}))).size() > 0) {
+        for(size_t i = 0; i < batch.size(); i++) {
+            const std::string& record_id = batch[i][5];
+            std::string name_context = row_context("Keys.record_name", muser, record_id);
+            std::string key_context = row_context("Keys.key", muser, record_id);
+            std::string record_context = row_context("Records.record", muser, record_id);
+            std::string name = stored_decrypt(batch[i][2], master_key, name_context);
+            CryptoPP::SecByteBlock record_key = crypto::_impl_details::string_to_bytes(
+                stored_decrypt(batch[i][3], master_key, key_context));
+            std::string name_encrypt = stored_encrypt(name, master_key, name_context);
+            std::string key_encrypt = stored_encrypt(crypto::_impl_details::bytes_to_string(record_key), master_key, key_context);
+            const std::string& stored = batch[i][4];
+            std::string record_encrypt = stored;
+            if(crypto::is_chunked(stored.data(), stored.size())) {
+                // the chunks are bound to the manifest's generation already;
+                // only the manifest itself needs binding to the row
+                record_encrypt = seal_manifest(open_manifest(stored.data(), stored.size(), record_key, record_context),
+                                               record_key, record_context);
+            } else if(!crypto::is_bound(stored.data(), stored.size())) {
+                record_encrypt = seal_contents(stored_decrypt(stored, record_key, record_context), record_key, record_context);
+            }
+            connection().prepared_query("UPDATE Keys SET record_name=?, key=? WHERE rowid=?",
+                                        ArgumentList({stored_arg(name_encrypt), stored_arg(key_encrypt), batch[i][0]}));
+            connection().prepared_query("UPDATE Records SET record=? WHERE rowid=?",
+                                        ArgumentList({stored_arg(record_encrypt), batch[i][1]}));
+            upgraded++;
+        }
+        last = std::atoll(batch.back()[0].c_str());
+    }
+    drop_legacy_ciphers();
+    upgrade.commit();
+    legacy_ciphers = false;
+
+    // every rewrapped key would miss in the cache anyway; drop them now
+    clear_record_key_cache();
+    return upgraded;
+}
+
+std::vector<RecordResult> AuthenticatedDBUser::run_batch(size_t count, bool writes,
+                                                         const std::function<void(size_t, RecordResult&)>& item) {
+    /*
+    * Run item(i, result) for i = 0..count-1 inside a single transaction,
+    * so that the whole batch costs one commit. Each item runs under its own
+    * savepoint: an item that throws is rolled back by itself and reported
+    * as failed, and the rest of the batch carries on.
+    * @arguments
+    * ~ writes: take the write lock up front, rather than on first write
+    * @returns one RecordResult per item, in order
+    */
+    Borrow borrow(*this, writes);
+    std::vector<RecordResult> results(count);
+    Transaction batch(connection(), writes);
+    for(size_t i = 0; i < count; i++) {
+        Transaction batch_item(connection());
+        try {
+            item(i, results[i]);
+            batch_item.commit();
+            results[i].ok = true;
+        } catch(std::exception& e) {
+            batch_item.rollback();
+            results[i].ok = false;
+            results[i].error = e.what();
+        }
+    }
+    batch.commit();
+    return results;
+}
+
+std::vector<RecordResult> AuthenticatedDBUser::create_records(const RecordList& records) {
+    metrics::Timer timer(metrics::USER_BATCH_CREATE);
+    return run_batch(records.size(), true, [&](size_t i, RecordResult&) {
+        create_record(records[i].first, records[i].second);
+    });
+}
+
+std::vector<RecordResult> AuthenticatedDBUser::write_records(const RecordList& records) {
+    metrics::Timer timer(metrics::USER_BATCH_WRITE);
+    // create each record, or replace its contents if it already exists
+    return run_batch(records.size(), true, [&](size_t i, RecordResult&) {
+        if(record_exists(records[i].first)) {
+            edit_record(records[i].first, records[i].second);
+        } else {
+            create_record(records[i].first, records[i].second);
+        }
+    });
+}
+
+std::vector<RecordResult> AuthenticatedDBUser::retrieve_records(const std::vector<std::string>& names) {
+    metrics::Timer timer(metrics::USER_BATCH_RETRIEVE);
+    return run_batch(names.size(), false, [&](size_t i, RecordResult& result) {
+        result.value = retrieve_record(names[i]);
+    });
+}
+
+std::vector<RecordResult> AuthenticatedDBUser::delete_records(const std::vector<std::string>& names) {
+    metrics::Timer timer(metrics::USER_BATCH_DELETE);
+    return run_batch(names.size(), true, [&](size_t i, RecordResult&) {
+        delete_record(names[i]);
+    });
 }
 
 DBTable AuthenticatedDBUser::debug_prepared_query(std::string q, const ArgumentList& args) {
+    Borrow borrow(*this, true);
     // For debugging only - call the parent's prepared_query from the child class
-    return prepared_query(q, args);
+    return connection().prepared_query(q, args);
+}
+
+
+ConnectionPool::ConnectionPool(const char* dbname, size_t reader_count, const DBOptions& options) {
+    /*
+    * Open the writer connection and reader_count read-only connections to
+    * dbname. The writer is opened first, so that it can put a new database
+    * into the journal mode options asks for before any reader opens it.
+    * @results throws std::runtime_error if any connection can't be opened
+    */
+    writer.reset(new DB(dbname, options));
+    writer_idle = true;
+    waits = 0;
+
+    DBOptions reader_options = options;
+    reader_options.read_only = true;
+    for(size_t i = 0; i < reader_count; i++) {
+        readers.push_back(std::unique_ptr<DB>(new DB(dbname, reader_options)));
+        idle_readers.push_back(readers.back().get());
+    }
+}
+
+ConnectionPool::Lease ConnectionPool::read() {
+    // check out a read connection, waiting for one to be returned if need be
+    std::unique_lock<std::mutex> guard(lock);
+    if(readers.empty()) {
+        throw std::runtime_error("connection pool has no read connections");
+    }
+    if(idle_readers.empty()) {
+        waits++;
+        returned.wait(guard, [this]() { return !idle_readers.empty(); });
+    }
+    DB* connection = idle_readers.back();
+    idle_readers.pop_back();
+    return Lease(this, connection, false);
+}
+
+ConnectionPool::Lease ConnectionPool::write() {
+    // check out the writer, waiting for whoever holds it to be done
+    std::unique_lock<std::mutex> guard(lock);
+    if(!writer_idle) {
+        waits++;
+        returned.wait(guard, [this]() { return writer_idle; });
+    }
+    writer_idle = false;
+    return Lease(this, writer.get(), true);
+}
+
+void ConnectionPool::give_back(DB* connection, bool writes) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if(writes) {
+            writer_idle = true;
+        } else {
+            idle_readers.push_back(connection);
+        }
+    }
+    // readers and the writer wait on the same condition
+    returned.notify_all();
+}
+
+size_t ConnectionPool::reader_count() const {
+    return readers.size();
+}
+
+size_t ConnectionPool::lease_waits() {
+    std::lock_guard<std::mutex> guard(lock);
+    return waits;
+}
+
+ConnectionPool::Lease::Lease(ConnectionPool* pool, DB* connection, bool writes) {
+    this->pool = pool;
+    this->connection = connection;
+    this->writes = writes;
+}
+
+ConnectionPool::Lease::Lease(Lease&& lease) {
+    pool = lease.pool;
+    connection = lease.connection;
+    writes = lease.writes;
+    lease.pool = NULL;
+    lease.connection = NULL;
+}
+
+ConnectionPool::Lease::~Lease() {
+    if(pool != NULL) {
+        pool->give_back(connection, writes);
+    }
 }
 
+DB& ConnectionPool::Lease::operator*() const {
+    return *connection;
+}
 
-/* NOTE: All LockedDB functionality is purely experimental at this time */
+DB* ConnectionPool::Lease::operator->() const {
+    return connection;
+}
 
-LockedDB::LockedDB(const char* dbname) : DB::DB(dbname) {
-    DB::prepared_query("BEGIN EXCLUSIVE TRANSACTION", ArgumentList({}));
-    transaction_number = 1;
-    savepoint_start = crypto::random_token();
+LockedDB::LockedDB(const char* dbname, size_t max_retries, const DBOptions& options) : DB::DB(dbname, options) {
+    /*
+    * Open dbname for use alongside other processes.
+    * @arguments
+    * ~ max_retries: how many times a transaction that finds the database
+        busy is retried before the DBBusy error is passed to the caller
+    * ~ options: how to configure the connection; see DBOptions
+    */
+    this->max_retries = max_retries;
+    retries = 0;
+    active = false;
+    writing = false;
 }
 
 LockedDB::~LockedDB() {
-    std::cout << "destruting locked db\n";
-    DB::prepared_query("COMMIT TRANSACTION", ArgumentList({}));
+    // savepoints must be rolled back innermost first
+    while(!savepoints.empty()) {
+        savepoints.pop_back();
+    }
 }
 
-DBTable LockedDB::prepared_query(std::string q, const ArgumentList& args) {
-    DBTable result = DB::prepared_query(q, args);
-    std::ostringstream transaction_point;
-    transaction_point << "SAVEPOINT " << savepoint_start << '_' << transaction_number;
-    std::cout << "about to set savepoint\n";
-    DB::prepared_query(transaction_point.str(), ArgumentList({}));
-    transaction_number++;
-    return result;
+void LockedDB::read(const std::function<void(LockedDB&)>& body) {
+    run(false, body);
+}
+
+void LockedDB::write(const std::function<void(LockedDB&)>& body) {
+    run(true, body);
+}
+
+void LockedDB::run(bool writer, const std::function<void(LockedDB&)>& body) {
+    /*
+    * Run body in a transaction, retrying it from the start while the
+    * database is busy. A transaction opened inside body joins the one
+    * already running, but a read transaction cannot be upgraded to a write.
+    */
+    if(active) {
+        if(writer && !writing) {
+            throw std::runtime_error("cannot write inside a read transaction");
+        }
+        body(*this);
+        return;
+    }
+
+    for(size_t attempt = 0; ; attempt++) {
+        try {
+            Transaction transaction(*this, writer);
+            active = true;
+            writing = writer;
+            try {
+                body(*this);
+            } catch(...) {
+                // the savepoints roll themselves back, innermost first
+                while(!savepoints.empty()) {
+                    savepoints.pop_back();
+                }
+                active = false;
+                throw;
+            }
+            close_savepoints(1, true);
+            active = false;
+            transaction.commit();
+            return;
+        } catch(DBBusy&) {
+            if(attempt >= max_retries) {
+                throw;
+            }
+            retries++;
+            busy_backoff(attempt);
+        }
+    }
+}
+
+void LockedDB::close_savepoints(size_t n, bool keep) {
+    // release or roll back savepoint n and every savepoint opened after it
+    while(savepoints.size() >= n) {
+        if(keep) {
+            savepoints.back()->commit();
+        } else {
+            savepoints.back()->rollback();
+        }
+        savepoints.pop_back();
+    }
+}
+
+size_t LockedDB::savepoint() {
+    /*
+    * Mark a point in the current transaction that rollback() can return to.
+    * @results the savepoint's number, to be passed to release() or rollback()
+    */
+    if(!active) {
+        throw std::runtime_error("savepoints can only be created inside a transaction");
+    }
+    savepoints.push_back(std::unique_ptr<Transaction>(new Transaction(*this)));
+    return savepoints.size();
+}
+
+void LockedDB::release(size_t n) {
+    // keep the changes made since savepoint n, and forget it
+    if(n == 0 || n > savepoints.size()) {
+        throw std::runtime_error("no such savepoint");
+    }
+    close_savepoints(n, true);
 }
 
 void LockedDB::rollback(size_t n) {
-    std::ostringstream transaction_point;
-    transaction_point << "ROLLBACK TRANSACTION TO SAVEPOINT " << savepoint_start << '_' << n;
+    // undo every change made since savepoint n, and forget it
+    if(n == 0 || n > savepoints.size()) {
+        throw std::runtime_error("no such savepoint");
+    }
+    close_savepoints(n, false);
+}
 
-    std::cout << "about to rollback to savepoint\n";
-    DB::prepared_query(transaction_point.str(), ArgumentList({}));
-}
\ No newline at end of file
+size_t LockedDB::busy_retries() const {
+    return retries;
+}
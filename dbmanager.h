@@ -7,10 +7,134 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <list>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <stdexcept>
 #include "cryptopp890/secblock.h"
+#include "threadpool.h"
+#include "compression.h"
 
 typedef std::vector< std::vector<std::string> > DBTable;
-typedef std::vector<std::string> ArgumentList;
+/*
+* DBArgument: A value to be bound to one '?' of a prepared query. Strings
+* convert implicitly and are bound as text; the static constructors bind
+* blobs, integers and NULL.
+* Text and blobs built from an existing string or buffer are not copied: the
+* argument only refers to it, so it must outlive the query. Arguments built
+* from a temporary std::string take ownership of it instead.
+*/
+class DBArgument {
+    public:
+        typedef enum { TEXT, BLOB, INTEGER, NULL_VALUE } Type;
+    private:
+        Type type;
+        bool owns;
+        std::string owned; // holds the value when built from a temporary
+        const char* data; // otherwise, refers to the caller's buffer
+        size_t length;
+        sqlite3_int64 integer_value;
+
+        DBArgument(Type t);
+    public:
+        DBArgument(const std::string& v);
+        DBArgument(std::string&& v);
+        DBArgument(const char* v);
+        static DBArgument text(const char* v, size_t n);
+        static DBArgument blob(const std::string& bytes);
+        static DBArgument blob(std::string&& bytes);
+        static DBArgument blob(const void* bytes, size_t n);
+        static DBArgument integer(sqlite3_int64 v);
+        static DBArgument null();
+
+        Type get_type() const;
+        const char* get_data() const;
+        size_t get_size() const;
+        sqlite3_int64 get_integer() const;
+};
+
+typedef std::vector<DBArgument> ArgumentList;
+
+/*
+* Storage formats, recorded in the database's user_version. HEX_STORAGE
+* databases hold hashes and ciphertexts as hex text; BINARY_STORAGE databases
+* hold the same values as raw BLOBs. AUTHENTICATED_STORAGE databases are
+* binary, with every ciphertext tagged with its cipher, and write with
+* AES-GCM. See upgrade_storage_format.
+*/
+typedef enum { HEX_STORAGE = 0, BINARY_STORAGE = 1, AUTHENTICATED_STORAGE = 2 } StorageFormat;
+
+/*
+* DBView: The bytes of one column of the current row, read in place from
+* SQLite's buffer. Only valid until the query steps to its next row.
+*/
+struct DBView {
+    const char* data;
+    size_t size;
+
+    std::string str() const;
+};
+
+/*
+* DBRow: A view of the row a query is currently positioned on. Only valid
+* for the duration of the RowVisitor call it is handed to.
+* operator[] copies a column into a std::string; view and integer read it
+* without allocating.
+*/
+class DBRow {
+    private:
+        sqlite3_stmt* pstmt;
+    public:
+        explicit DBRow(sqlite3_stmt* stmt);
+
+        int size() const;
+        std::string operator[](int i) const;
+        DBView view(int i) const;
+        sqlite3_int64 integer(int i) const;
+        bool is_blob(int i) const;
+        bool is_null(int i) const;
+};
+
+typedef std::function<void(const DBRow&)> RowVisitor;
+
+/*
+* DBBusy: Thrown when a query could not run because another connection held
+* a conflicting lock (SQLITE_BUSY or SQLITE_LOCKED) for longer than the
+* connection's busy handler was willing to wait. The transaction it was part
+* of should be rolled back and may be retried.
+*/
+class DBBusy : public std::runtime_error {
+    public:
+        DBBusy(const std::string& what) : std::runtime_error(what) {}
+};
+
+/*
+* DBOptions: How a DB configures SQLite when it opens a database. An empty
+* string or a 0 leaves SQLite's own default in place.
+* Presets: durable() keeps SQLite's defaults (rollback journal, full sync);
+* balanced() uses write-ahead logging, so readers don't block the writer,
+* and memory-maps the file for cheaper reads; bulk_load() gives up crash
+* safety for speed, for building a database that can be rebuilt if lost.
+*/
+struct DBOptions {
+    std::string journal_mode; // DELETE, TRUNCATE, PERSIST, MEMORY, WAL or OFF
+    std::string synchronous; // OFF, NORMAL, FULL or EXTRA
+    sqlite3_int64 mmap_size; // bytes of the file to memory-map
+    int cache_size; // pages if positive, KiB if negative, as PRAGMA cache_size
+    int page_size; // bytes; only applies to a new database, or after VACUUM
+    std::string temp_store; // DEFAULT, FILE or MEMORY
+    bool read_only; // open the database read-only
+
+    DBOptions();
+    static DBOptions durable();
+    static DBOptions balanced();
+    static DBOptions bulk_load();
+
+    std::string describe() const;
+};
 
 /*
 * DB: A bare-bones C++ wrapper over the SQLite C library
@@ -18,21 +142,195 @@ typedef std::vector<std::string> ArgumentList;
 * AuthenticatedDBUser class to perform its operations securely.
 * Currently, the only operation provided is a generic prepared query
 * operation. More operations will be added in the future as needed.
+* Compiled statements are kept in a small LRU cache keyed by query text, so
+* repeated queries skip SQLite's parsing and planning.
 */
 class DB {
+    friend class Transaction;
     private:
+        typedef std::list< std::pair<std::string, sqlite3_stmt*> > StatementList;
+
         sqlite3* db;
+        size_t transaction_depth; // number of open Transactions
+        StatementList statement_cache; // most recently used first
+        std::map<std::string, StatementList::iterator> statement_index;
+        size_t cache_hits;
+        size_t cache_misses;
+
+        // a statement that ran for longer than the slow query threshold,
+        // kept until the query that ran it is finished and it can be logged
+        struct SlowQuery {
+            std::string sql;
+            sqlite3_int64 nanoseconds;
+            int full_scan_steps;
+            int vm_steps;
+        };
+        // NULL unless the slow query log was on when the connection opened
+        std::unique_ptr< std::vector<SlowQuery> > slow_queries;
+
+        static int busy_wait(void*, int attempts);
+        static int profile(unsigned type, void* context, void* statement, void* elapsed);
+        void log_pending_slow_queries();
+        std::string explain_query_plan(const std::string& q);
+        void configure(const DBOptions& options);
+        sqlite3_stmt* acquire_statement(const std::string& q);
+        void release_statement(const std::string& q, sqlite3_stmt* pstmt);
+        void clear_statement_cache();
     protected:
         sqlite3* get_db(); // for debugging only
     public:
+        static const size_t STATEMENT_CACHE_SIZE = 16;
+        // how many times a statement that finds the database locked is
+        // retried, with backoff, before it fails with DBBusy
+        static const int BUSY_RETRY_LIMIT = 16;
+
         DB();
         DB(const DB&) = delete;
         DB(DB&&);
         DB& operator=(DB&& database);
-        DB(const char* dbname);
+        DB(const char* dbname, const DBOptions& options = DBOptions::balanced());
         ~DB();
 
         DBTable prepared_query(std::string q, const ArgumentList& args);
+        void query_rows(std::string q, const ArgumentList& args, const RowVisitor& visit);
+
+        size_t statement_cache_hits() const;
+        size_t statement_cache_misses() const;
+
+        // Slow query log: statements that take at least threshold_ms, on
+        // connections opened from now on, are written to out with their
+        // normalized SQL, duration and the rows they stepped through. With
+        // explain, the first time each statement is logged its query plan is
+        // too, so a lookup that scans a whole table stands out. A threshold
+        // of 0 turns the log off for every connection. Process-wide. SQLite
+        // times statements to the millisecond, so a smaller threshold acts
+        // as 1 ms.
+        static void log_slow_queries(double threshold_ms, std::ostream* out, bool explain);
+        static std::string normalize_sql(const std::string& sql);
+
+        StorageFormat storage_format();
+        // the codec new record contents are compressed with, kept in the
+        // database so that every connection to it agrees
+        compression::Codec record_codec();
+        void set_record_codec(compression::Codec codec);
+        DBOptions effective_options();
+};
+
+/*
+* Transaction: An RAII transaction on a DB. The outermost Transaction on a
+* connection issues BEGIN; Transactions opened inside it nest as savepoints.
+* A Transaction that goes out of scope without commit() having been called,
+* e.g. because an exception was thrown, rolls back everything done since it
+* was opened.
+*/
+class Transaction {
+    private:
+        DB& database;
+        size_t depth; // 0 for the outermost Transaction
+        bool finished;
+
+        std::string savepoint() const;
+    public:
+        Transaction(DB& db, bool immediate = false);
+        Transaction(const Transaction&) = delete;
+        Transaction& operator=(const Transaction&) = delete;
+        ~Transaction();
+
+        void commit();
+        void rollback();
+};
+
+/*
+* ConnectionPool: Connections to one database, shared between threads. Reads
+* check out one of several read-only connections, which in WAL mode all read
+* at once alongside a writer; writes are serialized through a single writer
+* connection. A thread that finds no connection free waits for one.
+* A Lease returns its connection to the pool when it goes out of scope. Each
+* leased connection must only be used by the thread holding the lease.
+*/
+class ConnectionPool {
+    private:
+        std::mutex lock;
+        std::condition_variable returned;
+        std::unique_ptr<DB> writer; // declared first so that it closes last
+        bool writer_idle;
+        std::vector< std::unique_ptr<DB> > readers;
+        std::vector<DB*> idle_readers;
+        size_t waits;
+
+        void give_back(DB* connection, bool writes);
+    public:
+        static const size_t DEFAULT_READERS = 4;
+
+        class Lease {
+            private:
+                ConnectionPool* pool;
+                DB* connection;
+                bool writes;
+            public:
+                Lease(ConnectionPool* pool, DB* connection, bool writes);
+                Lease(const Lease&) = delete;
+                Lease(Lease&& lease);
+                ~Lease();
+
+                DB& operator*() const;
+                DB* operator->() const;
+        };
+
+        ConnectionPool(const char* dbname, size_t reader_count = DEFAULT_READERS,
+                       const DBOptions& options = DBOptions::balanced());
+        ConnectionPool(const ConnectionPool&) = delete;
+
+        Lease read();
+        Lease write();
+
+        size_t reader_count() const;
+        size_t lease_waits(); // how often a thread had to wait for a connection
+};
+
+void migrate_to_binary_storage(DB& database);
+void migrate_to_authenticated_storage(DB& database);
+void upgrade_storage_format(DB& database);
+
+/*
+* RecordResult: The outcome of one item of a batch record operation
+*/
+struct RecordResult {
+    bool ok;
+    std::string value; // the record's contents, for reads
+    std::string error; // why the item failed, if it did
+};
+
+typedef std::vector< std::pair<std::string, std::string> > RecordList;
+
+/*
+* PreparedRecord: A record hashed and encrypted ready to be stored, but not
+* yet written. StoredRecord: A record's ciphertexts as read back from the
+* database, not yet decrypted. Preparing and opening records is CPU work
+* alone, so bulk tools can spread it over several threads.
+*/
+struct PreparedRecord {
+    std::string identifier; // the hashed name
+    std::string wrapped_name; // the name, under the master key
+    std::string wrapped_key; // the record key, under the master key
+    std::string contents; // the contents, under the record key
+    // for contents over RECORD_CHUNK_SIZE in an authenticated database, the
+    // chunks, in order, with contents holding their manifest
+    std::vector<std::string> chunks;
+};
+
+struct StoredRecord {
+    std::string identifier; // the hashed name
+    std::string wrapped_name;
+    std::string wrapped_key;
+    std::string contents; // or, for a chunked record, its manifest
+    // a chunked record is handed over first as itself, with chunks set to
+    // the number of its chunks that follow, and then once per chunk in
+    // order, with is_chunk set and that chunk in chunk
+    sqlite3_uint64 chunks;
+    bool is_chunk;
+    sqlite3_uint64 chunk_index;
+    std::string chunk;
 };
 
 /*
@@ -42,59 +340,228 @@ class DB {
 */
 class AuthenticatedDBUser : private DB {
     private:
+        // an unwrapped record key, along with the wrapped form it was
+        // decrypted from so that a rewrapped or replaced key is never reused
+        struct CachedRecordKey {
+            std::string hashed_record_name;
+            std::string wrapped_key;
+            CryptoPP::SecByteBlock key;
+        };
+        typedef std::list<CachedRecordKey> RecordKeyList;
+
         std::string uname_hash; 
         std::string salted_pwd_hash;
         CryptoPP::SecByteBlock master_key;
         bool lockdown; // tested by assert_safe, set to true if we enter an insecure state
+        StorageFormat format; // how hashes and ciphertexts are stored
+        // whether ciphertexts that aren't bound to their records (AES-CBC,
+        // or AES-GCM sealed before they were bound) are still accepted;
+        // cleared once none of the user's are left, and in every later
+        // session once Users.bound_ciphers records that
+        bool legacy_ciphers;
+        compression::Codec codec; // how new record contents are compressed
         // Upcoming design decision: do we keep lockdown, or simply throw an exception
         // if there's a security problem?
+        RecordKeyList record_key_cache; // most recently used first
+        std::map<std::string, RecordKeyList::iterator> record_key_index;
+        size_t key_cache_hits;
+        ConnectionPool* pool; // NULL if this user owns its own connection
+        DB* borrowed; // the connection leased for the current operation
+        bool borrowed_writes;
+        std::shared_ptr<ThreadPool> decrypt_pool; // NULL to decrypt on the calling thread
+
+        // Borrow: leases a connection from the pool, if there is one, for the
+        // duration of one operation. Operations nested inside it share it.
+        class Borrow {
+            private:
+                AuthenticatedDBUser& user;
+                std::unique_ptr<ConnectionPool::Lease> lease;
+            public:
+                Borrow(AuthenticatedDBUser& user, bool writes);
+                Borrow(const Borrow&) = delete;
+                ~Borrow();
+        };
+
+        DB& connection();
 
         void assert_safe();
 
         CryptoPP::SecByteBlock get_record_key(const std::string& muser, const std::string& hashed_record_name);
+        CryptoPP::SecByteBlock unwrap_record_key(const std::string& muser, const std::string& hashed_record_name,
+                                                 const DBView& wrapped_key);
+        void forget_record_key(const std::string& hashed_record_name);
+        void clear_record_key_cache();
+
+        std::vector<RecordResult> run_batch(size_t count, bool writes,
+                                            const std::function<void(size_t, RecordResult&)>& item);
         void assert_existence(const std::string& n);
         
         void authenticate(const std::string& username_plain, const std::string& password_plain);
+        bool has_bound_ciphers();
+        bool has_legacy_ciphers(const std::string& muser);
+        void drop_legacy_ciphers();
 
         int record_match(const std::string& n);
+        bool insert_prepared(const std::string& muser, const PreparedRecord& record);
+        PreparedRecord prepare_record(const std::string& n, const std::string& v, const CryptoPP::SecByteBlock key) const;
+
+        // chunked records: the contents are stored in RecordChunks, a chunk
+        // of up to RECORD_CHUNK_SIZE bytes per row, and the Records entry
+        // holds a manifest. generation is random and new each time the
+        // chunks are written, so that a chunk from an earlier version of the
+        // record can't be passed off as part of the current one. Chunks
+        // rewritten in place by a splice keep the generation, so each is
+        // bound to the number of the splice that last wrote it instead.
+        struct ChunkManifest {
+            std::string generation;
+            sqlite3_uint64 size; // total bytes of contents
+            sqlite3_uint64 chunks;
+            sqlite3_uint64 writes; // splices since the generation began
+            std::map<sqlite3_uint64, sqlite3_uint64> versions; // chunk -> the splice that wrote it
+        };
+        std::string chunk_context(const ChunkManifest& manifest, sqlite3_uint64 index) const;
+        std::string seal_manifest(const ChunkManifest& manifest, const CryptoPP::SecByteBlock key,
+                                  const std::string& context) const;
+        ChunkManifest open_manifest(const char* ct, size_t length, const CryptoPP::SecByteBlock key,
+                                    const std::string& context) const;
+        std::string open_chunk(const char* ct, size_t length, const ChunkManifest& manifest, sqlite3_uint64 index,
+                               const CryptoPP::SecByteBlock key) const;
+        ChunkManifest write_chunks(const std::string& muser, const std::string& record_id, std::istream& in,
+                                   const CryptoPP::SecByteBlock key);
+        void read_chunks(const std::string& muser, const std::string& record_id, const ChunkManifest& manifest,
+                         const CryptoPP::SecByteBlock key, std::ostream& out);
+        void delete_chunks(const std::string& muser, const std::string& record_id);
+        void write_chunk_range(const std::string& muser, const std::string& record_id, ChunkManifest& manifest,
+                               const CryptoPP::SecByteBlock key, sqlite3_uint64 offset, const std::string& data);
+        void splice_record(const std::string& n, sqlite3_uint64 offset, bool append, const std::string& v);
+        bool find_record(const std::string& muser, const std::string& record_id, CryptoPP::SecByteBlock& key,
+                         std::string& contents, ChunkManifest& manifest);
+
+        // hash, encrypt, decrypt and bind values in this database's format.
+        // In authenticated databases every ciphertext is bound to context,
+        // which names where it is stored (see row_context), so that it can't
+        // be moved to another row or column
+        std::string stored_hash(const std::string& str) const;
+        std::string stored_encrypt(const std::string& str, const CryptoPP::SecByteBlock key, const std::string& context) const;
+        std::string seal_contents(const std::string& v, const CryptoPP::SecByteBlock key, const std::string& context) const;
+        std::string open_sealed(const char* ct, size_t length, const CryptoPP::SecByteBlock key,
+                                const std::string& context) const;
+        std::string stored_decrypt(const std::string& ct, const CryptoPP::SecByteBlock key, const std::string& context) const;
+        std::string stored_decrypt(const DBView& ct, const CryptoPP::SecByteBlock key, const std::string& context) const;
+        std::vector<std::string> stored_decrypt_batch(const std::vector<std::string>& cts, const std::vector<std::string>& contexts,
+                                                      const CryptoPP::SecByteBlock key) const;
+        DBArgument stored_arg(const std::string& value) const;
     public:
+        static const size_t RECORD_KEY_CACHE_SIZE = 64;
+        static const size_t NAME_BATCH_SIZE = 256;
+        static const size_t RECORD_CHUNK_SIZE = 64 * 1024;
+        // lists shorter than this are decrypted on the calling thread, where
+        // handing the work out would cost more than it saves
+        static const size_t PARALLEL_DECRYPT_MIN = 1024;
+
         AuthenticatedDBUser();
         AuthenticatedDBUser(const AuthenticatedDBUser&) = delete;
         AuthenticatedDBUser(AuthenticatedDBUser&&);
         AuthenticatedDBUser& operator=(AuthenticatedDBUser&& database);
         AuthenticatedDBUser(const std::string& username_plain, const std::string& password_plain);
         AuthenticatedDBUser(const std::string& username_plain, const std::string& password_plain, const std::string& dbname);
+        AuthenticatedDBUser(const std::string& username_plain, const std::string& password_plain, ConnectionPool& pool);
         ~AuthenticatedDBUser();
 
         std::vector<std::string> get_record_names();
+        void for_each_record_name(const std::function<void(const std::string&)>& visit);
+        void set_decrypt_threads(size_t threads); // 0 decrypts sequentially
+        size_t decrypt_threads() const;
         void create_record(const std::string& n, const std::string& v);
         std::string retrieve_record(const std::string& n);
+        // streaming: contents are read and written a chunk at a time, so
+        // memory use is bounded by RECORD_CHUNK_SIZE, not the record's size
+        void create_record(const std::string& n, std::istream& v);
+        void retrieve_record(const std::string& n, std::ostream& out);
+        // up to length bytes of n from offset; for a chunked record only the
+        // chunks that overlap the range are read and decrypted
+        std::string retrieve_record_range(const std::string& n, size_t offset, size_t length);
         void edit_record(const std::string& n, const std::string& v);
+        // change part of a record: only the chunks the new bytes fall in are
+        // rewritten, so the cost follows the size of v, not of the record
+        void append_record(const std::string& n, const std::string& v);
+        void patch_record(const std::string& n, size_t offset, const std::string& v);
         void delete_record(const std::string& n);
 
+        // batch operations: each runs in a single transaction, and reports
+        // success or failure per item without stopping at the first failure
+        std::vector<RecordResult> create_records(const RecordList& records);
+        std::vector<RecordResult> write_records(const RecordList& records);
+        std::vector<RecordResult> retrieve_records(const std::vector<std::string>& names);
+        std::vector<RecordResult> delete_records(const std::vector<std::string>& names);
+
+        // bulk transfer: prepare_record, open_record and open_record_chunk
+        // may be called from several threads at once, alongside one thread
+        // running insert_prepared_records or for_each_stored_record. For a
+        // chunked record, open_record gives its name and no contents; they
+        // come from open_record_chunk, one chunk at a time
+        PreparedRecord prepare_record(const std::string& n, const std::string& v) const;
+        std::pair<std::string, std::string> open_record(const StoredRecord& record) const;
+        std::string open_record_chunk(const StoredRecord& piece) const;
+        std::vector<RecordResult> insert_prepared_records(const std::vector<PreparedRecord>& records);
+        void for_each_stored_record(const std::function<void(const StoredRecord&)>& visit);
+
         void share_record(const std::string& n, const std::string& user);
 
         void change_user_password(const std::string& old, const std::string& updated);
 
         DBTable debug_prepared_query(std::string q, const ArgumentList& args);
+        using DB::statement_cache_hits;
+        using DB::statement_cache_misses;
+        size_t record_key_cache_hits() const;
 
         bool record_exists(const std::string& n);
+
+        // reseal the user's legacy ciphertexts bound to their records; from
+        // then on, in this and later sessions, any that aren't are refused
+        size_t upgrade_record_encryption();
 };
 
+/*
+* LockedDB: A connection for running transactions alongside other processes
+* that use the same database. write() takes the write lock up front with
+* BEGIN IMMEDIATE, so that concurrent writers queue rather than deadlock;
+* read() runs in a deferred transaction. If SQLite still reports the
+* database busy, the transaction is rolled back and the whole body retried
+* after a bounded, randomised backoff, so a body may run more than once and
+* must not have effects outside the database.
+* Savepoints are only created when savepoint() is called; any still open when
+* the body returns are released with it.
+*/
 class LockedDB : private DB {
-    // This class is intended to handle transactions in a multithreaded
-    // environment. It is currently in-process and should not be used at this
-    // time. The current program main.cpp currently assumes it is the only
-    // process
     private:
-        size_t transaction_number;
-        std::string savepoint_start;
+        size_t max_retries;
+        size_t retries;
+        bool active;
+        bool writing;
+        std::vector< std::unique_ptr<Transaction> > savepoints;
+
+        void run(bool writer, const std::function<void(LockedDB&)>& body);
+        void close_savepoints(size_t n, bool keep);
     public:
-        LockedDB(const char* dbname);
+        static const size_t DEFAULT_MAX_RETRIES = 8;
+
+        LockedDB(const char* dbname, size_t max_retries = DEFAULT_MAX_RETRIES,
+                 const DBOptions& options = DBOptions::balanced());
+        LockedDB(const LockedDB&) = delete;
         ~LockedDB();
 
-        DBTable prepared_query(std::string q, const ArgumentList& args);
+        void read(const std::function<void(LockedDB&)>& body);
+        void write(const std::function<void(LockedDB&)>& body);
+
+        using DB::prepared_query;
+        using DB::query_rows;
+
+        size_t savepoint();
+        void release(size_t n);
         void rollback(size_t n);
+
+        size_t busy_retries() const;
 };
 
 #endif
\ No newline at end of file
@@ -1,9 +1,16 @@
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <cassert>
+#include <fstream>
+#include <cstdlib>
+#include <thread>
+#include <stdexcept>
 #include "dbmanager.h"
 #include "cryptowrapper.h"
 #include "parsecmd.h"
+#include "batchmode.h"
+#include "metrics.h"
 
 std::string get_input_wo_newline() {
     std::string with_nl;
@@ -12,24 +19,97 @@ std::string get_input_wo_newline() {
     return result;
 }
 
+bool parse_size(const std::string& str, size_t& value) {
+    // a non-negative decimal number, and nothing else
+    if(str.empty() || str.find_first_not_of("0123456789") != std::string::npos) {
+        return false;
+    }
+    try {
+        value = std::stoull(str);
+    } catch(std::out_of_range& e) {
+        return false;
+    }
+    return true;
+}
+
+void dump_stats(const char* filename) {
+    // write the session's statistics to filename, if it isn't NULL
+    if(filename == NULL) {
+        return;
+    }
+    std::ofstream out(filename);
+    metrics::report(out);
+    if(!out) {
+        std::cerr << "Could not write statistics to '" << filename << "'\n";
+    }
+}
+
 int main(int argc, char** argv) {
+    // securedb --batch [FILE]: run JSONL requests from FILE, or from the
+    // rest of stdin, instead of the interactive prompt
+    bool batch = argc >= 2 && std::strcmp(argv[1], "--batch") == 0;
+    if((batch && argc > 3) || (!batch && argc > 1)) {
+        std::cerr << "Usage: securedb [--batch [FILE]]\n";
+        return 1;
+    }
+
+    // SECUREDB_STATS=FILE collects statistics for the whole session, sign-in
+    // included, and writes them to FILE at exit
+    const char* stats_file = std::getenv("SECUREDB_STATS");
+    metrics::set_enabled(stats_file != NULL);
+
+    // SECUREDB_SLOW_QUERY_MS=N logs every statement that takes N ms or more,
+    // with its query plan the first time, to stderr or SECUREDB_SLOW_QUERY_LOG
+    std::ofstream slow_query_file;
+    if(std::getenv("SECUREDB_SLOW_QUERY_MS") != NULL) {
+        std::ostream* slow_query_log = &std::cerr;
+        if(std::getenv("SECUREDB_SLOW_QUERY_LOG") != NULL) {
+            slow_query_file.open(std::getenv("SECUREDB_SLOW_QUERY_LOG"), std::ios::app);
+            slow_query_log = &slow_query_file;
+        }
+        DB::log_slow_queries(std::atof(std::getenv("SECUREDB_SLOW_QUERY_MS")), slow_query_log, true);
+    }
 
     // authenticate the user
-    std::cout << "Username: ";
+    // in batch mode the credentials are still the first two lines of stdin,
+    // but without prompts, which would end up mixed into the results
+    if(!batch) std::cout << "Username: ";
     std::string uname = get_input_wo_newline();
-    std::cout << "Password: ";
+    if(!batch) std::cout << "Password: ";
     std::string pwd = get_input_wo_newline();
     
     
     AuthenticatedDBUser manager;
     try {
         manager = std::move(AuthenticatedDBUser(uname, pwd));
-        std::cout << "Successfully signed in. Hello, " << uname << "!\n";
+        if(!batch) std::cout << "Successfully signed in. Hello, " << uname << "!\n";
     } catch(...) {
         std::cerr << "Failed to sign in\n";
         return 1;
     }
 
+    // decrypt long listings on every core, or on SECUREDB_THREADS threads
+    size_t threads = std::thread::hardware_concurrency();
+    if(std::getenv("SECUREDB_THREADS") != NULL) {
+        threads = std::strtoul(std::getenv("SECUREDB_THREADS"), NULL, 10);
+    }
+    manager.set_decrypt_threads(threads > 1 ? threads - 1 : 0);
+
+    if(batch) {
+        std::ifstream file;
+        if(argc == 3) {
+            file.open(argv[2]);
+            if(!file) {
+                std::cerr << "Could not open '" << argv[2] << "'\n";
+                return 1;
+            }
+        }
+        BatchStats stats = run_batch_mode(manager, (argc == 3) ? file : std::cin, std::cout);
+        std::cerr << describe_batch_stats(stats) << '\n';
+        dump_stats(stats_file);
+        return 0;
+    }
+
     bool running = true;
     while(running) {
         std::cout << "> ";
@@ -47,6 +127,8 @@ int main(int argc, char** argv) {
         std::string recordName;
         std::string recordContent;
         std::string record;
+        size_t offset = 0; // for READRANGE and PATCH
+        size_t length = 0;
 
         // these variables are used only in the DELETE case
         // defining them here to avoid errors
@@ -66,21 +148,55 @@ int main(int argc, char** argv) {
                     std::cerr << "Error reading record: " << e.what() << '\n';
                 }
                 break;
+            case READRANGE:
+                // read only LENGTH bytes of the record, starting at OFFSET
+                recordName = args[0];
+                if(!parse_size(args[1], offset) || !parse_size(args[2], length)) {
+                    std::cerr << "Error reading record: offset and length must be numbers\n";
+                    break;
+                }
+                try {
+                    record = manager.retrieve_record_range(recordName, offset, length);
+                    std::cout << "Record '" << recordName << "' [" << offset << ", " << offset + record.size()
+                              << "):\n--------\n" << record << "\n--------\n";
+                } catch(std::exception& e) {
+                    std::cerr << "Error reading record: " << e.what() << '\n';
+                }
+                break;
             case WRITE:
                 recordName = args[0];
                 recordContent = args[1];
-                // TODO differentiate between when record exists vs it doesn't
-                try { // if the record doesn't exist, create it
-                    manager.create_record(recordName, recordContent);
-                } catch(...) {
-                    try { // if the record DOES exist, create_record throws
-                        // an exception. Catch the exception and edit the
-                        // already existing record instead
+                try { // create the record, or replace it if it exists
+                    if(manager.record_exists(recordName)) {
                         manager.edit_record(recordName, recordContent);
-                        std::cout << "Record '" << recordName << "' written\n";
-                    } catch(std::exception& e) {
-                        std::cerr << "Error writing record: " << e.what() << '\n';
+                    } else {
+                        manager.create_record(recordName, recordContent);
                     }
+                    std::cout << "Record '" << recordName << "' written\n";
+                } catch(std::exception& e) {
+                    std::cerr << "Error writing record: " << e.what() << '\n';
+                }
+                break;
+            case APPEND:
+                recordName = args[0];
+                try {
+                    manager.append_record(recordName, args[1]);
+                    std::cout << "Record '" << recordName << "' written\n";
+                } catch(std::exception& e) {
+                    std::cerr << "Error writing record: " << e.what() << '\n';
+                }
+                break;
+            case PATCH:
+                recordName = args[0];
+                if(!parse_size(args[1], offset)) {
+                    std::cerr << "Error writing record: offset must be a number\n";
+                    break;
+                }
+                try {
+                    manager.patch_record(recordName, offset, args[2]);
+                    std::cout << "Record '" << recordName << "' written\n";
+                } catch(std::exception& e) {
+                    std::cerr << "Error writing record: " << e.what() << '\n';
                 }
                 break;
             case DELETE:
@@ -114,14 +230,65 @@ int main(int argc, char** argv) {
                 break;
             case RECORDLIST:
                 try {
-                    std::vector<std::string> names = manager.get_record_names();
-                    for(size_t i = 0; i < names.size(); i++) {
-                        std::cout << names[i] << '\n';
-                    }
+                    // print names as they are decrypted rather than
+                    // collecting every name first
+                    manager.for_each_record_name([](const std::string& name) {
+                        std::cout << name << '\n';
+                    });
                 } catch(std::exception& e) {
                     std::cerr << "Error on retrieving record names: " << e.what() << '\n';
                 }
                 break;
+            case MREAD:
+                // read every named record in a single transaction
+                try {
+                    std::vector<RecordResult> results = manager.retrieve_records(args);
+                    for(size_t i = 0; i < results.size(); i++) {
+                        if(results[i].ok) {
+                            std::cout << "Record '" << args[i] << "':\n--------\n" << results[i].value << "\n--------\n";
+                        } else {
+                            std::cerr << "Error reading record '" << args[i] << "': " << results[i].error << '\n';
+                        }
+                    }
+                } catch(std::exception& e) {
+                    std::cerr << "Error reading records: " << e.what() << '\n';
+                }
+                break;
+            case MWRITE:
+                // write every name/content pair in a single transaction
+                try {
+                    RecordList records;
+                    for(size_t i = 0; i + 1 < args.size(); i += 2) {
+                        records.push_back(std::make_pair(args[i], args[i + 1]));
+                    }
+                    std::vector<RecordResult> results = manager.write_records(records);
+                    for(size_t i = 0; i < results.size(); i++) {
+                        if(results[i].ok) {
+                            std::cout << "Record '" << records[i].first << "' written\n";
+                        } else {
+                            std::cerr << "Error writing record '" << records[i].first << "': " << results[i].error << '\n';
+                        }
+                    }
+                } catch(std::exception& e) {
+                    std::cerr << "Error writing records: " << e.what() << '\n';
+                }
+                break;
+            case STATS:
+                // print what has been collected, or turn collection on or
+                // off, or clear it
+                if(args.empty()) {
+                    if(!metrics::enabled()) {
+                        std::cout << "Statistics are off; 'stats on' starts collecting them\n";
+                    }
+                    metrics::report(std::cout);
+                } else if(args.size() == 1 && (args[0] == "on" || args[0] == "off")) {
+                    metrics::set_enabled(args[0] == "on");
+                } else if(args.size() == 1 && args[0] == "reset") {
+                    metrics::reset();
+                } else {
+                    std::cerr << "Error: usage is 'stats [on|off|reset]'\n";
+                }
+                break;
             case SHARE:
                 std::cout << "Sorry! This functionality has not yet been implemented.\n";
                 break;
@@ -134,5 +301,6 @@ int main(int argc, char** argv) {
         }
     
     }
+    dump_stats(stats_file);
     return 0;
 }
\ No newline at end of file
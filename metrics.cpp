@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <iomanip>
+#include "metrics.h"
+
+namespace {
+    struct HistogramData {
+        std::atomic<std::uint64_t> buckets[metrics::_impl_details::BUCKETS];
+        std::atomic<std::uint64_t> total_ns;
+        std::atomic<std::uint64_t> max_ns;
+    };
+
+    // static storage, so every count starts at zero
+    HistogramData histograms[metrics::HISTOGRAM_COUNT];
+
+    const char* const HISTOGRAM_NAMES[metrics::HISTOGRAM_COUNT] = {
+        "sql query",
+        "crypto hash", "crypto encrypt", "crypto decrypt", "crypto keygen",
+        "sign in", "create", "retrieve", "retrieve range", "edit", "append", "patch",
+        "delete", "list", "exists", "batch create", "batch write", "batch retrieve",
+        "batch delete", "prepare record", "open record", "insert prepared", "read stored", "upgrade encryption",
+    };
+
+    const char* const COUNTER_NAMES[metrics::COUNTER_COUNT] = {
+        "sql rows returned",
+        "sql full scan steps",
+        "crypto bytes hashed", "crypto bytes encrypted", "crypto bytes decrypted",
+    };
+}
+
+std::atomic<bool> metrics::_impl_details::collecting(false);
+std::atomic<std::uint64_t> metrics::_impl_details::counters[metrics::COUNTER_COUNT];
+
+size_t metrics::_impl_details::bucket_of(std::uint64_t ns) {
+    /*
+    * Values below SUB_BUCKETS get a bucket each. Above that, a value's
+    * highest set bit picks its power of two, and the two bits after it pick
+    * the quarter of that range it falls in.
+    */
+    if(ns < SUB_BUCKETS) {
+        return ns;
+    }
+    size_t msb = 63 - __builtin_clzll(ns);
+    size_t quarter = (ns >> (msb - 2)) & (SUB_BUCKETS - 1);
+    return (msb - 1) * SUB_BUCKETS + quarter;
+}
+
+std::uint64_t metrics::_impl_details::bucket_floor(size_t bucket) {
+    // the smallest value that falls in bucket
+    if(bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    size_t msb = bucket / SUB_BUCKETS + 1;
+    return static_cast<std::uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS) << (msb - 2);
+}
+
+void metrics::_impl_details::record(Histogram which, std::uint64_t ns) {
+    HistogramData& data = histograms[which];
+    data.buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+    data.total_ns.fetch_add(ns, std::memory_order_relaxed);
+    std::uint64_t seen = data.max_ns.load(std::memory_order_relaxed);
+    while(ns > seen && !data.max_ns.compare_exchange_weak(seen, ns, std::memory_order_relaxed)) {
+    }
+}
+
+void metrics::set_enabled(bool on) {
+    _impl_details::collecting.store(on, std::memory_order_relaxed);
+}
+
+void metrics::reset() {
+    for(size_t h = 0; h < HISTOGRAM_COUNT; h++) {
+        for(size_t b = 0; b < _impl_details::BUCKETS; b++) {
+            histograms[h].buckets[b].store(0, std::memory_order_relaxed);
+        }
+        histograms[h].total_ns.store(0, std::memory_order_relaxed);
+        histograms[h].max_ns.store(0, std::memory_order_relaxed);
+    }
+    for(size_t c = 0; c < COUNTER_COUNT; c++) {
+        _impl_details::counters[c].store(0, std::memory_order_relaxed);
+    }
+}
+
+metrics::Summary metrics::summarize(Histogram which) {
+    /*
+    * Read a histogram's percentiles. Each is the upper end of the bucket the
+    * percentile falls in, capped at the largest time actually recorded.
+    * Times recorded while this runs may or may not be counted.
+    */
+    const HistogramData& data = histograms[which];
+    std::uint64_t counts[_impl_details::BUCKETS];
+    std::uint64_t count = 0;
+    for(size_t b = 0; b < _impl_details::BUCKETS; b++) {
+        counts[b] = data.buckets[b].load(std::memory_order_relaxed);
+        count += counts[b];
+    }
+    std::uint64_t max = data.max_ns.load(std::memory_order_relaxed);
+
+    Summary summary;
+    summary.count = count;
+    summary.total = data.total_ns.load(std::memory_order_relaxed) / 1000.0;
+    summary.max = max / 1000.0;
+    double* targets[] = {&summary.p50, &summary.p90, &summary.p99};
+    const double ranks[] = {0.50, 0.90, 0.99};
+    for(size_t t = 0; t < 3; t++) {
+        *targets[t] = 0;
+        std::uint64_t rank = static_cast<std::uint64_t>(ranks[t] * count + 0.999999);
+        std::uint64_t seen = 0;
+        for(size_t b = 0; b < _impl_details::BUCKETS && count > 0; b++) {
+            seen += counts[b];
+            if(seen >= rank) {
+                std::uint64_t top = (b + 1 < _impl_details::BUCKETS) ? _impl_details::bucket_floor(b + 1) - 1 : max;
+                *targets[t] = std::min(top, max) / 1000.0;
+                break;
+            }
+        }
+    }
+    return summary;
+}
+
+std::uint64_t metrics::counter(Counter which) {
+    return _impl_details::counters[which].load(std::memory_order_relaxed);
+}
+
+std::string metrics::name(Histogram which) {
+    return HISTOGRAM_NAMES[which];
+}
+
+std::string metrics::name(Counter which) {
+    return COUNTER_NAMES[which];
+}
+
+void metrics::report(std::ostream& out) {
+    std::ios_base::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::left << std::setw(22) << "operation" << std::right << std::setw(10) << "count"
+        << std::setw(12) << "total ms" << std::setw(10) << "mean us" << std::setw(10) << "p50 us"
+        << std::setw(10) << "p90 us" << std::setw(10) << "p99 us" << std::setw(10) << "max us" << '\n';
+    out << std::fixed;
+    for(size_t h = 0; h < HISTOGRAM_COUNT; h++) {
+        Summary summary = summarize(static_cast<Histogram>(h));
+        if(summary.count == 0) {
+            continue;
+        }
+        out << std::left << std::setw(22) << HISTOGRAM_NAMES[h] << std::right << std::setw(10) << summary.count
+            << std::setprecision(2) << std::setw(12) << summary.total / 1000
+            << std::setprecision(1) << std::setw(10) << summary.total / summary.count
+            << std::setw(10) << summary.p50 << std::setw(10) << summary.p90 << std::setw(10) << summary.p99
+            << std::setw(10) << summary.max << '\n';
+    }
+    for(size_t c = 0; c < COUNTER_COUNT; c++) {
+        out << std::left << std::setw(22) << COUNTER_NAMES[c] << std::right << std::setw(10)
+            << _impl_details::counters[c].load(std::memory_order_relaxed) << '\n';
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
@@ -0,0 +1,137 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+#ifndef __METRICS_H
+#define __METRICS_H
+
+/*
+* metrics: Counters and latency histograms for a session: time spent in SQL
+* and in crypto, and in each of AuthenticatedDBUser's operations, plus rows
+* and bytes processed. Collection is off until enabled; while it is off, a
+* Timer or add costs one relaxed atomic load and a branch, and reads no
+* clock. Everything may be updated from several threads at once.
+*/
+namespace metrics {
+    typedef enum {
+        SQL_QUERY,
+        CRYPTO_HASH, CRYPTO_ENCRYPT, CRYPTO_DECRYPT, CRYPTO_KEYGEN,
+        USER_SIGN_IN, USER_CREATE, USER_RETRIEVE, USER_RETRIEVE_RANGE, USER_EDIT, USER_APPEND, USER_PATCH,
+        USER_DELETE, USER_LIST, USER_EXISTS, USER_BATCH_CREATE, USER_BATCH_WRITE, USER_BATCH_RETRIEVE,
+        USER_BATCH_DELETE, USER_PREPARE, USER_OPEN, USER_INSERT_PREPARED, USER_READ_STORED, USER_UPGRADE,
+        HISTOGRAM_COUNT
+    } Histogram;
+
+    typedef enum {
+        SQL_ROWS_RETURNED,
+        SQL_FULL_SCAN_STEPS, // rows stepped through by full table scans
+        CRYPTO_BYTES_HASHED, CRYPTO_BYTES_ENCRYPTED, CRYPTO_BYTES_DECRYPTED,
+        COUNTER_COUNT
+    } Counter;
+
+    namespace _impl_details {
+        extern std::atomic<bool> collecting;
+
+        // Latencies in nanoseconds, in buckets a quarter of a power of two
+        // wide, so any percentile is read to within 25% of the true value
+        // whatever the scale, for a fixed 2 KiB per histogram.
+        const size_t SUB_BUCKETS = 4;
+        const size_t BUCKETS = 64 * SUB_BUCKETS;
+        size_t bucket_of(std::uint64_t ns);
+        std::uint64_t bucket_floor(size_t bucket);
+
+        extern std::atomic<std::uint64_t> counters[COUNTER_COUNT];
+        void record(Histogram which, std::uint64_t ns);
+    }
+
+    inline bool enabled() {
+        return _impl_details::collecting.load(std::memory_order_relaxed);
+    }
+    void set_enabled(bool on);
+    void reset();
+
+    inline void add(Counter which, std::uint64_t amount) {
+        if(enabled()) {
+            _impl_details::counters[which].fetch_add(amount, std::memory_order_relaxed);
+        }
+    }
+
+    // What one histogram has recorded so far. Times are in microseconds.
+    struct Summary {
+        std::uint64_t count;
+        double total;
+        double p50;
+        double p90;
+        double p99;
+        double max;
+    };
+    Summary summarize(Histogram which);
+    std::uint64_t counter(Counter which);
+    std::string name(Histogram which);
+    std::string name(Counter which);
+
+    // A table of every histogram that has recorded anything, then every
+    // counter
+    void report(std::ostream& out);
+
+    /*
+    * Timer: Records the time from its construction to its destruction in a
+    * histogram, if collection was enabled when it was constructed, less any
+    * time between pause and resume (e.g. spent in a caller's callback).
+    * Optionally adds amount to a counter as well.
+    */
+    class Timer {
+        private:
+            Histogram which;
+            bool active;
+            std::chrono::steady_clock::time_point start;
+            std::chrono::steady_clock::time_point paused_at;
+            std::chrono::steady_clock::duration excluded;
+        public:
+            explicit Timer(Histogram which);
+            Timer(Histogram which, Counter counter, std::uint64_t amount);
+            Timer(const Timer&) = delete;
+            ~Timer();
+
+            void pause();
+            void resume();
+    };
+
+    // Timer is defined here so that, with collection off, it compiles down
+    // to the check in its constructor
+    inline Timer::Timer(Histogram which) : which(which), active(enabled()) {
+        if(active) {
+            excluded = std::chrono::steady_clock::duration::zero();
+            start = std::chrono::steady_clock::now();
+        }
+    }
+
+    inline Timer::Timer(Histogram which, Counter counter, std::uint64_t amount) : Timer(which) {
+        if(active) {
+            _impl_details::counters[counter].fetch_add(amount, std::memory_order_relaxed);
+        }
+    }
+
+    inline Timer::~Timer() {
+        if(active) {
+            std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - start - excluded;
+            _impl_details::record(which, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+    }
+
+    inline void Timer::pause() {
+        if(active) {
+            paused_at = std::chrono::steady_clock::now();
+        }
+    }
+
+    inline void Timer::resume() {
+        if(active) {
+            excluded += std::chrono::steady_clock::now() - paused_at;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,56 @@
+#include <iostream>
+#include <string>
+#include <cstring>
+#include "dbmanager.h"
+#include "schema.h"
+
+int main(int argc, const char* argv[]) {
+    // migratedb [--codec CODEC] [database]: also sets the codec that new
+    // record contents are compressed with, if one is given
+    std::string dbname = "records.db";
+    std::string codec_name;
+    bool named = false;
+    for(int i = 1; i < argc; i++) {
+        if(std::strcmp(argv[i], "--codec") == 0 && i + 1 < argc && codec_name.empty()) {
+            codec_name = argv[++i];
+        } else if(!named && argv[i][0] != '-') {
+            dbname = argv[i];
+            named = true;
+        } else {
+            std::cerr << "Usage: migratedb [--codec none|lz] [database]\n";
+            return 1;
+        }
+    }
+
+    DB db;
+    try {
+        db = DB(dbname.c_str());
+    } catch(std::exception& e) {
+        std::cerr << "Could not open database: " << e.what() << '\n';
+        return 1;
+    }
+    std::cout << "Database settings: " << db.effective_options().describe() << '\n';
+    if(schema_version(db) >= SCHEMA_VERSION) {
+        std::cout << "'" << dbname << "' is already at the current schema version\n";
+    } else {
+        std::cout << "Upgrading '" << dbname << "' to schema version " << SCHEMA_VERSION << "...\n";
+        try {
+            upgrade_schema(db);
+        } catch(std::exception& e) {
+            std::cerr << "Could not convert database: " << e.what() << '\n';
+            return 1;
+        }
+        db.prepared_query("VACUUM", ArgumentList({}));
+        std::cout << "Done!\n";
+    }
+    if(!codec_name.empty()) {
+        try {
+            db.set_record_codec(compression::codec_from_name(codec_name));
+        } catch(std::exception& e) {
+            std::cerr << "Could not set codec: " << e.what() << '\n';
+            return 1;
+        }
+    }
+    std::cout << "New records are compressed with: " << compression::codec_name(db.record_codec()) << '\n';
+    return 0;
+}
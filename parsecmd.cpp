@@ -2,6 +2,8 @@
 #include <vector>
 #include <iomanip>
 #include <iostream>
+#include <stdexcept>
+#include <cassert>
 #include "parsecmd.h"
 
 std::string commandTypeToString(CommandType type) {
@@ -20,6 +22,18 @@ std::string commandTypeToString(CommandType type) {
             return "help";
         case QUIT:
             return "quit";
+        case MREAD:
+            return "mread";
+        case MWRITE:
+            return "mwrite";
+        case READRANGE:
+            return "readrange";
+        case APPEND:
+            return "append";
+        case PATCH:
+            return "patch";
+        case STATS:
+            return "stats";
         default:
             assert(false); // should never get here
     }
@@ -31,6 +45,10 @@ Command::Command(const std::string& cmd) {
 
     int expectedArgs = 0;
     int seenArgs = 0;
+    // variadic commands take expectedArgs or more arguments, in groups of
+    // argGroup (e.g. name/content pairs)
+    bool variadic = false;
+    int argGroup = 1;
 
     bool foundType = false;
     while(parser >> std::quoted(token)) {
@@ -38,9 +56,18 @@ Command::Command(const std::string& cmd) {
             if(token == "read") {
                 type = READ;
                 expectedArgs = 1;
+            } else if(token == "readrange") {
+                type = READRANGE;
+                expectedArgs = 3;
             } else if(token == "write") {
                 type = WRITE;
                 expectedArgs = 2;
+            } else if(token == "append") {
+                type = APPEND;
+                expectedArgs = 2;
+            } else if(token == "patch") {
+                type = PATCH;
+                expectedArgs = 3;
             } else if(token == "delete") {
                 type = DELETE;
                 expectedArgs = 1;
@@ -56,6 +83,20 @@ Command::Command(const std::string& cmd) {
             } else if(token == "quit") {
                 type = QUIT;
                 expectedArgs = 0;
+            } else if(token == "stats") {
+                // stats [on|off|reset]
+                type = STATS;
+                expectedArgs = 0;
+                variadic = true;
+            } else if(token == "mread") {
+                type = MREAD;
+                expectedArgs = 1;
+                variadic = true;
+            } else if(token == "mwrite") {
+                type = MWRITE;
+                expectedArgs = 2;
+                variadic = true;
+                argGroup = 2;
             } else {
                 std::string e = "invalid command '";
                 e += token + "'";
@@ -64,7 +105,7 @@ Command::Command(const std::string& cmd) {
             foundType = true;
         } else {
             seenArgs += 1;
-            if(seenArgs > expectedArgs) {
+            if(seenArgs > expectedArgs && !variadic) {
                 std::string e = "too many arguments for command '";
                 e += commandTypeToString(type) + "'";
                 throw std::runtime_error(e);
@@ -72,7 +113,7 @@ Command::Command(const std::string& cmd) {
             args.push_back(token);
         }
     }
-    if(seenArgs < expectedArgs) {
+    if(seenArgs < expectedArgs || seenArgs % argGroup != 0) {
         std::string e = "too few arguments for command '";
         e += commandTypeToString(type) + "'";
         throw std::runtime_error(e);
@@ -3,7 +3,7 @@
 #ifndef __PARSECMD_H
 #define __PARSECMD_H
 
-typedef enum { READ, WRITE, DELETE, SHARE, RECORDLIST, HELP, QUIT } CommandType;
+typedef enum { READ, WRITE, DELETE, SHARE, RECORDLIST, HELP, QUIT, MREAD, MWRITE, READRANGE, APPEND, PATCH, STATS } CommandType;
 typedef std::vector<std::string> CommandArgs;
 
 class Command {
@@ -1,5 +1,6 @@
 #include <iostream>
 #include "dbmanager.h"
+#include "schema.h"
 
 void resetDatabase();
 void resetUser1();
@@ -16,10 +17,11 @@ int main() {
 
 void resetDatabase() {
     DB db("runtests.db");
-    db.prepared_query("drop table Keys", ArgumentList({}));
-    db.prepared_query("drop table Records", ArgumentList({}));
-    db.prepared_query("create table Keys(user varchar(256), record_name varchar(512), key varchar(2048));", ArgumentList({}));
-    db.prepared_query("create table Records(id int primary key, owner int not null, name varchar(512), record varchar(4096), foreign key(owner) references Users(id))", ArgumentList({}));
+    db.prepared_query("drop table if exists Keys", ArgumentList({}));
+    db.prepared_query("drop table if exists Records", ArgumentList({}));
+    db.prepared_query("drop table if exists RecordChunks", ArgumentList({}));
+    // the users stay; everything else is recreated at the current version
+    upgrade_schema(db);
     std::cout << "Successfully reset database\n";
 }
 
@@ -0,0 +1,170 @@
+#include <cstdlib>
+#include "schema.h"
+
+// Keys is looked up by (user, record_identifier) to fetch a record's key, so
+// the index carries key as well and those lookups never touch the table.
+// Records is only ever looked up by (owner, name); its contents are too big
+// to be worth copying into an index.
+static const struct {
+    const char* name;
+    const char* on;
+} INDEXES[] = {
+    {"users_login", "Users(username, password)"},
+    {"keys_user_identifier", "Keys(user, record_identifier, key)"},
+    {"records_owner_name", "Records(owner, name)"},
+};
+
+// bound_ciphers is set once none of the user's ciphertexts are legacy ones;
+// see AuthenticatedDBUser::upgrade_record_encryption
+static const char* const USERS_TABLE = "(id INTEGER PRIMARY KEY, username TEXT NOT NULL, password TEXT NOT NULL,"
+                                       " bound_ciphers INTEGER NOT NULL DEFAULT 0)";
+static const char* const KEYS_TABLE = "(id INTEGER PRIMARY KEY, user BLOB NOT NULL, record_name BLOB,"
+                                      " record_identifier BLOB NOT NULL, key BLOB)";
+static const char* const RECORDS_TABLE = "(id INTEGER PRIMARY KEY, owner BLOB NOT NULL, name BLOB NOT NULL,"
+                                         " record BLOB)";
+// a chunk is up to RECORD_CHUNK_SIZE bytes, far too big for a WITHOUT ROWID
+// table, which keeps whole rows in its b-tree
+static const char* const RECORD_CHUNKS_TABLE = "(owner BLOB, name BLOB, seq INTEGER, chunk BLOB,"
+                                               " PRIMARY KEY(owner, name, seq))";
+static const char* const SETTINGS_TABLE = "(name TEXT PRIMARY KEY, value TEXT) WITHOUT ROWID";
+
+int schema_version(DB& database) {
+    DBTable version = database.prepared_query("PRAGMA user_version", ArgumentList({}));
+    return (version.size() == 1) ? std::atoi(version[0][0].c_str()) : 0;
+}
+
+static bool table_exists(DB& database, const std::string& table) {
+    DBTable check = database.prepared_query("SELECT COUNT(*) FROM sqlite_master WHERE type='table' AND name=?",
+                                            ArgumentList({table}));
+    return check.size() == 1 && check[0][0] != "0";
+}
+
+static void create_indexes(DB& database) {
+    for(size_t i = 0; i < sizeof(INDEXES) / sizeof(INDEXES[0]); i++) {
+        database.prepared_query(std::string("CREATE INDEX IF NOT EXISTS ") + INDEXES[i].name + " ON " + INDEXES[i].on,
+                                ArgumentList({}));
+    }
+}
+
+static bool indexes_exist(DB& database) {
+    for(size_t i = 0; i < sizeof(INDEXES) / sizeof(INDEXES[0]); i++) {
+        DBTable check = database.prepared_query("SELECT COUNT(*) FROM sqlite_master WHERE type='index' AND name=?",
+                                                ArgumentList({INDEXES[i].name}));
+        if(check.size() != 1 || check[0][0] == "0") {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void set_schema_version(DB& database, int version) {
+    database.prepared_query("PRAGMA user_version = " + std::to_string(version), ArgumentList({}));
+}
+
+static void rebuild_table(DB& database, const std::string& table, const std::string& definition,
+                          const std::string& columns, const std::string& values) {
+    /*
+    * Replace table with one created from definition, copying every row
+    * across (values, selected from the old table, go into columns of the new
+    * one). SQLite can't change a table's columns or keys in place. The
+    * table's indexes go with the old table.
+    */
+    database.prepared_query("CREATE TABLE " + table + "_rebuilt" + definition, ArgumentList({}));
+    database.prepared_query("INSERT INTO " + table + "_rebuilt (" + columns + ") SELECT " + values + " FROM " + table,
+                            ArgumentList({}));
+    database.prepared_query("DROP TABLE " + table, ArgumentList({}));
+    database.prepared_query("ALTER TABLE " + table + "_rebuilt RENAME TO " + table, ArgumentList({}));
+}
+
+void create_schema(DB& database) {
+    Transaction creation(database, true);
+    database.prepared_query(std::string("CREATE TABLE IF NOT EXISTS Users") + USERS_TABLE, ArgumentList({}));
+    database.prepared_query(std::string("CREATE TABLE IF NOT EXISTS Keys") + KEYS_TABLE, ArgumentList({}));
+    database.prepared_query(std::string("CREATE TABLE IF NOT EXISTS Records") + RECORDS_TABLE, ArgumentList({}));
+    database.prepared_query(std::string("CREATE TABLE IF NOT EXISTS RecordChunks") + RECORD_CHUNKS_TABLE,
+                            ArgumentList({}));
+    database.prepared_query(std::string("CREATE TABLE IF NOT EXISTS Settings") + SETTINGS_TABLE, ArgumentList({}));
+    create_indexes(database);
+    set_schema_version(database, SCHEMA_VERSION);
+    creation.commit();
+}
+
+static void migrate_to_indexed_layout(DB& database) {
+    /*
+    * Version 3. Keys and Records used to be created with `id int primary
+    * key`, which isn't an alias for the rowid and was never filled in, so
+    * the rowids are carried over as the new ids and rows keep their order.
+    */
+    Transaction migration(database, true);
+    // another connection may have upgraded the database while this one
+    // waited for the write lock
+    if(schema_version(database) != AUTHENTICATED_STORAGE) {
+        migration.commit();
+        return;
+    }
+    rebuild_table(database, "Keys", KEYS_TABLE, "id, user, record_name, record_identifier, key",
+                  "rowid, user, record_name, record_identifier, key");
+    rebuild_table(database, "Records", RECORDS_TABLE, "id, owner, name, record", "rowid, owner, name, record");
+    database.prepared_query(std::string("CREATE TABLE IF NOT EXISTS RecordChunks") + RECORD_CHUNKS_TABLE,
+                            ArgumentList({}));
+    if(table_exists(database, "Settings")) {
+        rebuild_table(database, "Settings", SETTINGS_TABLE, "name, value", "name, value");
+    } else {
+        database.prepared_query(std::string("CREATE TABLE Settings") + SETTINGS_TABLE, ArgumentList({}));
+    }
+    create_indexes(database);
+    set_schema_version(database, 3);
+    migration.commit();
+}
+
+static void migrate_to_bound_users(DB& database) {
+    /*
+    * Version 4. Users gains bound_ciphers, which starts out clear for every
+    * user, since only a signed-in user can tell whether any of their
+    * ciphertexts are legacy ones.
+    */
+    Transaction migration(database, true);
+    if(schema_version(database) != 3) {
+        migration.commit();
+        return;
+    }
+    rebuild_table(database, "Users", USERS_TABLE, "id, username, password", "rowid, username, password");
+    create_indexes(database);
+    set_schema_version(database, 4);
+    migration.commit();
+}
+
+void upgrade_schema(DB& database) {
+    if(!table_exists(database, "Keys")) {
+        create_schema(database);
+        return;
+    }
+    upgrade_storage_format(database);
+    if(schema_version(database) == AUTHENTICATED_STORAGE) {
+        migrate_to_indexed_layout(database);
+    }
+    if(schema_version(database) == 3) {
+        migrate_to_bound_users(database);
+    }
+}
+
+bool schema_needs_upgrade(DB& database) {
+    // whether open_schema has anything to write
+    int version = schema_version(database);
+    if(version >= SCHEMA_VERSION) {
+        return false;
+    }
+    return version >= AUTHENTICATED_STORAGE || !indexes_exist(database);
+}
+
+void open_schema(DB& database) {
+    int version = schema_version(database);
+    if(version >= SCHEMA_VERSION) {
+        return;
+    }
+    if(version >= AUTHENTICATED_STORAGE) {
+        upgrade_schema(database);
+    } else {
+        create_indexes(database);
+    }
+}
@@ -0,0 +1,45 @@
+#include <string>
+#include "dbmanager.h"
+
+#ifndef __SCHEMA_H
+#define __SCHEMA_H
+
+/*
+* schema: Creates a database's tables and indexes and upgrades older
+* databases to them. The version a database is at is kept in its
+* user_version. Versions 0 to 2 are the storage formats (see StorageFormat);
+* every later version is stored in AUTHENTICATED_STORAGE and changes only
+* tables and indexes.
+*
+* Version 3 gives Keys and Records INTEGER PRIMARY KEYs, so the key is the
+* rowid rather than a separate column, and adds the indexes that sign-in,
+* record lookups and record key lookups are served by. Settings is a
+* WITHOUT ROWID table.
+*
+* Version 4 adds Users.bound_ciphers, set for users none of whose
+* ciphertexts are legacy ones.
+*/
+const int SCHEMA_VERSION = 4;
+
+int schema_version(DB& database);
+
+// Create every table and index in an empty database, at SCHEMA_VERSION.
+// Tables that already exist are left as they are.
+void create_schema(DB& database);
+
+// Bring a database at any version up to SCHEMA_VERSION, converting its
+// storage format first if it needs it, or create it if it has no tables.
+// Each step runs in its own transaction, so an interrupted upgrade resumes
+// from the last finished step. Does nothing to a current database.
+void upgrade_schema(DB& database);
+
+// Run whenever a user signs in: upgrades the tables and indexes of a
+// database in AUTHENTICATED_STORAGE, which is cheap next to converting the
+// storage format. Older databases only get their indexes, and are
+// converted with migratedb.
+void open_schema(DB& database);
+// Whether open_schema would change anything, read without writing, so that
+// a sign-in only takes the write lock when it has to
+bool schema_needs_upgrade(DB& database);
+
+#endif
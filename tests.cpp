@@ -1,6 +1,20 @@
 #include <iostream>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sstream>
 #include "dbmanager.h"
 #include "cryptowrapper.h"
+#include "cryptopp890/aes.h"
+#include "batchmode.h"
+#include "bulktransfer.h"
+#include "threadpool.h"
+#include "compression.h"
+#include "schema.h"
+#include "metrics.h"
 
 // two users: test1, password test1pwd; test2, password test2pwd
 
@@ -23,6 +37,44 @@ int testInvalidRecordDeletion(AuthenticatedDBUser& user, std::string name);
 
 int testValidRecordListing(AuthenticatedDBUser& user, std::vector<std::string> expectedList);
 
+int testRecordExistsMatchesScan(AuthenticatedDBUser& user, std::vector<std::string> names);
+
+int testStatementCacheReuse(AuthenticatedDBUser& user, std::string name);
+
+int testStreamedRecordListing(AuthenticatedDBUser& user, std::vector<std::string> expectedList);
+
+int testBinaryStorageMigration();
+int testAuthenticatedStorageMigration();
+int testSchemaUpgrade();
+
+int testTypedArgumentBinding();
+int testNestedTransactions();
+int testConcurrentWriters();
+int testDatabaseOptions();
+int testSlowQueryLog();
+
+int testBatchDecryption();
+
+int testRecordKeyCache(AuthenticatedDBUser& user, std::string name);
+
+int testRecordEncryptionUpgrade(AuthenticatedDBUser& user, const std::string& u, const std::string& p,
+                                std::string name, std::string expectedContent);
+int testRecordBinding(AuthenticatedDBUser& user);
+int testTamperedRecordReading(AuthenticatedDBUser& user, std::string name);
+
+int testBatchOperations(AuthenticatedDBUser& user);
+int testBatchMode(AuthenticatedDBUser& user);
+int testBulkTransfer(AuthenticatedDBUser& user);
+int testParallelDecryption(AuthenticatedDBUser& user);
+
+int testPooledUsers(const std::string& u, const std::string& p);
+int testChunkedRecords(AuthenticatedDBUser& user);
+int testRecordRanges(AuthenticatedDBUser& user);
+int testRecordAppendPatch(AuthenticatedDBUser& user);
+int testCompressionCodec();
+int testCompressedRecords(const std::string& u, const std::string& p);
+int testStatistics(AuthenticatedDBUser& user);
+
 
 void resetDatabase();
 void resetUser1();
@@ -37,6 +89,20 @@ int main() {
     std::cout << "Finished resetting tests.\n";
     std::cout << "---------------------------------------------------\n\n";
 
+    // the reset users' records were written in hex format; every test after
+    // this point runs against the migrated binary database
+    std::cout << "Migrating test database to binary storage\n";
+    if(testBinaryStorageMigration() == 1) return 1;
+    if(testAuthenticatedStorageMigration() == 1) return 1;
+    if(testSchemaUpgrade() == 1) return 1;
+    if(testTypedArgumentBinding() == 1) return 1;
+    if(testNestedTransactions() == 1) return 1;
+    if(testConcurrentWriters() == 1) return 1;
+    if(testDatabaseOptions() == 1) return 1;
+    if(testSlowQueryLog() == 1) return 1;
+    if(testBatchDecryption() == 1) return 1;
+    if(testCompressionCodec() == 1) return 1;
+
     std::cout << "Running first tests: logins\n";
     // confirm unsuccessful logins as invalid user w/ junk password
     if(testInvalidAuthentication("nonexistent", "pwd", 1) == 1) return 1;
@@ -79,6 +145,9 @@ int main() {
     if(testValidRecordListing(alice, std::vector<std::string>({"permanent1"})) == 1) return 1;
     if(testValidRecordListing(bob, std::vector<std::string>({"permanent2"})) == 1) return 1;
 
+    // confirm repeated reads reuse compiled statements
+    if(testStatementCacheReuse(alice, "permanent1") == 1) return 1;
+
     std::cout << "Functionality test 2: record creation\n";
     // confirm successful creation of new records X, Y as users A and B respectively
     // confirm new records are accurately paired to their owners
@@ -95,6 +164,13 @@ int main() {
     if(testValidRecordCreation(bob, "A1") == 1) return 1;
     if(testValidRecordListing(alice, std::vector<std::string>({"permanent1", "A1", "A2"})) == 1) return 1;
     if(testValidRecordListing(bob, std::vector<std::string>({"permanent2", "A2", "A1"})) == 1) return 1;
+
+    // confirm the identifier lookup used for ownership checks agrees with a
+    // full decrypt-every-name scan of the user's records
+    std::vector<std::string> probes({"permanent1", "permanent2", "A1", "A2", "nonexistent", ""});
+    if(testRecordExistsMatchesScan(alice, probes) == 1) return 1;
+    if(testRecordExistsMatchesScan(bob, probes) == 1) return 1;
+    if(testStreamedRecordListing(alice, std::vector<std::string>({"permanent1", "A1", "A2"})) == 1) return 1;
     
     std::cout << "Functionality test 3: record editing\n";
     // confirm successful edits of records X, Y as users A and B
@@ -118,9 +194,53 @@ int main() {
     if(testValidRecordDeletion(bob, "A1") == 1) return 1;
     if(testValidRecordDeletion(alice, "A1") == 1) return 1;
     if(testValidRecordDeletion(bob, "A2") == 1) return 1;
+    if(testRecordKeyCache(alice, "cached") == 1) return 1;
 
     if(testValidRecordListing(alice, std::vector<std::string>({"permanent1"})) == 1) return 1;
     if(testValidRecordListing(bob, std::vector<std::string>({"permanent2"})) == 1) return 1;
+    if(testRecordExistsMatchesScan(alice, probes) == 1) return 1;
+    if(testRecordExistsMatchesScan(bob, probes) == 1) return 1;
+
+    std::cout << "Functionality test 5: authenticated encryption\n";
+    // confirm legacy AES-CBC records are upgraded to AES-GCM exactly once
+    // confirm a modified ciphertext is rejected rather than decrypted, as is
+    // one moved from another record or left over from before the upgrade
+    if(testRecordEncryptionUpgrade(alice, "test1", "test1pwd", "permanent1", "permanent1") == 1) return 1;
+    if(testRecordEncryptionUpgrade(bob, "test2", "test2pwd", "permanent2", "permanent2") == 1) return 1;
+    if(testTamperedRecordReading(alice, "permanent1") == 1) return 1;
+    if(testRecordBinding(alice) == 1) return 1;
+
+    std::cout << "Functionality test 6: batch operations\n";
+    // confirm batches report per-item results, and that a failed item
+    // neither stops the batch nor leaves partial changes behind
+    if(testBatchOperations(alice) == 1) return 1;
+    if(testBatchMode(alice) == 1) return 1;
+    if(testBulkTransfer(alice) == 1) return 1;
+    if(testParallelDecryption(alice) == 1) return 1;
+    if(testValidRecordListing(alice, std::vector<std::string>({"permanent1"})) == 1) return 1;
+
+    std::cout << "Functionality test 7: pooled connections\n";
+    // confirm that several threads can each run a user's operations over
+    // one shared pool of connections without interfering with each other
+    if(testPooledUsers("test1", "test1pwd") == 1) return 1;
+    if(testValidRecordListing(alice, std::vector<std::string>({"permanent1"})) == 1) return 1;
+
+    std::cout << "Functionality test 8: chunked records\n";
+    // confirm records streamed in and out a chunk at a time round-trip,
+    // and that chunks can't be reordered or dropped unnoticed
+    if(testChunkedRecords(alice) == 1) return 1;
+    if(testRecordRanges(alice) == 1) return 1;
+    if(testRecordAppendPatch(alice) == 1) return 1;
+
+    std::cout << "Functionality test 9: compression\n";
+    // confirm compressible contents are stored compressed and read back
+    // intact, and that incompressible contents are stored as they are
+    if(testCompressedRecords("test1", "test1pwd") == 1) return 1;
+
+    std::cout << "Functionality test 10: statistics\n";
+    // confirm operations are counted and timed only while collection is on
+    if(testStatistics(alice) == 1) return 1;
+    if(testValidRecordListing(alice, std::vector<std::string>({"permanent1"})) == 1) return 1;
 
     std::cout << "Functionality tests passed\n";
     std::cout << "All tests passed!\n";
@@ -130,9 +250,21 @@ int main() {
 
 /* Reset function definitions */
 void resetDatabase() {
+    // deliberately the oldest layout, in HEX_STORAGE, so that the storage
+    // and schema migrations are run against it before everything else
     DB db("runtests.db");
     db.prepared_query("drop table Keys", ArgumentList({}));
     db.prepared_query("drop table Records", ArgumentList({}));
+    db.prepared_query("drop table if exists RecordChunks", ArgumentList({}));
+    db.prepared_query("drop table if exists Settings", ArgumentList({}));
+    db.prepared_query("drop index if exists users_login", ArgumentList({}));
+    db.prepared_query("PRAGMA user_version = 0", ArgumentList({}));
+    db.prepared_query("drop table Users", ArgumentList({}));
+    db.prepared_query("create table Users(id int primary key, username varchar(256), password varchar(256))",
+                      ArgumentList({}));
+    db.prepared_query("insert into Users (username, password) values (?, ?), (?, ?)",
+                      ArgumentList({crypto::hash("test1"), crypto::hash(crypto::hash("test1test1pwd")),
+                                    crypto::hash("test2"), crypto::hash(crypto::hash("test2test2pwd"))}));
     db.prepared_query("create table Keys(user varchar(640), record_name varchar(2048), record_identifier varchar(640), key varchar(2048));", ArgumentList({}));
     db.prepared_query("create table Records(id int primary key, owner int not null, name varchar(512), record varchar(4096), foreign key(owner) references Users(id))", ArgumentList({}));
     std::cout << "Successfully reset database\n";
@@ -299,4 +431,1546 @@ int testValidRecordListing(AuthenticatedDBUser& user, std::vector<std::string> e
         std::cout << "Failed record listing test: an exception was thrown: " << e.what() << '\n';
         return 1;
     }
-}
\ No newline at end of file
+}
+
+int testRecordExistsMatchesScan(AuthenticatedDBUser& user, std::vector<std::string> names) {
+    // record_exists uses an indexed identifier lookup; the record listing
+    // decrypts every name the user holds. Both must agree on every name.
+    try {
+        std::vector<std::string> scan = user.get_record_names();
+        for(size_t i = 0; i < names.size(); i++) {
+            bool inScan = false;
+            for(size_t j = 0; j < scan.size(); j++) {
+                if(scan[j] == names[i]) inScan = true;
+            }
+            if(user.record_exists(names[i]) != inScan) {
+                std::cout << "Failed record lookup test: lookup and scan disagree on '" << names[i] << "'\n";
+                return 1;
+            }
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed record lookup test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testStatementCacheReuse(AuthenticatedDBUser& user, std::string name) {
+    // the first read may compile statements; a second identical read must be
+    // served entirely from the statement cache
+    try {
+        user.retrieve_record(name);
+        size_t hits = user.statement_cache_hits();
+        size_t misses = user.statement_cache_misses();
+        user.retrieve_record(name);
+        if(user.statement_cache_misses() != misses) {
+            std::cout << "Failed statement cache test: repeated read compiled a new statement\n";
+            return 1;
+        }
+        if(user.statement_cache_hits() <= hits) {
+            std::cout << "Failed statement cache test: repeated read did not hit the cache\n";
+            return 1;
+        }
+
+        // SQLite reports this statement's text without the trailing space,
+        // so it must be released by the text it was cached under
+        std::string padded = "SELECT COUNT(*) FROM Users; ";
+        DBTable first = user.debug_prepared_query(padded, ArgumentList({}));
+        hits = user.statement_cache_hits();
+        misses = user.statement_cache_misses();
+        DBTable second = user.debug_prepared_query(padded, ArgumentList({}));
+        if(second != first || user.statement_cache_misses() != misses || user.statement_cache_hits() <= hits) {
+            std::cout << "Failed statement cache test: a statement with trailing text was not reused\n";
+            return 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed statement cache test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testStreamedRecordListing(AuthenticatedDBUser& user, std::vector<std::string> expectedList) {
+    // names must stream in the same order as get_record_names, and issuing
+    // other queries from inside the visitor must not disturb the listing
+    try {
+        std::vector<std::string> test;
+        bool allExist = true;
+        user.for_each_record_name([&](const std::string& name) {
+            test.push_back(name);
+            allExist = allExist && user.record_exists(name);
+        });
+        if(test != expectedList) {
+            std::cout << "Failed streamed listing test: record list differs from expected record\n";
+            return 1;
+        }
+        if(!allExist) {
+            std::cout << "Failed streamed listing test: nested lookup failed during listing\n";
+            return 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed streamed listing test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testBinaryStorageMigration() {
+    try {
+        DB db("runtests.db");
+        if(db.storage_format() != HEX_STORAGE) {
+            std::cout << "Failed migration test: reset database is not in hex format\n";
+            return 1;
+        }
+        migrate_to_binary_storage(db);
+        if(db.storage_format() != BINARY_STORAGE) {
+            std::cout << "Failed migration test: database not marked as binary\n";
+            return 1;
+        }
+        DBTable remaining = db.prepared_query(
+            "SELECT (SELECT COUNT(*) FROM Keys WHERE typeof(key)!='blob' OR typeof(record_name)!='blob')"
+            " + (SELECT COUNT(*) FROM Records WHERE typeof(record)!='blob' OR typeof(name)!='blob')",
+            ArgumentList({}));
+        if(remaining.size() != 1 || remaining[0][0] != "0") {
+            std::cout << "Failed migration test: hex values remain after migration\n";
+            return 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed migration test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testTypedArgumentBinding() {
+    // bind one value of every argument type and read each back in place
+    try {
+        DB db("runtests.db");
+        std::string bytes("a\0b", 3);
+        bool ok = false;
+        db.query_rows("SELECT ?, ?, ?, ?", ArgumentList({DBArgument::integer(-42), DBArgument::null(),
+                                                          DBArgument::blob(bytes), DBArgument::text("text", 2)}),
+                      [&](const DBRow& row) {
+            DBView blob = row.view(2);
+            ok = row.integer(0) == -42 && row.is_null(1) && row.is_blob(2)
+                 && std::string(blob.data, blob.size) == bytes && row[3] == "te";
+        });
+        if(!ok) {
+            std::cout << "Failed argument binding test: values did not round trip\n";
+            return 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed argument binding test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testNestedTransactions() {
+    // a rolled back savepoint must undo only its own changes, and an outer
+    // transaction abandoned by an exception must undo everything
+    try {
+        DB db("runtests.db");
+        db.prepared_query("CREATE TEMP TABLE Scratch(value INTEGER)", ArgumentList({}));
+        {
+            Transaction outer(db, true);
+            db.prepared_query("INSERT INTO Scratch VALUES (1)", ArgumentList({}));
+            {
+                Transaction inner(db);
+                db.prepared_query("INSERT INTO Scratch VALUES (2)", ArgumentList({}));
+                inner.rollback();
+            }
+            {
+                Transaction inner(db);
+                db.prepared_query("INSERT INTO Scratch VALUES (3)", ArgumentList({}));
+                inner.commit();
+            }
+            outer.commit();
+        }
+        DBTable kept = db.prepared_query("SELECT value FROM Scratch ORDER BY value", ArgumentList({}));
+        if(kept.size() != 2 || kept[0][0] != "1" || kept[1][0] != "3") {
+            std::cout << "Failed transaction test: savepoint rollback did not undo exactly its own changes\n";
+            return 1;
+        }
+
+        try {
+            Transaction abandoned(db, true);
+            db.prepared_query("DELETE FROM Scratch", ArgumentList({}));
+            throw std::runtime_error("abandon transaction");
+        } catch(std::runtime_error&) {
+        }
+        if(db.prepared_query("SELECT value FROM Scratch", ArgumentList({})).size() != 2) {
+            std::cout << "Failed transaction test: abandoned transaction was not rolled back\n";
+            return 1;
+        }
+        db.prepared_query("DROP TABLE Scratch", ArgumentList({}));
+    } catch(std::exception& e) {
+        std::cout << "Failed transaction test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testConcurrentWriters() {
+    // several processes incrementing one counter through LockedDB must
+    // neither fail on lock contention nor lose an update
+    const int processes = 4;
+    const int increments = 25;
+    try {
+        LockedDB setup("runtests.db");
+        setup.prepared_query("DROP TABLE IF EXISTS Contention", ArgumentList({}));
+        setup.prepared_query("CREATE TABLE Contention(value INTEGER)", ArgumentList({}));
+        setup.prepared_query("INSERT INTO Contention VALUES (0)", ArgumentList({}));
+    } catch(std::exception& e) {
+        std::cout << "Failed contention test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+
+    // anything still buffered would otherwise be printed once per process
+    std::cout.flush();
+    std::vector<pid_t> children;
+    for(int p = 0; p < processes; p++) {
+        pid_t pid = fork();
+        if(pid == 0) {
+            int status = 0;
+            try {
+                LockedDB db("runtests.db");
+                for(int i = 0; i < increments; i++) {
+                    db.write([](LockedDB& t) {
+                        DBTable current = t.prepared_query("SELECT value FROM Contention", ArgumentList({}));
+                        t.prepared_query("UPDATE Contention SET value=?",
+                                         ArgumentList({DBArgument::integer(std::atoi(current[0][0].c_str()) + 1)}));
+                    });
+                    db.read([](LockedDB& t) {
+                        t.prepared_query("SELECT value FROM Contention", ArgumentList({}));
+                    });
+                }
+            } catch(std::exception& e) {
+                std::cout << "Failed contention test: process " << p << " threw: " << e.what() << '\n';
+                status = 1;
+            }
+            std::cout.flush();
+            _exit(status);
+        } else if(pid < 0) {
+            std::cout << "Failed contention test: could not start a process\n";
+            return 1;
+        }
+        children.push_back(pid);
+    }
+
+    bool failed = false;
+    for(size_t i = 0; i < children.size(); i++) {
+        int status;
+        if(waitpid(children[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = true;
+        }
+    }
+    if(failed) {
+        return 1;
+    }
+
+    try {
+        LockedDB db("runtests.db");
+        DBTable total = db.prepared_query("SELECT value FROM Contention", ArgumentList({}));
+        db.prepared_query("DROP TABLE Contention", ArgumentList({}));
+        if(total.size() != 1 || std::atoi(total[0][0].c_str()) != processes * increments) {
+            std::cout << "Failed contention test: updates were lost\n";
+            return 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed contention test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testDatabaseOptions() {
+    // each preset must actually take effect, and unknown settings must be
+    // refused rather than spliced into a PRAGMA
+    try {
+        DBOptions balanced = DB("runtests.db").effective_options();
+        if(balanced.journal_mode != "WAL" || balanced.synchronous != "NORMAL" || balanced.mmap_size <= 0
+           || balanced.cache_size != -16384 || balanced.temp_store != "MEMORY") {
+            std::cout << "Failed database options test: balanced settings not applied: " << balanced.describe() << '\n';
+            return 1;
+        }
+
+        DBOptions bulk = DB("runtests_options.db", DBOptions::bulk_load()).effective_options();
+        DBOptions durable = DB("runtests_options.db", DBOptions::durable()).effective_options();
+        std::remove("runtests_options.db");
+        if(bulk.journal_mode != "MEMORY" || bulk.synchronous != "OFF"
+           || durable.journal_mode != "DELETE" || durable.synchronous != "FULL") {
+            std::cout << "Failed database options test: presets not applied: "
+                      << bulk.describe() << "; " << durable.describe() << '\n';
+            return 1;
+        }
+
+        DBOptions invalid;
+        invalid.journal_mode = "WAL; DROP TABLE Keys";
+        try {
+            DB db("runtests.db", invalid);
+            std::cout << "Failed database options test: invalid journal mode accepted\n";
+            return 1;
+        } catch(std::runtime_error&) {
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed database options test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testBatchDecryption() {
+    // a batch mixing bound GCM, unbound GCM and legacy CBC ciphertexts must
+    // decrypt exactly as one call per item would, unbound items must be
+    // refused unless legacy ones are allowed, and a single altered or moved
+    // item must fail it
+    try {
+        CryptoPP::SecByteBlock key = crypto::random_block(CryptoPP::AES::DEFAULT_KEYLENGTH);
+        std::vector<std::string> plaintexts({"", "a", "exactly sixteen!", std::string(100, 'x')});
+        std::vector<std::string> cts;
+        std::vector<std::string> contexts;
+        for(size_t i = 0; i < plaintexts.size(); i++) {
+            cts.push_back(crypto::auth_encrypt(plaintexts[i], key));
+            contexts.push_back("");
+            cts.push_back(std::string(1, static_cast<char>(crypto::CIPHER_AES_CBC)) + crypto::raw_encrypt(plaintexts[i], key));
+            contexts.push_back("");
+            contexts.push_back("row " + std::to_string(i));
+            cts.push_back(crypto::auth_encrypt(plaintexts[i], key, contexts.back(),
+                                               crypto::CIPHER_AES_GCM | crypto::CIPHER_BOUND));
+        }
+        std::vector<crypto::CiphertextView> views;
+        std::vector<crypto::CiphertextView> bound;
+        for(size_t i = 0; i < cts.size(); i++) {
+            views.push_back(crypto::CiphertextView({cts[i].data(), cts[i].size(), contexts[i]}));
+            if(crypto::is_bound(cts[i].data(), cts[i].size())) {
+                bound.push_back(views.back());
+            }
+        }
+        std::vector<std::string> decrypted = crypto::auth_decrypt_batch(views, key, true);
+        if(decrypted.size() != cts.size()) {
+            std::cout << "Failed batch decryption test: wrong number of results\n";
+            return 1;
+        }
+        for(size_t i = 0; i < cts.size(); i++) {
+            std::string single = crypto::is_bound(cts[i].data(), cts[i].size())
+                                 ? crypto::auth_decrypt(cts[i].data(), cts[i].size(), key, contexts[i])
+                                 : crypto::auth_decrypt(cts[i], key);
+            if(decrypted[i] != plaintexts[i / 3] || decrypted[i] != single) {
+                std::cout << "Failed batch decryption test: item " << i << " decrypted incorrectly\n";
+                return 1;
+            }
+        }
+
+        if(crypto::auth_decrypt_batch(bound, key, false).size() != plaintexts.size()) {
+            std::cout << "Failed batch decryption test: wrong number of bound results\n";
+            return 1;
+        }
+        try {
+            crypto::auth_decrypt_batch(views, key, false);
+            std::cout << "Failed batch decryption test: legacy ciphertext was accepted\n";
+            return 1;
+        } catch(std::exception&) {
+        }
+        std::swap(bound[0].context, bound[1].context);
+        try {
+            crypto::auth_decrypt_batch(bound, key, false);
+            std::cout << "Failed batch decryption test: ciphertext was accepted under another context\n";
+            return 1;
+        } catch(std::exception&) {
+        }
+
+        cts[0][cts[0].size() - 1] ^= 1;
+        try {
+            crypto::auth_decrypt_batch(views, key, true);
+            std::cout << "Failed batch decryption test: altered ciphertext was accepted\n";
+            return 1;
+        } catch(std::exception&) {
+        }
+
+        // the batch runs GCM's counter blocks and GHASH itself, so check it
+        // against the single item path at every length of text up to three
+        // blocks, and a long one, under contexts of every length up to
+        // three blocks; a change to the nonce, text or tag of any one item
+        // must fail the whole batch
+        std::vector<std::string> sealed;
+        std::vector<std::string> sealed_contexts;
+        for(size_t n = 0; n < 48; n++) {
+            sealed_contexts.push_back(std::string(n, static_cast<char>('c' + n)));
+            sealed.push_back(crypto::auth_encrypt(std::string(n, static_cast<char>(n)), key, sealed_contexts.back(),
+                                                  crypto::CIPHER_AES_GCM | crypto::CIPHER_BOUND));
+        }
+        sealed_contexts.push_back("long");
+        sealed.push_back(crypto::auth_encrypt(std::string(4096, 'l'), key, "long", crypto::CIPHER_AES_GCM | crypto::CIPHER_BOUND));
+        std::vector<crypto::CiphertextView> sealed_views;
+        for(size_t i = 0; i < sealed.size(); i++) {
+            sealed_views.push_back(crypto::CiphertextView({sealed[i].data(), sealed[i].size(), sealed_contexts[i]}));
+        }
+        std::vector<std::string> opened = crypto::auth_decrypt_batch(sealed_views, key, false);
+        for(size_t i = 0; i < sealed.size(); i++) {
+            if(opened[i] != crypto::auth_decrypt(sealed[i].data(), sealed[i].size(), key, sealed_contexts[i])) {
+                std::cout << "Failed batch decryption test: sealed item " << i << " decrypted incorrectly\n";
+                return 1;
+            }
+        }
+        // offsets past the cipher tag: the nonce, the last byte of text and the tag
+        size_t middle = 20;
+        std::vector<size_t> offsets({1, 1 + crypto::_impl_details::GCM_NONCE_SIZE + middle - 1,
+                                     sealed[middle].size() - crypto::_impl_details::GCM_TAG_SIZE});
+        for(size_t i = 0; i < offsets.size(); i++) {
+            sealed[middle][offsets[i]] ^= 0x40;
+            try {
+                crypto::auth_decrypt_batch(sealed_views, key, false);
+                std::cout << "Failed batch decryption test: altered byte " << offsets[i] << " was accepted\n";
+                return 1;
+            } catch(std::exception&) {
+            }
+            sealed[middle][offsets[i]] ^= 0x40;
+        }
+
+        // every length of padding is stripped, and bad padding, a bad
+        // length and a failed authentication must all look the same, one
+        // item at a time or in a batch
+        for(size_t n = 0; n <= 32; n++) {
+            if(crypto::raw_decrypt(crypto::raw_encrypt(std::string(n, 'p'), key), key) != std::string(n, 'p')) {
+                std::cout << "Failed batch decryption test: " << n << " bytes did not round-trip through AES-CBC\n";
+                return 1;
+            }
+        }
+        std::string cbc = crypto::raw_encrypt("padding", key);
+        std::string bad_padding = cbc;
+        bad_padding[bad_padding.size() - 17] ^= 0x01; // the last plaintext byte, i.e. the padding
+        std::string tagged = std::string(1, static_cast<char>(crypto::CIPHER_AES_CBC)) + bad_padding;
+        std::vector<std::function<void()>> failures({
+            [&]() { crypto::raw_decrypt(bad_padding, key); },
+            [&]() { crypto::raw_decrypt(cbc.substr(0, cbc.size() - 1), key); },
+            [&]() { crypto::auth_decrypt(tagged, key); },
+            [&]() { crypto::auth_decrypt(cts[0], key); },
+            [&]() { crypto::raw_decrypt_batch(std::vector<crypto::CiphertextView>({{bad_padding.data(), bad_padding.size(), ""}}), key); },
+            [&]() { crypto::auth_decrypt_batch(std::vector<crypto::CiphertextView>({{tagged.data(), tagged.size(), ""}}), key, true); },
+            [&]() { crypto::auth_decrypt_batch(std::vector<crypto::CiphertextView>({views[0]}), key, true); }
+        });
+        std::string first_error;
+        for(size_t i = 0; i < failures.size(); i++) {
+            try {
+                failures[i]();
+                std::cout << "Failed batch decryption test: bad ciphertext " << i << " was accepted\n";
+                return 1;
+            } catch(std::exception& e) {
+                if(i == 0) {
+                    first_error = e.what();
+                } else if(e.what() != first_error) {
+                    std::cout << "Failed batch decryption test: '" << e.what() << "' tells apart a failure that '"
+                              << first_error << "' doesn't\n";
+                    return 1;
+                }
+            }
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed batch decryption test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testRecordKeyCache(AuthenticatedDBUser& user, std::string name) {
+    // a repeated read must reuse the unwrapped record key, and a record that
+    // is deleted and recreated under the same name must not reuse its old key
+    try {
+        user.create_record(name, "first");
+        user.retrieve_record(name);
+        size_t hits = user.record_key_cache_hits();
+        user.retrieve_record(name);
+        if(user.record_key_cache_hits() != hits + 1) {
+            std::cout << "Failed record key cache test: repeated read did not hit the cache\n";
+            return 1;
+        }
+        user.delete_record(name);
+        user.create_record(name, "second");
+        if(user.retrieve_record(name) != "second") {
+            std::cout << "Failed record key cache test: recreated record read with a stale key\n";
+            return 1;
+        }
+        user.delete_record(name);
+    } catch(std::exception& e) {
+        std::cout << "Failed record key cache test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testAuthenticatedStorageMigration() {
+    try {
+        DB db("runtests.db");
+        migrate_to_authenticated_storage(db);
+        if(db.storage_format() != AUTHENTICATED_STORAGE) {
+            std::cout << "Failed migration test: database not marked as authenticated\n";
+            return 1;
+        }
+        DBTable untagged = db.prepared_query("SELECT COUNT(*) FROM Records WHERE substr(record, 1, 1)!=X'00'",
+                                             ArgumentList({}));
+        if(untagged.size() != 1 || untagged[0][0] != "0") {
+            std::cout << "Failed migration test: existing records were not tagged as AES-CBC\n";
+            return 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed migration test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+static bool plan_uses(DB& db, const std::string& query, const std::string& index) {
+    // whether SQLite would serve query through index
+    DBTable plan = db.prepared_query("EXPLAIN QUERY PLAN " + query,
+                                     ArgumentList({DBArgument::blob("u"), DBArgument::blob("n")}));
+    for(size_t i = 0; i < plan.size(); i++) {
+        if(plan[i].back().find(index) != std::string::npos) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int testSchemaUpgrade() {
+    try {
+        DB db("runtests.db");
+        DBTable before = db.prepared_query("SELECT rowid, record_name FROM Keys ORDER BY rowid", ArgumentList({}));
+        upgrade_schema(db);
+        if(schema_version(db) != SCHEMA_VERSION) {
+            std::cout << "Failed schema test: database not at version " << SCHEMA_VERSION << '\n';
+            return 1;
+        }
+        // a second upgrade, and opening the database, change nothing
+        upgrade_schema(db);
+        open_schema(db);
+        DBTable after = db.prepared_query("SELECT id, record_name FROM Keys ORDER BY id", ArgumentList({}));
+        if(after != before || schema_version(db) != SCHEMA_VERSION) {
+            std::cout << "Failed schema test: upgrading changed the rows or their order\n";
+            return 1;
+        }
+        DBTable unset = db.prepared_query("SELECT COUNT(*) FROM Records WHERE id IS NULL", ArgumentList({}));
+        if(unset.size() != 1 || unset[0][0] != "0") {
+            std::cout << "Failed schema test: Records.id is not the rowid\n";
+            return 1;
+        }
+        if(!plan_uses(db, "SELECT key FROM Keys WHERE user=? AND record_identifier=?", "COVERING INDEX keys_user_identifier")
+           || !plan_uses(db, "SELECT record FROM Records WHERE owner=? AND name=?", "INDEX records_owner_name")
+           || !plan_uses(db, "SELECT username FROM Users WHERE username=? AND password=?", "INDEX users_login")) {
+            std::cout << "Failed schema test: a lookup is not served by its index\n";
+            return 1;
+        }
+        if(db.storage_format() != AUTHENTICATED_STORAGE) {
+            std::cout << "Failed schema test: database no longer in authenticated format\n";
+            return 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed schema test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+
+    // a database with no tables is created at the current version
+    std::remove("runtests_schema.db");
+    int result = 0;
+    try {
+        DB fresh("runtests_schema.db");
+        upgrade_schema(fresh);
+        upgrade_schema(fresh);
+        DBTable tables = fresh.prepared_query("SELECT COUNT(*) FROM sqlite_master WHERE type='table'"
+                                              " AND name IN ('Users', 'Keys', 'Records', 'RecordChunks', 'Settings')",
+                                              ArgumentList({}));
+        if(schema_version(fresh) != SCHEMA_VERSION || tables.size() != 1 || tables[0][0] != "5") {
+            std::cout << "Failed schema test: new database not created at the current version\n";
+            result = 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed schema test: an exception was thrown creating a database: " << e.what() << '\n';
+        result = 1;
+    }
+    std::remove("runtests_schema.db");
+    return result;
+}
+
+int testRecordEncryptionUpgrade(AuthenticatedDBUser& user, const std::string& u, const std::string& p,
+                                std::string name, std::string expectedContent) {
+    // once upgraded, the user's legacy ciphertexts must be refused, by this
+    // session and by any later one, even if they are put back in place along
+    // with the user's password verifier from before the upgrade
+    DBTable legacy = user.debug_prepared_query("SELECT rowid, record FROM Records WHERE substr(record, 1, 1)=X'00'",
+                                               ArgumentList({}));
+    DBTable credentials = user.debug_prepared_query("SELECT rowid, password FROM Users", ArgumentList({}));
+    DBTable restored;
+    try {
+        if(user.upgrade_record_encryption() != 1) {
+            std::cout << "Failed encryption upgrade test: expected one legacy record\n";
+            return 1;
+        }
+        if(user.upgrade_record_encryption() != 0) {
+            std::cout << "Failed encryption upgrade test: record upgraded twice\n";
+            return 1;
+        }
+        if(user.retrieve_record(name) != expectedContent) {
+            std::cout << "Failed encryption upgrade test: unexpected record content\n";
+            return 1;
+        }
+        for(size_t i = 0; i < legacy.size(); i++) {
+            DBTable now = user.debug_prepared_query("SELECT rowid, record FROM Records WHERE rowid=?",
+                                                    ArgumentList({legacy[i][0]}));
+            if(now.size() == 1 && now[0][1] != legacy[i][1]) {
+                restored.push_back(now[0]);
+                user.debug_prepared_query("UPDATE Records SET record=? WHERE rowid=?",
+                                          ArgumentList({DBArgument::blob(legacy[i][1]), legacy[i][0]}));
+            }
+        }
+        for(size_t i = 0; i < credentials.size(); i++) {
+            user.debug_prepared_query("UPDATE Users SET password=? WHERE rowid=?",
+                                      ArgumentList({credentials[i][1], credentials[i][0]}));
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed encryption upgrade test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    if(restored.size() != 1) {
+        std::cout << "Failed encryption upgrade test: upgraded record not found\n";
+        return 1;
+    }
+
+    int result = 0;
+    if(testInvalidRecordReading(user, name) == 1) {
+        std::cout << "Failed encryption upgrade test: legacy record read after upgrading\n";
+        result = 1;
+    }
+    try {
+        AuthenticatedDBUser later(u, p, "runtests.db");
+        if(result == 0 && testInvalidRecordReading(later, name) == 1) {
+            std::cout << "Failed encryption upgrade test: legacy record read in a later session\n";
+            result = 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed encryption upgrade test: could not sign in again: " << e.what() << '\n';
+        result = 1;
+    }
+    user.debug_prepared_query("UPDATE Records SET record=? WHERE rowid=?",
+                              ArgumentList({DBArgument::blob(restored[0][1]), restored[0][0]}));
+    if(result == 0 && testValidRecordReading(user, name, expectedContent) == 1) return 1;
+    return result;
+}
+
+int testRecordBinding(AuthenticatedDBUser& user) {
+    // swapping ciphertexts between two of a user's records, all under the
+    // user's own keys, must be caught rather than serve one record as the other
+    try {
+        user.create_record("bound1", "first contents");
+        user.create_record("bound2", "second contents");
+        DBTable keys = user.debug_prepared_query("SELECT rowid, record_name, key FROM Keys ORDER BY rowid DESC LIMIT 2",
+                                                 ArgumentList({}));
+        DBTable records = user.debug_prepared_query("SELECT rowid, record FROM Records ORDER BY rowid DESC LIMIT 2",
+                                                    ArgumentList({}));
+        auto swap_keys = [&](const char* column, int from, int field) {
+            for(int i = 0; i < 2; i++) {
+                user.debug_prepared_query(std::string("UPDATE Keys SET ") + column + "=? WHERE rowid=?",
+                                          ArgumentList({DBArgument::blob(keys[(i + from) % 2][field]), keys[i][0]}));
+            }
+        };
+        auto swap_records = [&](int from) {
+            for(int i = 0; i < 2; i++) {
+                user.debug_prepared_query("UPDATE Records SET record=? WHERE rowid=?",
+                                          ArgumentList({DBArgument::blob(records[(i + from) % 2][1]), records[i][0]}));
+            }
+        };
+
+        int result = 0;
+        swap_keys("key", 1, 2);
+        swap_records(1);
+        if(testInvalidRecordReading(user, "bound1") == 1) {
+            std::cout << "Failed record binding test: another record's key and contents were accepted\n";
+            result = 1;
+        }
+        swap_keys("key", 0, 2);
+        swap_records(0);
+        swap_keys("record_name", 1, 1);
+        try {
+            user.get_record_names();
+            std::cout << "Failed record binding test: swapped record names were accepted\n";
+            result = 1;
+        } catch(std::exception&) {
+        }
+        swap_keys("record_name", 0, 1);
+
+        if(result == 0 && testValidRecordReading(user, "bound1", "first contents") == 1) return 1;
+        user.delete_record("bound1");
+        user.delete_record("bound2");
+        return result;
+    } catch(std::exception& e) {
+        std::cout << "Failed record binding test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+}
+
+int testTamperedRecordReading(AuthenticatedDBUser& user, std::string name) {
+    // flip one bit of every stored AES-GCM ciphertext; the read must fail,
+    // and must succeed again once the ciphertexts are restored
+    DBTable stored = user.debug_prepared_query("SELECT rowid, record FROM Records WHERE substr(record, 1, 1)=X'81'",
+                                               ArgumentList({}));
+    if(stored.empty()) {
+        std::cout << "Failed tampering test: no authenticated records found\n";
+        return 1;
+    }
+    for(size_t i = 0; i < stored.size(); i++) {
+        std::string tampered = stored[i][1];
+        tampered[tampered.size() / 2] ^= 0x01;
+        user.debug_prepared_query("UPDATE Records SET record=? WHERE rowid=?",
+                                  ArgumentList({DBArgument::blob(tampered), stored[i][0]}));
+    }
+
+    int result = 0;
+    if(testInvalidRecordReading(user, name) == 1) {
+        std::cout << "Failed tampering test: modified record was decrypted\n";
+        result = 1;
+    }
+
+    for(size_t i = 0; i < stored.size(); i++) {
+        user.debug_prepared_query("UPDATE Records SET record=? WHERE rowid=?",
+                                  ArgumentList({DBArgument::blob(stored[i][1]), stored[i][0]}));
+    }
+    if(result == 0 && testValidRecordReading(user, name, name) == 1) return 1;
+    return result;
+}
+
+int testBatchOperations(AuthenticatedDBUser& user) {
+    try {
+        std::vector<RecordResult> created = user.create_records(RecordList({
+            {"B1", "one"}, {"B2", "two"}, {"B1", "duplicate"}, {"permanent1", "existing"}}));
+        if(created.size() != 4 || !created[0].ok || !created[1].ok || created[2].ok || created[3].ok) {
+            std::cout << "Failed batch test: unexpected results from batch creation\n";
+            return 1;
+        }
+
+        std::vector<RecordResult> read = user.retrieve_records(std::vector<std::string>({"B2", "nonexistent", "B1", "permanent1"}));
+        if(read.size() != 4 || !read[0].ok || read[0].value != "two" || read[1].ok
+           || !read[2].ok || read[2].value != "one" || !read[3].ok || read[3].value != "permanent1") {
+            std::cout << "Failed batch test: unexpected results from batch reading\n";
+            return 1;
+        }
+
+        std::vector<RecordResult> written = user.write_records(RecordList({{"B1", "new one"}, {"B3", "three"}}));
+        if(written.size() != 2 || !written[0].ok || !written[1].ok
+           || user.retrieve_record("B1") != "new one" || user.retrieve_record("B3") != "three") {
+            std::cout << "Failed batch test: unexpected results from batch writing\n";
+            return 1;
+        }
+
+        std::vector<RecordResult> deleted = user.delete_records(std::vector<std::string>({"B1", "B2", "B1", "B3"}));
+        if(deleted.size() != 4 || !deleted[0].ok || !deleted[1].ok || deleted[2].ok || !deleted[3].ok) {
+            std::cout << "Failed batch test: unexpected results from batch deletion\n";
+            return 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed batch test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testBatchMode(AuthenticatedDBUser& user) {
+    // every request line gets exactly one result line, in order, and bad
+    // requests fail without stopping the stream
+    std::istringstream in(
+        "{\"id\": 1, \"op\": \"write\", \"name\": \"J1\", \"value\": \"line\\none \\\"quoted\\\" \\u00e9\"}\n"
+        "\n"
+        "{\"id\": \"two\", \"op\": \"read\", \"name\": \"J1\"}\n"
+        "{\"op\": \"read\", \"name\": \"nonexistent\"}\n"
+        "not json\n"
+        "{\"id\": x\", \"op\": \"list\"}\n"
+        "{\"id\": 01, \"op\": \"list\"}\n"
+        "{\"op\": \"read\", \"name\": \"\\udc00\"}\n"
+        "{\"id\": -2.5e3, \"op\": \"read\", \"name\": \"\\ud83d\\ude00\"}\n"
+        "{\"op\": \"write\", \"name\": \"J2\", \"value_b64\": \"AP/+gA==\"}\n"
+        "{\"op\": \"write\", \"name\": \"J3\", \"value_b64\": \"AP/+g===\"}\n"
+        "{\"op\": \"read\", \"name\": \"J2\"}\n"
+        "{\"op\": \"list\"}\n"
+        "{\"op\": \"delete\", \"name\": \"J1\"}\n"
+        "{\"op\": \"delete\", \"name\": \"J2\"}\n");
+    std::ostringstream out;
+    BatchStats stats;
+    try {
+        stats = run_batch_mode(user, in, out);
+    } catch(std::exception& e) {
+        std::cout << "Failed batch mode test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+
+    std::vector<std::string> expected({
+        "{\"id\": 1, \"ok\": true}",
+        "{\"id\": \"two\", \"ok\": true, \"value\": \"line\\none \\\"quoted\\\" \xc3\xa9\"}",
+        "{\"ok\": false, \"error\": \"could not retrieve record\"}",
+        "",
+        "",
+        "",
+        "",
+        "{\"id\": -2.5e3, \"ok\": false, \"error\": \"could not retrieve record\"}",
+        "{\"ok\": true}",
+        "{\"ok\": false, \"error\": \"invalid base64\"}",
+        "{\"ok\": true, \"value_b64\": \"AP/+gA==\"}",
+        "{\"ok\": true, \"names\": [\"permanent1\", \"J1\", \"J2\"]}",
+        "{\"ok\": true}",
+        "{\"ok\": true}"});
+    std::istringstream results(out.str());
+    std::string line;
+    for(size_t i = 0; i < expected.size(); i++) {
+        if(!std::getline(results, line)) {
+            std::cout << "Failed batch mode test: missing result " << i << '\n';
+            return 1;
+        }
+        // the parse error's wording is not part of the format
+        bool matches = expected[i].empty() ? line.find("\"ok\": false") != std::string::npos : line == expected[i];
+        if(!matches) {
+            std::cout << "Failed batch mode test: unexpected result " << i << ": " << line << '\n';
+            return 1;
+        }
+    }
+    if(std::getline(results, line) || stats.requests != 14 || stats.failures != 7) {
+        std::cout << "Failed batch mode test: wrong result or request counts\n";
+        return 1;
+    }
+
+    // a binary record comes out as valid JSON, and back again intact
+    std::string binary;
+    for(int i = 0; i < 256; i++) {
+        binary += static_cast<char>(255 - i);
+    }
+    try {
+        user.create_record("J4", binary);
+        std::istringstream read_binary("{\"op\": \"read\", \"name\": \"J4\"}\n");
+        std::ostringstream read_out;
+        run_batch_mode(user, read_binary, read_out);
+        user.delete_record("J4");
+        JSONObject result = parse_json_object(read_out.str());
+        if(!is_utf8(read_out.str()) || result.strings.count("value") != 0 || result.get_bytes("value") != binary) {
+            std::cout << "Failed batch mode test: binary record read back as " << read_out.str();
+            return 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed batch mode test: an exception was thrown reading a binary record: " << e.what() << '\n';
+        return 1;
+    }
+    for(size_t length = 0; length < 8; length++) {
+        std::string bytes = binary.substr(100, length);
+        if(base64_decode(base64_encode(bytes)) != bytes || base64_encode(bytes).size() != (length + 2) / 3 * 4) {
+            std::cout << "Failed batch mode test: base64 of " << length << " bytes did not round-trip\n";
+            return 1;
+        }
+    }
+    std::vector<std::string> not_base64({"A", "A===", "AB=C", "AB*=", "=AAA", std::string("AB\0=", 4)});
+    for(size_t i = 0; i < not_base64.size(); i++) {
+        try {
+            base64_decode(not_base64[i]);
+            std::cout << "Failed batch mode test: accepted \"" << not_base64[i] << "\" as base64\n";
+            return 1;
+        } catch(std::runtime_error&) {
+        }
+    }
+    // overlong, surrogate and out of range sequences are not UTF-8, nor is
+    // one cut short
+    std::vector<std::string> not_utf8({"\xc0\x80", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xe2\x82", "\x80"});
+    for(size_t i = 0; i < not_utf8.size(); i++) {
+        if(is_utf8(not_utf8[i]) || json_quote("a" + not_utf8[i]).find("\\ufffd") == std::string::npos
+           || !is_utf8(json_quote(not_utf8[i]))) {
+            std::cout << "Failed batch mode test: invalid UTF-8 sequence " << i << " was let through\n";
+            return 1;
+        }
+    }
+    if(!is_utf8("\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80") || json_quote("\xe2\x82\xac") != "\"\xe2\x82\xac\"") {
+        std::cout << "Failed batch mode test: valid UTF-8 was not let through\n";
+        return 1;
+    }
+    return 0;
+}
+
+int testBulkTransfer(AuthenticatedDBUser& user) {
+    // enough records for several chunks and transactions, plus a duplicate
+    // and an unparseable line, which must be skipped without stopping the
+    // import, and a record large enough to be stored in chunks; the export
+    // must then give back the records in order
+    const size_t records = 2 * BULK_CHUNK_ROWS + 17;
+    std::string input;
+    std::vector<std::string> names;
+    std::string large;
+    for(size_t i = 0; large.size() < 2 * AuthenticatedDBUser::RECORD_CHUNK_SIZE + 100; i++) {
+        large += "line " + std::to_string(i) + ";";
+    }
+    std::string binary("\xff\xfe\0binary\x80", 10);
+    for(size_t i = 0; i < records; i++) {
+        names.push_back("bulk" + std::to_string(i));
+        input += "{\"name\": \"" + names.back() + "\", \"value\": \"value " + std::to_string(i) + "\"}\n";
+        if(i == 100) {
+            input += "{\"name\": \"bulk0\", \"value\": \"duplicate\"}\nnot json\n";
+            input += "{\"name\": \"large bulk\", \"value\": \"" + large + "\"}\n";
+            input += "{\"name\": \"binary bulk\", \"value_b64\": \"" + base64_encode(binary) + "\"}\n";
+        }
+    }
+
+    try {
+        DBTable chunks_before = user.debug_prepared_query("SELECT COUNT(*) FROM RecordChunks", ArgumentList({}));
+        std::istringstream in(input);
+        BulkStats imported = bulk_import(user, in, 3, NULL);
+        DBTable chunks_after = user.debug_prepared_query("SELECT COUNT(*) FROM RecordChunks", ArgumentList({}));
+        if(std::stoul(chunks_after[0][0]) != std::stoul(chunks_before[0][0]) + 3
+           || user.retrieve_record("large bulk") != large
+           || user.retrieve_record_range("large bulk", AuthenticatedDBUser::RECORD_CHUNK_SIZE - 5, 10)
+              != large.substr(AuthenticatedDBUser::RECORD_CHUNK_SIZE - 5, 10)) {
+            std::cout << "Failed bulk transfer test: a large record was not imported in chunks\n";
+            return 1;
+        }
+        if(imported.records != records + 2 || imported.failures != 2 || user.retrieve_record("binary bulk") != binary) {
+            std::cout << "Failed bulk transfer test: imported " << imported.records << " records, skipped "
+                      << imported.failures << '\n';
+            return 1;
+        }
+
+        std::ostringstream out;
+        BulkStats exported = bulk_export(user, out, 3, NULL);
+        std::istringstream lines(out.str());
+        std::string line;
+        size_t found = 0;
+        bool found_large = false;
+        bool found_binary = false;
+        while(std::getline(lines, line)) {
+            if(!is_utf8(line)) {
+                std::cout << "Failed bulk transfer test: exported a line that isn't valid UTF-8\n";
+                return 1;
+            }
+            JSONObject record = parse_json_object(line);
+            if(record.get("name") == "large bulk") {
+                found_large = record.get_bytes("value") == large;
+                continue;
+            }
+            if(record.get("name") == "binary bulk") {
+                found_binary = record.get_bytes("value") == binary;
+                continue;
+            }
+            if(record.get("name").compare(0, 4, "bulk") != 0) {
+                continue; // one of the user's other records
+            }
+            if(found >= records || record.get("name") != names[found]
+               || record.get("value") != "value " + std::to_string(found)) {
+                std::cout << "Failed bulk transfer test: unexpected exported record: " << line << '\n';
+                return 1;
+            }
+            found++;
+        }
+        if(found != records || !found_large || !found_binary || exported.failures != 0 || user.retrieve_record("bulk0") != "value 0") {
+            std::cout << "Failed bulk transfer test: exported " << found << " of " << records << " records\n";
+            return 1;
+        }
+
+        names.push_back("large bulk");
+        names.push_back("binary bulk");
+        user.delete_records(names);
+    } catch(std::exception& e) {
+        std::cout << "Failed bulk transfer test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testParallelDecryption(AuthenticatedDBUser& user) {
+    // the pool must run every range exactly once, even when some ranges are
+    // far slower than others, and pass on an exception from any of them
+    ThreadPool pool(3);
+    std::vector<int> counts(1000, 0);
+    pool.parallel_for(counts.size(), 10, [&counts](size_t begin, size_t end) {
+        if(begin < 100) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        for(size_t i = begin; i < end; i++) {
+            counts[i]++;
+        }
+    });
+    for(size_t i = 0; i < counts.size(); i++) {
+        if(counts[i] != 1) {
+            std::cout << "Failed parallel decryption test: item " << i << " was visited " << counts[i] << " times\n";
+            return 1;
+        }
+    }
+    try {
+        pool.parallel_for(100, 10, [](size_t begin, size_t) {
+            if(begin == 50) {
+                throw std::runtime_error("range failed");
+            }
+        });
+        std::cout << "Failed parallel decryption test: an exception in one range was lost\n";
+        return 1;
+    } catch(std::runtime_error& e) {
+    }
+
+    // a listing long enough to be shared out must match the sequential one
+    RecordList records;
+    std::vector<std::string> names;
+    for(size_t i = 0; i < 3 * AuthenticatedDBUser::PARALLEL_DECRYPT_MIN; i++) {
+        names.push_back("parallel" + std::to_string(i));
+        records.push_back(std::make_pair(names.back(), std::string("value")));
+    }
+    try {
+        user.create_records(records);
+        std::vector<std::string> sequential = user.get_record_names();
+        user.set_decrypt_threads(3);
+        std::vector<std::string> parallel = user.get_record_names();
+        user.set_decrypt_threads(0);
+        user.delete_records(names);
+        if(parallel != sequential || sequential.size() < names.size()) {
+            std::cout << "Failed parallel decryption test: listed " << parallel.size() << " names, expected "
+                      << sequential.size() << " in the same order\n";
+            return 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed parallel decryption test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testPooledUsers(const std::string& u, const std::string& p) {
+    // more threads than read connections, so that some have to wait for one
+    const int threads = 6;
+    const int records = 10;
+    try {
+        // a new user, who has no records at all, signs in below too
+        DB setup("runtests.db");
+        setup.prepared_query("INSERT INTO Users (username, password) VALUES (?, ?)",
+                             ArgumentList({crypto::hash("pooled"), crypto::hash(crypto::hash("pooledpooledpwd"))}));
+        ConnectionPool pool("runtests.db", 2);
+
+        // signing in only reads, so it must not wait for the writer
+        std::unique_ptr<ConnectionPool::Lease> writer(new ConnectionPool::Lease(pool.write()));
+        std::atomic<bool> signed_in(false);
+        std::string signin_error;
+        std::thread signin([&]() {
+            try {
+                AuthenticatedDBUser user(u, p, pool);
+                AuthenticatedDBUser fresh("pooled", "pooledpwd", pool);
+            } catch(std::exception& e) {
+                signin_error = e.what();
+            }
+            signed_in = true;
+        });
+        for(int waited = 0; waited < 500 && !signed_in; waited++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        bool signed_in_alongside_writer = signed_in;
+        writer.reset();
+        signin.join();
+        if(!signed_in_alongside_writer) {
+            std::cout << "Failed pooled connection test: signing in waited for the writer\n";
+            return 1;
+        }
+        setup.prepared_query("DELETE FROM Users WHERE username=?", ArgumentList({crypto::hash("pooled")}));
+        if(!signin_error.empty()) {
+            std::cout << "Failed pooled connection test: could not sign in: " << signin_error << '\n';
+            return 1;
+        }
+
+        std::vector<std::string> failures(threads);
+        std::vector<std::thread> workers;
+        for(int t = 0; t < threads; t++) {
+            workers.push_back(std::thread([&, t]() {
+                try {
+                    AuthenticatedDBUser user(u, p, pool);
+                    for(int i = 0; i < records; i++) {
+                        std::string name = "pooled" + std::to_string(t) + "_" + std::to_string(i);
+                        user.create_record(name, name + " contents");
+                        if(user.retrieve_record(name) != name + " contents") {
+                            failures[t] = "read back the wrong contents for " + name;
+                            return;
+                        }
+                        user.delete_record(name);
+                    }
+                } catch(std::exception& e) {
+                    failures[t] = e.what();
+                }
+            }));
+        }
+        for(size_t t = 0; t < workers.size(); t++) {
+            workers[t].join();
+        }
+        for(int t = 0; t < threads; t++) {
+            if(!failures[t].empty()) {
+                std::cout << "Failed pooled connection test: thread " << t << ": " << failures[t] << '\n';
+                return 1;
+            }
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed pooled connection test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testChunkedRecords(AuthenticatedDBUser& user) {
+    const size_t chunk = AuthenticatedDBUser::RECORD_CHUNK_SIZE;
+    std::string contents;
+    for(size_t i = 0; i < 3 * chunk + chunk / 2; i++) {
+        contents += static_cast<char>(i * 7 + i / 251);
+    }
+    try {
+        std::istringstream in(contents);
+        user.create_record("chunked", in);
+        std::istringstream empty("");
+        user.create_record("chunked empty", empty);
+
+        std::ostringstream out;
+        user.retrieve_record("chunked", out);
+        if(out.str() != contents || user.retrieve_record("chunked") != contents
+           || user.retrieve_record("chunked empty") != "") {
+            std::cout << "Failed chunked record test: contents did not round-trip\n";
+            return 1;
+        }
+        DBTable chunks = user.debug_prepared_query("SELECT COUNT(*), MAX(length(chunk)) FROM RecordChunks", ArgumentList({}));
+        if(chunks[0][0] != "4" || std::stoul(chunks[0][1]) > chunk + 64) {
+            std::cout << "Failed chunked record test: expected 4 chunks of at most " << chunk << " bytes, found "
+                      << chunks[0][0] << " of up to " << chunks[0][1] << '\n';
+            return 1;
+        }
+
+        // bulk export reads a chunked record through open_record, and then
+        // its chunks through open_record_chunk, one at a time
+        std::string exported;
+        bool named = false;
+        user.for_each_stored_record([&](const StoredRecord& record) {
+            if(!record.is_chunk) {
+                named = user.open_record(record).first == "chunked";
+            } else if(named) {
+                exported += user.open_record_chunk(record);
+            }
+        });
+        if(exported != contents) {
+            std::cout << "Failed chunked record test: exported contents did not match\n";
+            return 1;
+        }
+        std::ostringstream whole;
+        bulk_export(user, whole, 2, NULL);
+        std::istringstream whole_lines(whole.str());
+        std::string whole_line;
+        exported = "";
+        while(std::getline(whole_lines, whole_line)) {
+            JSONObject record = parse_json_object(whole_line);
+            if(record.get("name") == "chunked") {
+                exported = record.get_bytes("value");
+            }
+        }
+        if(exported != contents || !is_utf8(whole.str())) {
+            std::cout << "Failed chunked record test: bulk export did not give back the contents as valid JSON\n";
+            return 1;
+        }
+
+        // swap two chunks, then drop one: both must be refused
+        user.debug_prepared_query("UPDATE RecordChunks SET seq=-seq WHERE seq IN (1, 2)", ArgumentList({}));
+        user.debug_prepared_query("UPDATE RecordChunks SET seq=3+seq WHERE seq<0", ArgumentList({}));
+        if(testInvalidRecordReading(user, "chunked") == 1) return 1;
+        user.debug_prepared_query("UPDATE RecordChunks SET seq=-seq WHERE seq IN (1, 2)", ArgumentList({}));
+        user.debug_prepared_query("UPDATE RecordChunks SET seq=3+seq WHERE seq<0", ArgumentList({}));
+
+        // export writes a chunked record's line a chunk at a time, so a bad
+        // chunk after the first has to stop it rather than be skipped
+        std::string second = user.debug_prepared_query("SELECT chunk FROM RecordChunks WHERE seq=2", ArgumentList({}))[0][0];
+        std::string corrupt = second;
+        corrupt[corrupt.size() / 2] ^= 0x01;
+        user.debug_prepared_query("UPDATE RecordChunks SET chunk=? WHERE seq=2", ArgumentList({DBArgument::blob(corrupt)}));
+        try {
+            std::ostringstream partial;
+            bulk_export(user, partial, 2, NULL);
+            std::cout << "Failed chunked record test: a corrupt chunk was exported\n";
+            return 1;
+        } catch(std::runtime_error&) {
+        }
+        user.debug_prepared_query("UPDATE RecordChunks SET chunk=? WHERE seq=2", ArgumentList({DBArgument::blob(second)}));
+
+        user.debug_prepared_query("DELETE FROM RecordChunks WHERE seq=3", ArgumentList({}));
+        if(testInvalidRecordReading(user, "chunked") == 1) return 1;
+        // a record found short of chunks before any of it is written out is
+        // skipped whole, and the export carries on
+        std::ostringstream skipped_out;
+        BulkStats skipped = bulk_export(user, skipped_out, 2, NULL);
+        std::istringstream skipped_lines(skipped_out.str());
+        std::string line;
+        size_t lines = 0;
+        while(std::getline(skipped_lines, line)) {
+            if(parse_json_object(line).get("name") == "chunked") {
+                break;
+            }
+            lines++;
+        }
+        if(skipped.failures != 1 || lines != skipped.records || skipped.records == 0) {
+            std::cout << "Failed chunked record test: a record missing chunks was not skipped cleanly\n";
+            return 1;
+        }
+
+        // replacing or deleting a chunked record removes its chunks
+        user.edit_record("chunked", "small");
+        if(user.retrieve_record("chunked") != "small") {
+            std::cout << "Failed chunked record test: edited record read back wrong\n";
+            return 1;
+        }
+        user.delete_record("chunked");
+        user.delete_record("chunked empty");
+        chunks = user.debug_prepared_query("SELECT COUNT(*) FROM RecordChunks", ArgumentList({}));
+        if(chunks[0][0] != "0") {
+            std::cout << "Failed chunked record test: " << chunks[0][0] << " chunks left behind\n";
+            return 1;
+        }
+    } catch(std::exception& e) {
+        std::cout << "Failed chunked record test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testRecordRanges(AuthenticatedDBUser& user) {
+    // ranges of a record large enough to be chunked must match the same
+    // ranges of its contents, without reading the chunks outside them
+    const size_t chunk = AuthenticatedDBUser::RECORD_CHUNK_SIZE;
+    std::string contents;
+    for(size_t i = 0; i < 2 * chunk + chunk / 2; i++) {
+        contents += static_cast<char>('a' + (i * 31 + i / 97) % 26);
+    }
+    std::vector<std::pair<size_t, size_t>> ranges({
+        {0, 16}, {chunk - 5, 10}, {chunk, chunk}, {2 * chunk + 7, 1000000}, {contents.size() - 1, 5},
+        {contents.size(), 5}, {contents.size() + 100, 5}, {0, std::string::npos}, {12, 0}
+    });
+    try {
+        user.create_record("ranged", contents);
+        user.create_record("ranged small", "a small record");
+        for(size_t i = 0; i < ranges.size(); i++) {
+            size_t offset = ranges[i].first;
+            std::string expected = offset < contents.size() ? contents.substr(offset, ranges[i].second) : "";
+            if(user.retrieve_record_range("ranged", offset, ranges[i].second) != expected) {
+                std::cout << "Failed record range test: wrong contents for [" << offset << ", +" << ranges[i].second << ")\n";
+                return 1;
+            }
+        }
+        if(user.retrieve_record_range("ranged small", 2, 5) != "small"
+           || user.retrieve_record_range("ranged small", 50, 5) != "") {
+            std::cout << "Failed record range test: wrong contents for an unchunked record\n";
+            return 1;
+        }
+
+        // with the last chunk corrupted, only ranges that reach it fail
+        user.debug_prepared_query("UPDATE RecordChunks SET chunk=substr(chunk, 1, 40)"
+                                  " || CASE substr(chunk, 41, 1) WHEN X'00' THEN X'01' ELSE X'00' END"
+                                  " || substr(chunk, 42) WHERE seq=2", ArgumentList({}));
+        if(user.retrieve_record_range("ranged", chunk - 5, 10) != contents.substr(chunk - 5, 10)) {
+            std::cout << "Failed record range test: a range read a chunk outside itself\n";
+            return 1;
+        }
+        try {
+            user.retrieve_record_range("ranged", 2 * chunk, 10);
+            std::cout << "Failed record range test: a corrupted chunk was read\n";
+            return 1;
+        } catch(std::runtime_error& e) {
+        }
+
+        // rewriting the record rechunks it
+        user.edit_record("ranged", contents + contents);
+        if(user.retrieve_record_range("ranged", contents.size() - 3, 6) != contents.substr(contents.size() - 3) + contents.substr(0, 3)) {
+            std::cout << "Failed record range test: wrong contents after an edit\n";
+            return 1;
+        }
+        user.delete_record("ranged");
+        user.delete_record("ranged small");
+    } catch(std::exception& e) {
+        std::cout << "Failed record range test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testRecordAppendPatch(AuthenticatedDBUser& user) {
+    // appends and patches must match the same edits made to a plain string,
+    // and must leave the chunks they don't touch exactly as they were
+    const size_t chunk = AuthenticatedDBUser::RECORD_CHUNK_SIZE;
+    std::string small = "log:";
+    std::string large(2 * chunk + 100, 'x');
+    auto stored_chunks = [&user]() {
+        DBTable rows = user.debug_prepared_query("SELECT seq, hex(chunk) FROM RecordChunks ORDER BY seq", ArgumentList({}));
+        std::vector<std::string> chunks;
+        for(size_t i = 0; i < rows.size(); i++) {
+            chunks.push_back(rows[i][1]);
+        }
+        return chunks;
+    };
+    try {
+        user.create_record("appended", small);
+        user.append_record("appended", " one");
+        user.patch_record("appended", 0, "LOG");
+        user.patch_record("appended", 8, " two");
+        small = "LOG: one two";
+        if(user.retrieve_record("appended") != small) {
+            std::cout << "Failed append/patch test: small record read back as '" << user.retrieve_record("appended") << "'\n";
+            return 1;
+        }
+        try {
+            user.patch_record("appended", small.size() + 1, "gap");
+            std::cout << "Failed append/patch test: patched past the end of a record\n";
+            return 1;
+        } catch(std::runtime_error& e) {
+        }
+
+        user.create_record("large appended", large);
+        std::vector<std::string> before = stored_chunks();
+        user.append_record("large appended", "tail");
+        large += "tail";
+        std::vector<std::string> after = stored_chunks();
+        if(after.size() != 3 || after[0] != before[0] || after[1] != before[1] || after[2] == before[2]) {
+            std::cout << "Failed append/patch test: an append rewrote more than the last chunk\n";
+            return 1;
+        }
+
+        // a patch across a chunk boundary that also runs past the end
+        std::string patch(chunk, 'p');
+        user.patch_record("large appended", 2 * chunk + 50, patch);
+        large.resize(2 * chunk + 50);
+        large += patch;
+        std::vector<std::string> patched = stored_chunks();
+        if(patched.size() != 4 || patched[0] != after[0] || patched[1] != after[1]
+           || user.retrieve_record("large appended") != large) {
+            std::cout << "Failed append/patch test: large record read back wrong after a patch\n";
+            return 1;
+        }
+
+        // appending a full chunk's worth adds chunks, and a small record
+        // that outgrows one chunk becomes chunked
+        user.append_record("large appended", patch);
+        large += patch;
+        user.append_record("appended", patch);
+        small += patch;
+        if(user.retrieve_record("large appended") != large || user.retrieve_record("appended") != small
+           || stored_chunks().size() != 5 + 2) {
+            std::cout << "Failed append/patch test: records read back wrong after growing\n";
+            return 1;
+        }
+
+        // a chunk put back as it was before a patch must not pass for the
+        // current one, even though it is the same size and position
+        // only "large appended" has a fourth chunk
+        DBTable id = user.debug_prepared_query("SELECT owner, name FROM RecordChunks WHERE seq=3", ArgumentList({}));
+        auto first_chunk = [&]() {
+            return user.debug_prepared_query("SELECT chunk FROM RecordChunks WHERE owner=? AND name=? AND seq=0",
+                                             ArgumentList({DBArgument::blob(id[0][0]), DBArgument::blob(id[0][1])}))[0][0];
+        };
+        auto put_first_chunk = [&](const std::string& ct) {
+            user.debug_prepared_query("UPDATE RecordChunks SET chunk=? WHERE owner=? AND name=? AND seq=0",
+                                      ArgumentList({DBArgument::blob(ct), DBArgument::blob(id[0][0]), DBArgument::blob(id[0][1])}));
+        };
+        std::string stale = first_chunk();
+        user.patch_record("large appended", 10, "PATCH");
+        large.replace(10, 5, "PATCH");
+        std::string current = first_chunk();
+        put_first_chunk(stale);
+        try {
+            user.retrieve_record("large appended");
+            std::cout << "Failed append/patch test: a chunk from before a patch was accepted\n";
+            return 1;
+        } catch(std::runtime_error&) {
+        }
+        put_first_chunk(current);
+        if(user.retrieve_record("large appended") != large) {
+            std::cout << "Failed append/patch test: large record read back wrong after a patch in place\n";
+            return 1;
+        }
+        user.delete_record("appended");
+        user.delete_record("large appended");
+    } catch(std::exception& e) {
+        std::cout << "Failed append/patch test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testCompressionCodec() {
+    // round trips through the LZ codec, including long runs (overlapping
+    // matches), long literals, and data with nothing to match
+    std::string text;
+    for(int i = 0; text.size() < 100000; i++) {
+        text += "line " + std::to_string(i % 1000) + ": the quick brown fox jumps over the lazy dog\n";
+    }
+    std::string random = crypto::_impl_details::bytes_to_string(crypto::random_block(70000));
+    std::vector<std::string> inputs({text, std::string(5000, 'a'), text.substr(0, 300) + random.substr(0, 40000) + text,
+                                     std::string(64, 'z')});
+    for(size_t i = 0; i < inputs.size(); i++) {
+        std::string encoded;
+        if(!compression::compress(inputs[i], compression::CODEC_LZ, encoded) || encoded.size() >= inputs[i].size()
+           || compression::decompress(encoded) != inputs[i]) {
+            std::cout << "Failed compression test: input " << i << " did not compress and round-trip\n";
+            return 1;
+        }
+    }
+
+    // compression is skipped when it can't help, and a corrupted stream is
+    // refused rather than decoded
+    std::string encoded;
+    if(compression::compress(random, compression::CODEC_LZ, encoded) || compression::compress("short", compression::CODEC_LZ, encoded)
+       || compression::compress(text, compression::CODEC_NONE, encoded)) {
+        std::cout << "Failed compression test: compressed data that should have been left alone\n";
+        return 1;
+    }
+    compression::compress(text, compression::CODEC_LZ, encoded);
+    for(size_t cut = 1; cut < 40; cut += 7) {
+        try {
+            compression::decompress(encoded.substr(0, encoded.size() - cut));
+            std::cout << "Failed compression test: a truncated stream was decoded\n";
+            return 1;
+        } catch(std::runtime_error& e) {
+        }
+    }
+    return 0;
+}
+
+int testCompressedRecords(const std::string& u, const std::string& p) {
+    std::string text;
+    for(int i = 0; text.size() < 3 * AuthenticatedDBUser::RECORD_CHUNK_SIZE + AuthenticatedDBUser::RECORD_CHUNK_SIZE / 2; i++) {
+        text += "entry " + std::to_string(i) + ": nothing to report\n";
+    }
+    std::string random = crypto::_impl_details::bytes_to_string(crypto::random_block(5000));
+    try {
+        // the codec is read when a user signs in
+        DB("runtests.db").set_record_codec(compression::CODEC_LZ);
+        AuthenticatedDBUser user(u, p, "runtests.db");
+        user.create_record("compressed", text.substr(0, 20000));
+        user.create_record("compressed chunked", text);
+        user.create_record("incompressible", random);
+        user.append_record("compressed chunked", "one more entry\n");
+
+        DBTable stored = user.debug_prepared_query("SELECT hex(substr(record, 1, 1)), length(record) FROM Records"
+                                                   " ORDER BY rowid DESC LIMIT 3", ArgumentList({}));
+        DBTable chunks = user.debug_prepared_query("SELECT COUNT(*), SUM(length(chunk)) FROM RecordChunks"
+                                                   " WHERE substr(chunk, 1, 1)=X'83'", ArgumentList({}));
+        if(stored[0][0] != "81" || stored[2][0] != "83" || std::stoul(stored[2][1]) > 20000 / 2
+           || chunks[0][0] != "4" || std::stoul(chunks[0][1]) > text.size() / 2) {
+            std::cout << "Failed compressed record test: records were not stored as expected\n";
+            return 1;
+        }
+        if(user.retrieve_record("compressed") != text.substr(0, 20000) || user.retrieve_record("incompressible") != random
+           || user.retrieve_record("compressed chunked") != text + "one more entry\n"
+           || user.retrieve_record_range("compressed chunked", 100000, 50) != text.substr(100000, 50)) {
+            std::cout << "Failed compressed record test: contents did not round-trip\n";
+            return 1;
+        }
+
+        // records keep their own codec tag, so switching back leaves them readable
+        DB("runtests.db").set_record_codec(compression::CODEC_NONE);
+        AuthenticatedDBUser plain(u, p, "runtests.db");
+        if(plain.retrieve_record("compressed") != text.substr(0, 20000)) {
+            std::cout << "Failed compressed record test: a compressed record was unreadable after a codec change\n";
+            return 1;
+        }
+        plain.delete_records(std::vector<std::string>({"compressed", "compressed chunked", "incompressible"}));
+    } catch(std::exception& e) {
+        std::cout << "Failed compressed record test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    return 0;
+}
+
+int testStatistics(AuthenticatedDBUser& user) {
+    // every latency falls in a bucket whose range holds it, and which is
+    // no more than a quarter of its floor wide
+    for(std::uint64_t ns = 1; ns < (1ull << 40); ns = ns * 3 + 1) {
+        size_t bucket = metrics::_impl_details::bucket_of(ns);
+        std::uint64_t floor = metrics::_impl_details::bucket_floor(bucket);
+        std::uint64_t next = metrics::_impl_details::bucket_floor(bucket + 1);
+        if(floor > ns || next <= ns || (ns >= 4 && (next - floor) * 4 > floor)) {
+            std::cout << "Failed statistics test: " << ns << "ns put in bucket [" << floor << ", " << next << ")\n";
+            return 1;
+        }
+    }
+
+    metrics::reset();
+    metrics::set_enabled(true);
+    try {
+        user.create_record("stats", "statistics test");
+        user.retrieve_record("stats");
+        user.get_record_names();
+    } catch(std::exception& e) {
+        metrics::set_enabled(false);
+        std::cout << "Failed statistics test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    metrics::set_enabled(false);
+
+    metrics::Summary retrieves = metrics::summarize(metrics::USER_RETRIEVE);
+    metrics::Summary queries = metrics::summarize(metrics::SQL_QUERY);
+    if(metrics::summarize(metrics::USER_CREATE).count != 1 || retrieves.count != 1
+       || metrics::summarize(metrics::USER_LIST).count != 1 || queries.count == 0
+       || metrics::summarize(metrics::CRYPTO_ENCRYPT).count == 0 || metrics::summarize(metrics::CRYPTO_DECRYPT).count == 0) {
+        std::cout << "Failed statistics test: operations were not all counted\n";
+        return 1;
+    }
+    if(retrieves.p50 <= 0 || retrieves.p50 > retrieves.max || retrieves.total < retrieves.max) {
+        std::cout << "Failed statistics test: inconsistent retrieve latencies\n";
+        return 1;
+    }
+    if(metrics::counter(metrics::SQL_ROWS_RETURNED) == 0 || metrics::counter(metrics::CRYPTO_BYTES_ENCRYPTED) == 0) {
+        std::cout << "Failed statistics test: rows and bytes were not counted\n";
+        return 1;
+    }
+
+    // nothing more is counted once collection is off
+    user.retrieve_record("stats");
+    user.delete_record("stats");
+    if(metrics::summarize(metrics::USER_RETRIEVE).count != 1 || metrics::summarize(metrics::USER_DELETE).count != 0
+       || metrics::summarize(metrics::SQL_QUERY).count != queries.count) {
+        std::cout << "Failed statistics test: operations were counted while collection was off\n";
+        return 1;
+    }
+    std::ostringstream report;
+    metrics::report(report);
+    if(report.str().find("retrieve") == std::string::npos) {
+        std::cout << "Failed statistics test: report does not list retrieve\n";
+        return 1;
+    }
+    metrics::reset();
+    return 0;
+}
+
+int testSlowQueryLog() {
+    // values are stripped from statements, while names keep their digits
+    std::string normalized = DB::normalize_sql("SELECT  id FROM\n t2 WHERE a=12 AND b='it''s' AND c=X'00ff' AND d=?");
+    if(normalized != "SELECT id FROM t2 WHERE a=? AND b=? AND c=? AND d=?") {
+        std::cout << "Failed slow query test: normalized SQL was '" << normalized << "'\n";
+        return 1;
+    }
+
+    // a statement that counts its way through a few hundred thousand rows
+    // and scans Keys, which has no index on key, takes well over the
+    // threshold; it is logged with its plan only the first time
+    const std::string slow = "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x+1 FROM c WHERE x<300000)"
+                             " SELECT COUNT(*) FROM c WHERE x NOT IN (SELECT rowid FROM Keys WHERE key=?)";
+    std::ostringstream log;
+    DB::log_slow_queries(1, &log, true);
+    try {
+        DB db("runtests.db");
+        for(int i = 0; i < 2; i++) {
+            db.prepared_query(slow, ArgumentList({DBArgument::blob("none")}));
+        }
+        DB::log_slow_queries(0, NULL, false);
+        db.prepared_query(slow, ArgumentList({DBArgument::blob("none")}));
+    } catch(std::exception& e) {
+        DB::log_slow_queries(0, NULL, false);
+        std::cout << "Failed slow query test: an exception was thrown: " << e.what() << '\n';
+        return 1;
+    }
+    std::string text = log.str();
+    std::string entry = "vm steps: " + DB::normalize_sql(slow) + "\n";
+    size_t first = text.find(entry);
+    size_t second = (first == std::string::npos) ? first : text.find(entry, first + 1);
+    if(first == std::string::npos || second == std::string::npos || text.find(entry, second + 1) != std::string::npos) {
+        std::cout << "Failed slow query test: expected the lookup to be logged twice, while the log was on\n" << text;
+        return 1;
+    }
+    std::string plan = text.substr(first + entry.size(), second - first - entry.size());
+    if(plan.find("SCAN Keys") == std::string::npos || text.substr(second + entry.size()).find("plan:") != std::string::npos) {
+        std::cout << "Failed slow query test: expected the full scan's plan once\n" << text;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,154 @@
+#include <exception>
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(size_t threads) : queued(0), stolen(0) {
+    /*
+    * Start threads workers. A pool of zero threads is allowed, and runs
+    * everything on the thread calling parallel_for.
+    */
+    next_queue = 0;
+    stopping = false;
+    for(size_t i = 0; i < threads; i++) {
+        queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+    }
+    for(size_t i = 0; i < threads; i++) {
+        workers.push_back(std::thread(&ThreadPool::work, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    /*
+    * Let the workers finish whatever is queued, then stop them
+    */
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for(size_t i = 0; i < workers.size(); i++) {
+        workers[i].join();
+    }
+}
+
+bool ThreadPool::take(size_t self, Task& task) {
+    // the newest task on the worker's own queue, whose data is most likely
+    // to still be in cache
+    WorkQueue& queue = *queues[self];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if(queue.tasks.empty()) {
+        return false;
+    }
+    task = std::move(queue.tasks.back());
+    queue.tasks.pop_back();
+    queued--;
+    return true;
+}
+
+bool ThreadPool::steal(size_t self, Task& task) {
+    // the oldest task on any other queue, starting with the next one along so
+    // that thieves spread out rather than all raiding the same queue
+    for(size_t i = 1; i <= queues.size(); i++) {
+        WorkQueue& queue = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if(!queue.tasks.empty()) {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+            queued--;
+            stolen++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::work(size_t self) {
+    Task task;
+    while(true) {
+        if(take(self, task) || steal(self, task)) {
+            task();
+            task = Task();
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(sleep_lock);
+        wake.wait(guard, [this]() { return stopping || queued > 0; });
+        if(stopping && queued == 0) {
+            return;
+        }
+    }
+}
+
+void ThreadPool::parallel_for(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body) {
+    /*
+    * Split [0, count) into ranges of grain items and deal them out across
+    * the workers' queues, then help run them. Too little work to split, or
+    * a pool without workers, just runs body on this thread.
+    */
+    if(grain == 0) {
+        grain = 1;
+    }
+    if(count == 0) {
+        return;
+    }
+    if(workers.empty() || count <= grain) {
+        body(0, count);
+        return;
+    }
+
+    struct Job {
+        std::mutex lock;
+        std::condition_variable done;
+        size_t remaining;
+        std::exception_ptr error;
+    } job;
+    job.remaining = (count + grain - 1) / grain;
+
+    {
+        std::lock_guard<std::mutex> guard(sleep_lock);
+        for(size_t begin = 0; begin < count; begin += grain) {
+            size_t end = (count - begin > grain) ? begin + grain : count;
+            WorkQueue& queue = *queues[next_queue];
+            next_queue = (next_queue + 1) % queues.size();
+            std::lock_guard<std::mutex> queue_guard(queue.lock);
+            queue.tasks.push_back([&job, &body, begin, end]() {
+                std::exception_ptr error;
+                try {
+                    body(begin, end);
+                } catch(...) {
+                    error = std::current_exception();
+                }
+                // the last task out wakes parallel_for, which may then
+                // return and destroy job, so nothing may touch it after
+                std::lock_guard<std::mutex> guard(job.lock);
+                if(error && !job.error) {
+                    job.error = error;
+                }
+                if(--job.remaining == 0) {
+                    job.done.notify_all();
+                }
+            });
+            queued++;
+        }
+    }
+    wake.notify_all();
+
+    // run tasks here too until none are left to start, then wait for the
+    // ones still running on the workers
+    Task task;
+    while(steal(queues.size() - 1, task)) {
+        task();
+        task = Task();
+    }
+    std::unique_lock<std::mutex> guard(job.lock);
+    job.done.wait(guard, [&job]() { return job.remaining == 0; });
+    if(job.error) {
+        std::rethrow_exception(job.error);
+    }
+}
+
+size_t ThreadPool::size() const {
+    return workers.size();
+}
+
+size_t ThreadPool::steals() const {
+    return stolen;
+}
@@ -0,0 +1,58 @@
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+#ifndef __THREADPOOL_H
+#define __THREADPOOL_H
+
+/*
+* ThreadPool: A fixed set of worker threads for splitting CPU-heavy loops,
+* such as decrypting every one of a user's record names, across cores.
+* Each worker has its own queue of tasks. A worker takes its newest task
+* first, and once its own queue is empty it steals the oldest task from
+* another worker's queue, so a worker whose share turned out to be cheap
+* helps with the rest rather than sitting idle.
+* The thread calling parallel_for works through the tasks too, so a pool of
+* N threads runs N + 1 tasks at a time.
+*/
+class ThreadPool {
+    private:
+        typedef std::function<void()> Task;
+
+        struct WorkQueue {
+            std::mutex lock;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<std::unique_ptr<WorkQueue>> queues;
+        std::vector<std::thread> workers;
+        std::mutex sleep_lock;
+        std::condition_variable wake;
+        std::atomic<size_t> queued; // tasks waiting in any queue
+        std::atomic<size_t> stolen;
+        size_t next_queue; // where parallel_for hands out its next task
+        bool stopping;
+
+        void work(size_t self);
+        bool take(size_t self, Task& task);
+        bool steal(size_t self, Task& task);
+    public:
+        ThreadPool(size_t threads);
+        ThreadPool(const ThreadPool&) = delete;
+        ~ThreadPool();
+
+        // Call body(begin, end) over [0, count) in ranges of about grain
+        // items, and return once every range is done. If any call throws,
+        // the first exception is rethrown here after the rest have finished.
+        void parallel_for(size_t count, size_t grain, const std::function<void(size_t, size_t)>& body);
+
+        size_t size() const;
+        size_t steals() const; // tasks not run by the worker they were dealt to
+};
+
+#endif